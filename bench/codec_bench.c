@@ -0,0 +1,304 @@
+//
+//  codec_bench.c
+//  te
+//
+//  Compares the map codecs and filters on the chunks of real maps, or of
+//  generated layers when no maps are given, reporting the compression ratio
+//  and throughput of each, and the throughput of the checksum every chunk is
+//  checked against when loaded. Use it to pick a project's map_codec and
+//  layer_filter.
+//
+//  Build:
+//      cc -O2 bench/codec_bench.c source/map.c source/rle.c source/lz.c
+//          source/jobs.c source/crc.c source/trace.c -Isource -lSDL3
+//          -o codec_bench
+//
+//  Usage:
+//      codec_bench [map.temap ...]
+//
+
+#include "map.h"
+#include "crc.h"
+#include "lz.h"
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ITERATIONS 10
+#define SYNTHETIC_SIZE 1024 // tiles wide and high
+
+typedef enum {
+    LAYER_SPARSE,
+    LAYER_BRICK,
+    LAYER_CHECKER,
+    LAYER_RANDOM,
+    NUM_LAYER_TYPES
+} LayerType;
+
+static const char * layer_names[NUM_LAYER_TYPES] = {
+    "sparse", "brick", "checker", "random"
+};
+
+/// The chunks of one map or generated layer, each CHUNK_TILES long.
+typedef struct {
+    const char * name;
+    GID * tiles;
+    size_t num_chunks;
+} Sample;
+
+static Uint32 _seed = 1;
+
+static Uint32 Random(void)
+{
+    _seed = _seed * 1664525 + 1013904223;
+    return _seed >> 8;
+}
+
+static GID SyntheticTile(LayerType type, int x, int y)
+{
+    switch ( type ) {
+        case LAYER_SPARSE: // Empty with the occasional object.
+            return Random() % 64 == 0 ? (GID)(1 + Random() % 64) : 0;
+        case LAYER_BRICK: { // Offset every other row, mortar every 4th.
+            int offset = (y / 2) % 2 ? 2 : 0;
+            return (GID)(y % 2 == 0 ? 10 : (x + offset) % 4 == 0 ? 11 : 12);
+        }
+        case LAYER_CHECKER:
+            return (GID)(20 + (x + y) % 2);
+        default:
+            return (GID)Random();
+    }
+}
+
+static bool AllocSample(Sample * sample, size_t num_chunks)
+{
+    sample->num_chunks = num_chunks;
+    sample->tiles = calloc(num_chunks * CHUNK_TILES, sizeof(GID));
+    return sample->tiles != NULL;
+}
+
+static bool MakeSyntheticSample(Sample * sample, LayerType type)
+{
+    const int chunks_wide = SYNTHETIC_SIZE / CHUNK_SIZE;
+    if ( !AllocSample(sample, (size_t)(chunks_wide * chunks_wide)) ) {
+        return false;
+    }
+
+    sample->name = layer_names[type];
+
+    GID * out = sample->tiles;
+    for ( int cy = 0; cy < chunks_wide; cy++ ) {
+        for ( int cx = 0; cx < chunks_wide; cx++ ) {
+            for ( int y = 0; y < CHUNK_SIZE; y++ ) {
+                for ( int x = 0; x < CHUNK_SIZE; x++ ) {
+                    *out++ = SyntheticTile(type,
+                                           cx * CHUNK_SIZE + x,
+                                           cy * CHUNK_SIZE + y);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/// Gather every chunk of every layer. Tiles past the map edge are empty,
+/// as they are when the map saves them.
+static bool MakeMapSample(Sample * sample, const char * path)
+{
+    Map map;
+    if ( !LoadMap(&map, path) ) {
+        fprintf(stderr, "Could not load '%s'\n", path);
+        return false;
+    }
+
+    size_t per_layer = (size_t)map.chunks_w * (size_t)map.chunks_h;
+    if ( !AllocSample(sample, per_layer * map.num_layers) ) {
+        FreeMap(&map);
+        return false;
+    }
+
+    sample->name = path;
+
+    GID * out = sample->tiles;
+    for ( int layer = 0; layer < map.num_layers; layer++ ) {
+        for ( int cy = 0; cy < map.chunks_h; cy++ ) {
+            for ( int cx = 0; cx < map.chunks_w; cx++ ) {
+                for ( int y = 0; y < CHUNK_SIZE; y++ ) {
+                    for ( int x = 0; x < CHUNK_SIZE; x++ ) {
+                        int map_x = cx * CHUNK_SIZE + x;
+                        int map_y = cy * CHUNK_SIZE + y;
+                        *out++ = IsValidPosition(&map, map_x, map_y)
+                            ? GetMapTile(&map, map_x, map_y, layer)
+                            : 0;
+                    }
+                }
+            }
+        }
+    }
+
+    FreeMap(&map);
+    return true;
+}
+
+static double Seconds(Uint64 start)
+{
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    return (double)elapsed / (double)SDL_GetPerformanceFrequency();
+}
+
+/// Encode one chunk, returning its size in bytes, or 0 if it doesn't
+/// compress and the map would store it as is.
+static size_t Encode(MapCodec codec, MapFilter filter, RLEKernel kernel,
+                     const GID * tiles, Uint8 * dest)
+{
+    const size_t tiles_size = CHUNK_TILES * sizeof(GID);
+
+    GID filtered[CHUNK_TILES];
+    if ( filter != MAP_FILTER_NONE ) {
+        FilterTiles(filter, tiles, filtered, CHUNK_TILES);
+        tiles = filtered;
+    }
+
+    if ( codec == MAP_CODEC_LZ ) {
+        return LZ_Encode(tiles, CHUNK_TILES, dest, tiles_size - 1);
+    }
+
+    size_t n = RLE_Encode(kernel, tiles, CHUNK_TILES,
+                          (Uint16 *)dest, CHUNK_TILES - 1);
+    return n * sizeof(Uint16);
+}
+
+static bool Decode(MapCodec codec, MapFilter filter, RLEKernel kernel,
+                   const Uint8 * src, size_t size, GID * dest)
+{
+    GID filtered[CHUNK_TILES];
+    GID * decoded = filter != MAP_FILTER_NONE ? filtered : dest;
+    bool ok;
+
+    if ( codec == MAP_CODEC_LZ ) {
+        ok = LZ_Decode(src, size, decoded, CHUNK_TILES);
+    } else {
+        ok = RLE_Decode(kernel, (const Uint16 *)src, size / sizeof(Uint16),
+                        decoded, CHUNK_TILES);
+    }
+
+    if ( ok && decoded != dest ) {
+        UnfilterTiles(filter, decoded, dest, CHUNK_TILES);
+    }
+
+    return ok;
+}
+
+static bool RunSample(const Sample * sample)
+{
+    const size_t chunk_size = CHUNK_TILES * sizeof(GID);
+    const size_t total = sample->num_chunks * chunk_size;
+    const double mb = (double)(total * ITERATIONS) / 1e6;
+    const RLEKernel kernel = RLE_GetKernel();
+
+    Uint8 * encoded = malloc(total);
+    size_t * sizes = malloc(sample->num_chunks * sizeof(*sizes));
+    GID * decoded = malloc(total);
+    bool ok = encoded && sizes && decoded;
+
+    for ( int c = 0; ok && c < MAP_NUM_CODECS * MAP_NUM_FILTERS; c++ ) {
+        MapCodec codec = (MapCodec)(c / MAP_NUM_FILTERS);
+        MapFilter filter = (MapFilter)(c % MAP_NUM_FILTERS);
+        size_t encoded_total = 0;
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        for ( int it = 0; it < ITERATIONS; it++ ) {
+            encoded_total = 0;
+            for ( size_t i = 0; i < sample->num_chunks; i++ ) {
+                size_t n = Encode(codec, filter, kernel,
+                                  sample->tiles + i * CHUNK_TILES,
+                                  encoded + i * chunk_size);
+                sizes[i] = n;
+                encoded_total += n ? n : chunk_size;
+            }
+        }
+        double encode_time = Seconds(start);
+
+        start = SDL_GetPerformanceCounter();
+        for ( int it = 0; it < ITERATIONS; it++ ) {
+            for ( size_t i = 0; i < sample->num_chunks; i++ ) {
+                GID * out = decoded + i * CHUNK_TILES;
+                if ( sizes[i] == 0 ) {
+                    memcpy(out, sample->tiles + i * CHUNK_TILES, chunk_size);
+                } else if ( !Decode(codec, filter, kernel,
+                                    encoded + i * chunk_size, sizes[i],
+                                    out) ) {
+                    ok = false;
+                }
+            }
+        }
+        double decode_time = Seconds(start);
+
+        if ( !ok || memcmp(decoded, sample->tiles, total) != 0 ) {
+            fprintf(stderr, "%s: %s/%s did not round trip\n",
+                    sample->name, MapCodecName(codec), MapFilterName(filter));
+            ok = false;
+        }
+
+        printf("%-24s %-6s %-8s %7.1f%% %12.1f %12.1f\n",
+               sample->name,
+               MapCodecName(codec),
+               MapFilterName(filter),
+               100.0 * (double)encoded_total / (double)total,
+               mb / encode_time,
+               mb / decode_time);
+    }
+
+    free(decoded);
+    free(sizes);
+    free(encoded);
+
+    return ok;
+}
+
+/// Checksum each chunk of the sample, as loading does.
+static void RunChecksum(const Sample * sample)
+{
+    const size_t chunk_size = CHUNK_TILES * sizeof(GID);
+    const double mb = (double)(sample->num_chunks * chunk_size * ITERATIONS) / 1e6;
+
+    volatile Uint32 sum = 0; // Keep the work from being optimized out.
+    Uint64 start = SDL_GetPerformanceCounter();
+    for ( int it = 0; it < ITERATIONS; it++ ) {
+        for ( size_t i = 0; i < sample->num_chunks; i++ ) {
+            sum ^= CRC_Compute(sample->tiles + i * CHUNK_TILES, chunk_size);
+        }
+    }
+    double time = Seconds(start);
+
+    printf("%-24s %-6s %-8s %8s %12.1f %12s\n",
+           sample->name, "crc32c", CRC_KernelName(), "-", mb / time, "-");
+}
+
+int main(int argc, char ** argv)
+{
+    printf("%-24s %-6s %-8s %8s %12s %12s\n",
+           "sample", "codec", "filter", "ratio", "enc MB/s", "dec MB/s");
+
+    int status = EXIT_SUCCESS;
+    int num_samples = argc > 1 ? argc - 1 : NUM_LAYER_TYPES;
+
+    for ( int i = 0; i < num_samples; i++ ) {
+        Sample sample = { 0 };
+        bool made = argc > 1
+            ? MakeMapSample(&sample, argv[i + 1])
+            : MakeSyntheticSample(&sample, (LayerType)i);
+
+        if ( !made || !RunSample(&sample) ) {
+            status = EXIT_FAILURE;
+        } else {
+            RunChecksum(&sample);
+        }
+
+        free(sample.tiles);
+    }
+
+    return status;
+}
@@ -0,0 +1,174 @@
+//
+//  rle_bench.c
+//  te
+//
+//  Compares the throughput of the RLE kernels on map chunks filled with
+//  sparse, dense and random tiles, and checks that they agree byte for byte.
+//  The scalar kernel makes the same passes over the data as the original
+//  Compress/Decompress loops in map.c.
+//
+//  Build:
+//      cc -O2 bench/rle_bench.c source/rle.c -Isource -lSDL3 -o rle_bench
+//
+
+#include "map.h"
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_CHUNKS 256 // A 1024 x 1024 layer.
+#define ITERATIONS 20
+
+typedef enum {
+    LAYER_SPARSE,
+    LAYER_DENSE,
+    LAYER_RANDOM,
+    NUM_LAYER_TYPES
+} LayerType;
+
+static const char * layer_names[NUM_LAYER_TYPES] = {
+    "sparse", "dense", "random"
+};
+
+static Uint32 _seed = 1;
+
+static Uint32 Random(void)
+{
+    _seed = _seed * 1664525 + 1013904223;
+    return _seed >> 8;
+}
+
+static void FillLayer(GID * tiles, size_t count, LayerType type)
+{
+    size_t i = 0;
+
+    while ( i < count ) {
+        GID gid;
+        size_t run;
+
+        switch ( type ) {
+            case LAYER_SPARSE: // Empty with the occasional object.
+                gid = Random() % 32 == 0 ? (GID)(1 + Random() % 64) : 0;
+                run = gid ? 1 : 1 + Random() % 128;
+                break;
+            case LAYER_DENSE: // Terrain: short runs from a small tile set.
+                gid = (GID)(1 + Random() % 48);
+                run = 1 + Random() % 8;
+                break;
+            default:
+                gid = (GID)Random();
+                run = 1;
+                break;
+        }
+
+        for ( ; run > 0 && i < count; run--, i++ ) {
+            tiles[i] = gid;
+        }
+    }
+}
+
+static double Seconds(Uint64 start)
+{
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    return (double)elapsed / (double)SDL_GetPerformanceFrequency();
+}
+
+int main(void)
+{
+    const size_t chunk_count = CHUNK_TILES;
+    const size_t total = chunk_count * NUM_CHUNKS;
+    const double mb = (double)(total * sizeof(GID) * ITERATIONS) / 1e6;
+
+    GID * tiles = malloc(total * sizeof(GID));
+    GID * decoded = malloc(total * sizeof(GID));
+    Uint16 * encoded[RLE_NUM_KERNELS];
+    size_t encoded_size[RLE_NUM_KERNELS][NUM_CHUNKS];
+
+    for ( int k = 0; k < RLE_NUM_KERNELS; k++ ) {
+        encoded[k] = malloc(total * sizeof(Uint16));
+    }
+
+    printf("%-8s %-8s %8s %12s %12s\n",
+           "layer", "kernel", "ratio", "enc MB/s", "dec MB/s");
+
+    int status = EXIT_SUCCESS;
+
+    for ( int type = 0; type < NUM_LAYER_TYPES; type++ ) {
+        FillLayer(tiles, total, (LayerType)type);
+
+        for ( int k = 0; k < RLE_NUM_KERNELS; k++ ) {
+            RLEKernel kernel = (RLEKernel)k;
+            if ( !RLE_IsKernelSupported(kernel) ) {
+                continue;
+            }
+
+            size_t encoded_total = 0;
+
+            Uint64 start = SDL_GetPerformanceCounter();
+            for ( int it = 0; it < ITERATIONS; it++ ) {
+                encoded_total = 0;
+                for ( size_t c = 0; c < NUM_CHUNKS; c++ ) {
+                    size_t offset = c * chunk_count;
+                    size_t n = RLE_Encode(kernel,
+                                          tiles + offset, chunk_count,
+                                          encoded[k] + offset, chunk_count);
+                    encoded_size[k][c] = n;
+                    encoded_total += n ? n : chunk_count;
+                }
+            }
+            double encode_time = Seconds(start);
+
+            start = SDL_GetPerformanceCounter();
+            for ( int it = 0; it < ITERATIONS; it++ ) {
+                for ( size_t c = 0; c < NUM_CHUNKS; c++ ) {
+                    size_t offset = c * chunk_count;
+                    if ( encoded_size[k][c] == 0 ) {
+                        // Stored as is by the map code.
+                        memcpy(decoded + offset, tiles + offset,
+                               chunk_count * sizeof(GID));
+                    } else if ( !RLE_Decode(kernel,
+                                            encoded[k] + offset,
+                                            encoded_size[k][c],
+                                            decoded + offset,
+                                            chunk_count) ) {
+                        status = EXIT_FAILURE;
+                    }
+                }
+            }
+            double decode_time = Seconds(start);
+
+            printf("%-8s %-8s %7.1f%% %12.1f %12.1f\n",
+                   layer_names[type],
+                   RLE_KernelName(kernel),
+                   100.0 * (double)encoded_total / (double)total,
+                   mb / encode_time,
+                   mb / decode_time);
+
+            // Every kernel has to match the scalar one exactly.
+            bool match = memcmp(decoded, tiles, total * sizeof(GID)) == 0;
+            for ( size_t c = 0; match && c < NUM_CHUNKS; c++ ) {
+                size_t offset = c * chunk_count;
+                size_t n = encoded_size[k][c];
+                match = n == encoded_size[0][c]
+                    && memcmp(encoded[k] + offset,
+                              encoded[0] + offset,
+                              n * sizeof(Uint16)) == 0;
+            }
+
+            if ( !match ) {
+                fprintf(stderr, "%s: %s output differs from scalar\n",
+                        layer_names[type], RLE_KernelName(kernel));
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    for ( int k = 0; k < RLE_NUM_KERNELS; k++ ) {
+        free(encoded[k]);
+    }
+    free(decoded);
+    free(tiles);
+
+    return status;
+}
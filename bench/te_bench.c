@@ -0,0 +1,490 @@
+//
+//  te_bench.c
+//  te
+//
+//  Times the editor's map operations without a window: saving, saving an
+//  edit, loading, compressing and decompressing chunks, resizing, flood fill,
+//  and recording, undoing and redoing a change. Each runs on generated maps of
+//  several sizes and contents, and is reported as CSV in nanoseconds per tile
+//  and megabytes of tiles per second, so runs can be compared in a
+//  spreadsheet.
+//
+//  Build:
+//      ./build_bench.sh
+//
+//  Usage:
+//      te_bench results.csv [max size]
+//
+//  Maps are written to te_bench.temap in the working directory. The CSV goes
+//  to its own file as loading maps prints to stdout.
+//
+
+#include "editor.h"
+#include "jobs.h"
+#include "lz.h"
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAP_PATH "te_bench.temap"
+#define NUM_LAYERS 2
+#define MIN_SECONDS 0.25 // Each operation repeats for at least this long.
+
+// Changes recorded for undo are kept to a region of this size, a million
+// tiles, so that the largest map's don't take gigabytes.
+#define EDIT_SIZE 1024
+
+typedef enum {
+    CONTENT_EMPTY,
+    CONTENT_NOISE, // Every tile random.
+    CONTENT_STRUCTURED, // Walled rooms.
+    CONTENT_TERRAIN, // Patches of ground, scattered objects on top.
+    NUM_CONTENTS
+} Content;
+
+static const char * _content_names[NUM_CONTENTS] = {
+    "empty", "noise", "structured", "terrain"
+};
+
+static const int _sizes[] = { 256, 1024, 4096 };
+
+static Uint32 _seed = 1;
+
+// Static: an EditorMap carries its undo history.
+static EditorMap _map;
+static const char * _content;
+static FILE * _csv;
+
+static Uint32 Random(void)
+{
+    _seed = _seed * 1664525 + 1013904223;
+    return _seed >> 8;
+}
+
+/// Deterministic noise, for terrain patches that look the same every run.
+static Uint32 Hash(int x, int y)
+{
+    Uint32 h = (Uint32)x * 374761393u + (Uint32)y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+}
+
+static GID GenerateTile(Content content, int x, int y, int layer)
+{
+    switch ( content ) {
+        case CONTENT_EMPTY:
+            return 0;
+        case CONTENT_NOISE:
+            return (GID)(1 + Random() % 1024);
+        case CONTENT_STRUCTURED: {
+            bool wall = x % 16 == 0 || y % 16 == 0;
+            bool door = x % 16 == 8 || y % 16 == 8;
+            if ( layer == 0 ) {
+                return wall && !door ? 2 : 1;
+            }
+            return !wall && x % 16 == 4 && y % 16 == 4 ? 3 : 0; // Furniture
+        }
+        case CONTENT_TERRAIN:
+            if ( layer == 0 ) {
+                // Ground in 32 x 32 patches of four kinds, with some variety.
+                GID ground = (GID)(10 + 4 * (Hash(x / 32, y / 32) % 4));
+                return (GID)(ground + (Random() % 8 == 0 ? Random() % 4 : 0));
+            }
+            return Random() % 32 == 0 ? (GID)(100 + Random() % 64) : 0;
+        default:
+            return 0;
+    }
+}
+
+static bool GenerateMap(Content content, int size)
+{
+    remove(MAP_PATH);
+    if ( !CreateMap(MAP_PATH, (Uint16)size, (Uint16)size, NUM_LAYERS)
+        || !LoadMap(&_map.map, MAP_PATH) ) {
+        fprintf(stderr, "%s: could not create a %d x %d map\n",
+                __func__, size, size);
+        return false;
+    }
+
+    _seed = 1;
+    for ( int layer = 0; layer < NUM_LAYERS; layer++ ) {
+        for ( int y = 0; y < size; y++ ) {
+            for ( int x = 0; x < size; x++ ) {
+                GID gid = GenerateTile(content, x, y, layer);
+                if ( gid != 0 ) {
+                    SetMapTile(&_map.map, x, y, layer, gid);
+                }
+            }
+        }
+    }
+
+    _content = _content_names[content];
+    return true;
+}
+
+static double Seconds(Uint64 start)
+{
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    return (double)elapsed / (double)SDL_GetPerformanceFrequency();
+}
+
+static void Report(const char * operation, size_t tiles, int iterations,
+                   double seconds)
+{
+    double per_run = seconds / iterations;
+    double bytes = (double)(tiles * sizeof(GID));
+
+    fprintf(_csv, "%s,%s,%d,%d,%d,%zu,%d,%.2f,%.1f\n",
+           operation,
+           _content,
+           _map.map.width,
+           _map.map.height,
+           _map.map.num_layers,
+           tiles,
+           iterations,
+           per_run * 1e9 / (double)SDL_max(tiles, 1),
+           bytes / per_run / 1e6);
+}
+
+static size_t MapTiles(void)
+{
+    return (size_t)_map.map.width * _map.map.height * _map.map.num_layers;
+}
+
+#ifdef __APPLE__
+#pragma mark - Files
+#endif
+
+/// The first save of a generated map, when every chunk is encoded.
+static bool BenchSave(void)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    bool ok = SaveMap(&_map.map, MAP_PATH);
+    Report("save", MapTiles(), 1, Seconds(start));
+
+    return ok;
+}
+
+/// Saves of one tile edit each, which only write the chunk it's in and a new
+/// chunk table, and now and then the whole file.
+static bool BenchSaveEdit(void)
+{
+    GID gid = GetMapTile(&_map.map, 0, 0, 0);
+    int iterations = 0;
+    bool ok = true;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    do {
+        SetMapTile(&_map.map, 0, 0, 0, (GID)(gid + 1 + iterations % 2));
+        ok = SaveMap(&_map.map, MAP_PATH);
+        iterations++;
+    } while ( ok && Seconds(start) < MIN_SECONDS );
+
+    Report("save edit", 1, iterations, Seconds(start));
+    SetMapTile(&_map.map, 0, 0, 0, gid);
+
+    return ok;
+}
+
+static bool BenchLoad(void)
+{
+    int iterations = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    do {
+        Map map = { 0 };
+        if ( !LoadMap(&map, MAP_PATH) ) {
+            return false;
+        }
+        FreeMap(&map);
+        iterations++;
+    } while ( Seconds(start) < MIN_SECONDS );
+
+    Report("load", MapTiles(), iterations, Seconds(start));
+    return true;
+}
+
+#ifdef __APPLE__
+#pragma mark - Codecs
+#endif
+
+/// Every chunk of every layer, each CHUNK_TILES long, as the map saves them.
+static GID * GatherChunks(size_t * num_chunks)
+{
+    Map * map = &_map.map;
+    *num_chunks = (size_t)map->chunks_w * (size_t)map->chunks_h * map->num_layers;
+
+    GID * tiles = malloc(*num_chunks * CHUNK_TILES * sizeof(GID));
+    if ( tiles == NULL ) {
+        return NULL;
+    }
+
+    GID * out = tiles;
+    for ( int layer = 0; layer < map->num_layers; layer++ ) {
+        for ( int cy = 0; cy < map->chunks_h; cy++ ) {
+            for ( int cx = 0; cx < map->chunks_w; cx++ ) {
+                for ( int y = 0; y < CHUNK_SIZE; y++ ) {
+                    for ( int x = 0; x < CHUNK_SIZE; x++ ) {
+                        int map_x = cx * CHUNK_SIZE + x;
+                        int map_y = cy * CHUNK_SIZE + y;
+                        *out++ = IsValidPosition(map, map_x, map_y)
+                            ? GetMapTile(map, map_x, map_y, layer)
+                            : 0;
+                    }
+                }
+            }
+        }
+    }
+
+    return tiles;
+}
+
+/// Encode one chunk, returning its size in bytes, or 0 if it doesn't
+/// compress and the map would store it as is.
+static size_t Encode(MapCodec codec, RLEKernel kernel,
+                     const GID * tiles, Uint8 * dest)
+{
+    if ( codec == MAP_CODEC_LZ ) {
+        return LZ_Encode(tiles, CHUNK_TILES, dest, CHUNK_TILES * sizeof(GID) - 1);
+    }
+
+    size_t n = RLE_Encode(kernel, tiles, CHUNK_TILES,
+                          (Uint16 *)dest, CHUNK_TILES - 1);
+    return n * sizeof(Uint16);
+}
+
+static bool Decode(MapCodec codec, RLEKernel kernel,
+                   const Uint8 * src, size_t size, GID * dest)
+{
+    if ( codec == MAP_CODEC_LZ ) {
+        return LZ_Decode(src, size, dest, CHUNK_TILES);
+    }
+
+    return RLE_Decode(kernel, (const Uint16 *)src, size / sizeof(Uint16),
+                      dest, CHUNK_TILES);
+}
+
+static bool BenchCodecs(void)
+{
+    const size_t chunk_size = CHUNK_TILES * sizeof(GID);
+    const RLEKernel kernel = RLE_GetKernel();
+
+    size_t num_chunks;
+    GID * tiles = GatherChunks(&num_chunks);
+    Uint8 * encoded = malloc(num_chunks * chunk_size);
+    size_t * sizes = malloc(num_chunks * sizeof(*sizes));
+    GID decoded[CHUNK_TILES];
+    bool ok = tiles && encoded && sizes;
+
+    for ( int c = 0; ok && c < MAP_NUM_CODECS; c++ ) {
+        MapCodec codec = (MapCodec)c;
+        char name[32];
+
+        int iterations = 0;
+        Uint64 start = SDL_GetPerformanceCounter();
+        do {
+            for ( size_t i = 0; i < num_chunks; i++ ) {
+                sizes[i] = Encode(codec, kernel,
+                                  tiles + i * CHUNK_TILES,
+                                  encoded + i * chunk_size);
+            }
+            iterations++;
+        } while ( Seconds(start) < MIN_SECONDS );
+
+        snprintf(name, sizeof(name), "compress %s", MapCodecName(codec));
+        Report(name, num_chunks * CHUNK_TILES, iterations, Seconds(start));
+
+        // Chunks that didn't compress are stored as is and never decoded.
+        size_t num_encoded = 0;
+        for ( size_t i = 0; i < num_chunks; i++ ) {
+            num_encoded += sizes[i] != 0;
+        }
+
+        if ( num_encoded == 0 ) {
+            continue;
+        }
+
+        iterations = 0;
+        start = SDL_GetPerformanceCounter();
+        do {
+            for ( size_t i = 0; ok && i < num_chunks; i++ ) {
+                if ( sizes[i] != 0 ) {
+                    ok = Decode(codec, kernel, encoded + i * chunk_size,
+                                sizes[i], decoded);
+                }
+            }
+            iterations++;
+        } while ( ok && Seconds(start) < MIN_SECONDS );
+
+        snprintf(name, sizeof(name), "decompress %s", MapCodecName(codec));
+        Report(name, num_encoded * CHUNK_TILES, iterations, Seconds(start));
+
+        if ( !ok ) {
+            fprintf(stderr, "%s: %s failed to decode\n",
+                    __func__, MapCodecName(codec));
+        }
+    }
+
+    free(sizes);
+    free(encoded);
+    free(tiles);
+
+    return ok;
+}
+
+#ifdef __APPLE__
+#pragma mark - Editing
+#endif
+
+/// Grow the map by a chunk each way and shrink it back.
+static void BenchResize(void)
+{
+    Map * map = &_map.map;
+    Uint16 w = map->width;
+    Uint16 h = map->height;
+
+    int iterations = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    do {
+        ResizeMap(map, (Uint16)(w + CHUNK_SIZE), (Uint16)(h + CHUNK_SIZE));
+        ResizeMap(map, w, h);
+        iterations++;
+    } while ( Seconds(start) < MIN_SECONDS );
+
+    Report("resize", MapTiles(), iterations, Seconds(start));
+}
+
+static size_t _tiles_changed;
+
+static void RecordTileRun(int x, int y, int layer, int count, GID old, GID new)
+{
+    _tiles_changed += (size_t)count;
+    AddTileRunChange(x, y, layer, count, old, new);
+}
+
+/// Flood fill the bottom layer as one change, recorded as the editor does.
+static void FillChange(int x, int y, GID gid)
+{
+    FreeChangeStack(&_map.undo); // Keep only the one being made.
+    BeginChange(&_map, CHANGE_SET_TILES);
+    FloodFillMap(&_map.map, x, y, 0, gid, RecordTileRun);
+    EndChange(&_map);
+}
+
+/// Fill the region around the middle of the bottom layer, and fill it back.
+static void BenchFloodFill(void)
+{
+    Map * map = &_map.map;
+    int x = map->width / 2 + 1; // Off the walls of a structured map.
+    int y = map->height / 2 + 1;
+
+    GID original = GetMapTile(map, x, y, 0);
+    GID fill = 0xFFFE; // In no generated map, so the region stays the same.
+
+    int iterations = 0;
+    _tiles_changed = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    do {
+        FillChange(x, y, fill);
+        FillChange(x, y, original);
+        iterations += 2;
+    } while ( Seconds(start) < MIN_SECONDS );
+
+    Report("flood fill", _tiles_changed / (size_t)iterations, iterations,
+           Seconds(start));
+
+    FreeChangeStack(&_map.undo);
+}
+
+/// Set every tile in the edit area of a layer as one change, as pasting
+/// does, then undo and redo it.
+static void BenchUndo(void)
+{
+    Map * map = &_map.map;
+    int size = SDL_min(EDIT_SIZE, map->width);
+    size_t tiles = (size_t)size * (size_t)size;
+
+    int iterations = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    do {
+        FreeChangeStack(&_map.undo);
+        BeginChange(&_map, CHANGE_SET_TILES);
+        for ( int y = 0; y < size; y++ ) {
+            for ( int x = 0; x < size; x++ ) {
+                GID old = GetMapTile(map, x, y, 1);
+                GID new = (GID)(old + 1);
+                SetMapTile(map, x, y, 1, new);
+                AddTileChange(x, y, 1, old, new);
+            }
+        }
+        EndChange(&_map);
+        iterations++;
+    } while ( Seconds(start) < MIN_SECONDS );
+
+    Report("record change", tiles, iterations, Seconds(start));
+
+    iterations = 0;
+    start = SDL_GetPerformanceCounter();
+    do {
+        Undo(&_map);
+        iterations++;
+        Redo(&_map);
+        iterations++;
+    } while ( Seconds(start) < MIN_SECONDS );
+
+    Report("undo/redo", tiles, iterations, Seconds(start));
+
+    FreeChangeStack(&_map.undo);
+    FreeChangeStack(&_map.redo);
+}
+
+int main(int argc, char ** argv)
+{
+    if ( argc < 2 ) {
+        fprintf(stderr, "usage: te_bench results.csv [max size]\n");
+        return EXIT_FAILURE;
+    }
+
+    _csv = fopen(argv[1], "w");
+    if ( _csv == NULL ) {
+        fprintf(stderr, "Could not open '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    int max_size = argc > 2 ? atoi(argv[2]) : _sizes[SDL_arraysize(_sizes) - 1];
+
+    InitJobs();
+    fprintf(_csv, "operation,content,width,height,layers,tiles,iterations,"
+           "ns_per_tile,mb_per_s\n");
+
+    int status = EXIT_SUCCESS;
+    for ( size_t s = 0; s < SDL_arraysize(_sizes) && _sizes[s] <= max_size; s++ ) {
+        for ( int c = 0; c < NUM_CONTENTS; c++ ) {
+            if ( !GenerateMap((Content)c, _sizes[s]) ) {
+                status = EXIT_FAILURE;
+                continue;
+            }
+
+            if ( !BenchSave()
+                || !BenchSaveEdit()
+                || !BenchLoad()
+                || !BenchCodecs() ) {
+                status = EXIT_FAILURE;
+            }
+
+            BenchResize();
+            BenchFloodFill();
+            BenchUndo();
+
+            FreeMap(&_map.map);
+            fflush(_csv);
+        }
+    }
+
+    remove(MAP_PATH);
+    ShutdownJobs();
+    fclose(_csv);
+
+    return status;
+}
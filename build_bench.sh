@@ -0,0 +1,10 @@
+#!/bin/bash
+# Headless benchmark of the map, undo and codec code. See bench/te_bench.c.
+cc -O2 bench/te_bench.c \
+    source/map.c source/undo.c source/rle.c source/lz.c \
+    source/jobs.c source/crc.c source/trace.c \
+    -Isource -lSDL3 \
+    -Wall -Wextra -Werror \
+    -Wno-missing-field-initializers \
+    -Wconversion \
+    -o te_bench
@@ -0,0 +1,396 @@
+//
+//  map_fuzz.c
+//  te
+//
+//  Loads corrupt and truncated map files, which should fail to load or load
+//  as some map, but never crash or touch memory out of bounds. Build it with
+//  sanitizers. Inputs that pass the map's checksums are also decoded, saved
+//  and loaded again, and half of them have their checksums fixed up after
+//  being mutated so that the decoders see the damage.
+//
+//  Offline, mutating the corpus with a fixed seed:
+//      cc -g -O1 -fsanitize=address,undefined fuzz/map_fuzz.c source/map.c
+//          source/rle.c source/lz.c source/jobs.c source/crc.c source/trace.c
+//          -Isource -lSDL3 -o map_fuzz
+//      ./map_fuzz fuzz/corpus [iterations] [seed] > /dev/null
+//
+//  With libFuzzer:
+//      clang -g -O1 -DLIBFUZZER -fsanitize=fuzzer,address,undefined ...
+//      ./map_fuzz fuzz/corpus
+//
+//  Maps are written to map_fuzz.temap in the working directory.
+//
+
+#include "map.h"
+#include "crc.h"
+#include "lz.h"
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEMP_PATH "map_fuzz.temap"
+#define SAVE_PATH "map_fuzz_saved.temap"
+#define MAX_INPUT_SIZE 0x100000
+#define MAX_LEGACY_TILES 0x400000 // Version 1 layers are allocated up front.
+
+static Uint32 _seed = 1;
+
+static Uint32 Random(void)
+{
+    _seed = _seed * 1664525 + 1013904223;
+    return _seed >> 8;
+}
+
+static bool WriteFile(const char * path, const Uint8 * data, size_t size)
+{
+    FILE * file = fopen(path, "wb");
+    if ( file == NULL ) {
+        fprintf(stderr, "%s: could not create '%s'\n", __func__, path);
+        return false;
+    }
+
+    bool ok = size == 0 || fwrite(data, size, 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+/// Skip version 1 maps whose layers alone would run out of memory, since
+/// their size is only checked after decoding.
+static bool TooBig(const Uint8 * data, size_t size)
+{
+    Uint32 magic = 0;
+    LegacyMapHeader header;
+    if ( size < sizeof(header) ) {
+        return false;
+    }
+
+    memcpy(&magic, data, sizeof(magic));
+    memcpy(&header, data, sizeof(header));
+    return magic != MAP_MAGIC
+        && (size_t)header.width * header.height > MAX_LEGACY_TILES;
+}
+
+/// Make a version 5 or later map's checksums match its data again.
+static void FixChecksums(Uint8 * data, size_t size)
+{
+    MapHeader header = { 0 };
+    size_t header_size = offsetof(MapHeader, table_offset);
+    if ( size < header_size ) {
+        return;
+    }
+
+    memcpy(&header, data, header_size);
+    if ( header.magic != MAP_MAGIC || header.version < 5 ) {
+        return;
+    }
+
+    Uint64 table_offset = header_size;
+    if ( header.version >= 6 ) {
+        header_size = sizeof(header);
+        if ( size < header_size ) {
+            return;
+        }
+        memcpy(&header, data, header_size);
+        table_offset = header.table_offset;
+    }
+
+    size_t chunks_w = ((size_t)header.width + CHUNK_MASK) >> CHUNK_SHIFT;
+    size_t chunks_h = ((size_t)header.height + CHUNK_MASK) >> CHUNK_SHIFT;
+    size_t table_count = chunks_w * chunks_h * SDL_min(header.num_layers, MAX_LAYERS);
+    size_t table_size = table_count * sizeof(ChunkInfo);
+    if ( table_offset > size || size - table_offset < table_size ) {
+        return;
+    }
+
+    Uint8 * table = data + table_offset;
+    for ( size_t i = 0; i < table_count; i++ ) {
+        ChunkInfo info;
+        memcpy(&info, table + i * sizeof(info), sizeof(info));
+        if ( info.offset <= size && info.size <= size - info.offset ) {
+            info.checksum = CRC_Compute(data + info.offset, info.size);
+            memcpy(table + i * sizeof(info), &info, sizeof(info));
+        }
+    }
+
+    header.checksum = 0;
+    Uint32 checksum = CRC_Compute(&header, header_size);
+    header.checksum = CRC_Update(checksum, table, table_size);
+    memcpy(data, &header, header_size);
+}
+
+/// Read every chunk of every layer, which pages in streamed ones.
+static void ReadTiles(const Map * map, GID * out, size_t out_count)
+{
+    size_t n = 0;
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        for ( int y = 0; y < map->height; y += CHUNK_SIZE ) {
+            for ( int x = 0; x < map->width; x += CHUNK_SIZE ) {
+                int last_x = SDL_min(x + CHUNK_MASK, map->width - 1);
+                int last_y = SDL_min(y + CHUNK_MASK, map->height - 1);
+                GID a = GetMapTile(map, x, y, l);
+                GID b = GetMapTile(map, last_x, last_y, l);
+                if ( n + 2 <= out_count ) {
+                    out[n++] = a;
+                    out[n++] = b;
+                }
+            }
+        }
+    }
+}
+
+/// Load a map with no memory budget and with a tiny one. Maps that load
+/// in full must save and load again the same.
+static void FuzzMap(const Uint8 * data, size_t size)
+{
+    if ( TooBig(data, size) || !WriteFile(TEMP_PATH, data, size) ) {
+        return;
+    }
+
+    const size_t max_samples = (size / sizeof(ChunkInfo) + 1) * 2;
+    GID * loaded = calloc(max_samples, sizeof(GID));
+    GID * reloaded = calloc(max_samples, sizeof(GID));
+    if ( loaded == NULL || reloaded == NULL ) {
+        free(loaded);
+        free(reloaded);
+        return;
+    }
+
+    const size_t budgets[] = { 0, CHUNK_TILES * sizeof(GID) };
+    for ( int i = 0; i < (int)SDL_arraysize(budgets); i++ ) {
+        SetMapMemoryBudget(budgets[i]);
+
+        Map map = { 0 };
+        if ( !LoadMap(&map, TEMP_PATH) ) {
+            continue;
+        }
+
+        SDL_Rect visible = { 0, 0, CHUNK_SIZE * 2, CHUNK_SIZE * 2 };
+        UpdateMapStream(&map, &visible);
+        ReadTiles(&map, loaded, max_samples);
+        UpdateMapStream(&map, &visible);
+
+        // Streamed maps can have corrupt chunks that were never paged in,
+        // which a save keeps as they are.
+        if ( map.stream != NULL ) {
+            FreeMap(&map);
+            continue;
+        }
+
+        Map copy = { 0 };
+        if ( !SaveMap(&map, SAVE_PATH) || !LoadMap(&copy, SAVE_PATH) ) {
+            fprintf(stderr, "%s: a loaded map did not save and reload\n",
+                    __func__);
+            abort();
+        }
+
+        memset(reloaded, 0, max_samples * sizeof(GID));
+        ReadTiles(&copy, reloaded, max_samples);
+        if ( memcmp(loaded, reloaded, max_samples * sizeof(GID)) != 0 ) {
+            fprintf(stderr, "%s: a saved map reloaded differently\n", __func__);
+            abort();
+        }
+
+        FreeMap(&copy);
+        FreeMap(&map);
+    }
+
+    SetMapMemoryBudget(0);
+    free(reloaded);
+    free(loaded);
+}
+
+/// Decode the input as a bare chunk with each codec.
+static void FuzzCodecs(const Uint8 * data, size_t size)
+{
+    GID tiles[CHUNK_TILES];
+
+    LZ_Decode(data, size, tiles, CHUNK_TILES);
+
+    Uint16 * values = malloc(size + 1);
+    if ( values != NULL ) {
+        memcpy(values, data, size);
+        for ( int k = 0; k < RLE_NUM_KERNELS; k++ ) {
+            if ( RLE_IsKernelSupported((RLEKernel)k) ) {
+                RLE_Decode((RLEKernel)k, values, size / sizeof(Uint16),
+                           tiles, CHUNK_TILES);
+            }
+        }
+        free(values);
+    }
+}
+
+static void FuzzOne(const Uint8 * data, size_t size)
+{
+    FuzzCodecs(data, size);
+    FuzzMap(data, size);
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const Uint8 * data, size_t size)
+{
+    if ( size > MAX_INPUT_SIZE ) {
+        return 0;
+    }
+
+    FuzzOne(data, size);
+
+    // Again with the checksums right, to reach the decoders.
+    Uint8 * fixed = malloc(size + 1);
+    if ( fixed != NULL ) {
+        memcpy(fixed, data, size);
+        FixChecksums(fixed, size);
+        FuzzMap(fixed, size);
+        free(fixed);
+    }
+
+    return 0;
+}
+
+#else
+
+typedef struct {
+    Uint8 * data;
+    size_t size;
+} Input;
+
+static Input * inputs;
+static int num_inputs;
+
+static void AddInput(const char * path)
+{
+    size_t size = 0;
+    Uint8 * data = SDL_LoadFile(path, &size);
+    if ( data == NULL ) {
+        fprintf(stderr, "Could not read '%s': %s\n", path, SDL_GetError());
+        return;
+    }
+
+    Input * new_inputs = realloc(inputs, (size_t)(num_inputs + 1) * sizeof(*inputs));
+    if ( new_inputs == NULL || size > MAX_INPUT_SIZE ) {
+        SDL_free(data);
+        return;
+    }
+
+    inputs = new_inputs;
+    inputs[num_inputs++] = (Input){ data, size };
+}
+
+/// Add a file, or every file in a directory.
+static void AddInputs(const char * path)
+{
+    SDL_PathInfo info;
+    if ( !SDL_GetPathInfo(path, &info) ) {
+        fprintf(stderr, "Could not find '%s'\n", path);
+        return;
+    }
+
+    if ( info.type != SDL_PATHTYPE_DIRECTORY ) {
+        AddInput(path);
+        return;
+    }
+
+    int count = 0;
+    char ** names = SDL_GlobDirectory(path, "*", 0, &count);
+    for ( int i = 0; names != NULL && i < count; i++ ) {
+        char file_path[1024];
+        snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]);
+        AddInput(file_path);
+    }
+    SDL_free(names);
+}
+
+/// Damage a copy of `src` in a few random ways, returning its new size.
+static size_t Mutate(const Input * src, Uint8 * dest, size_t capacity)
+{
+    size_t size = SDL_min(src->size, capacity);
+    memcpy(dest, src->data, size);
+
+    int num_mutations = 1 + (int)(Random() % 4);
+    for ( int i = 0; i < num_mutations && size > 0; i++ ) {
+        size_t at = Random() % size;
+        switch ( Random() % 6 ) {
+            case 0: // Flip a bit.
+                dest[at] ^= (Uint8)(1 << (Random() % 8));
+                break;
+            case 1:
+                dest[at] = (Uint8)Random();
+                break;
+            case 2: // Values that tend to be boundaries.
+                dest[at] = Random() % 2 ? 0x00 : 0xFF;
+                break;
+            case 3:
+                size = at;
+                break;
+            case 4: { // Copy a run of bytes over another.
+                size_t from = Random() % size;
+                size_t n = SDL_min(Random() % 64, size - SDL_max(at, from));
+                memmove(dest + at, dest + from, n);
+                break;
+            }
+            default: // Append some noise.
+                while ( size < capacity && Random() % 16 != 0 ) {
+                    dest[size++] = (Uint8)Random();
+                }
+                break;
+        }
+    }
+
+    if ( Random() % 2 ) {
+        FixChecksums(dest, size);
+    }
+
+    return size;
+}
+
+int main(int argc, char ** argv)
+{
+    if ( argc < 2 ) {
+        fprintf(stderr, "usage: %s corpus [iterations] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+    _seed = argc > 3 ? (Uint32)strtoul(argv[3], NULL, 0) : 1;
+
+    AddInputs(argv[1]);
+    if ( num_inputs == 0 ) {
+        fprintf(stderr, "No inputs in '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // The corpus as is first.
+    for ( int i = 0; i < num_inputs; i++ ) {
+        FuzzOne(inputs[i].data, inputs[i].size);
+    }
+
+    Uint8 * buffer = malloc(MAX_INPUT_SIZE);
+    if ( buffer == NULL ) {
+        return EXIT_FAILURE;
+    }
+
+    for ( int i = 0; i < iterations; i++ ) {
+        const Input * input = &inputs[Random() % (Uint32)num_inputs];
+        size_t size = Mutate(input, buffer, MAX_INPUT_SIZE);
+        FuzzOne(buffer, size);
+
+        if ( (i + 1) % 1000 == 0 ) {
+            fprintf(stderr, "%d / %d\n", i + 1, iterations);
+        }
+    }
+
+    fprintf(stderr, "%d inputs, %d mutations: ok\n", num_inputs, iterations);
+
+    for ( int i = 0; i < num_inputs; i++ ) {
+        SDL_free(inputs[i].data);
+    }
+    free(inputs);
+    free(buffer);
+    remove(TEMP_PATH);
+    remove(SAVE_PATH);
+
+    return EXIT_SUCCESS;
+}
+
+#endif /* LIBFUZZER */
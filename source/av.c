@@ -5,6 +5,7 @@
 //
 
 #include "av.h"
+#include "profiler.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -195,6 +196,7 @@ RenderChar(Font * font, int x, int y, int ch)
     SDL_GetRenderDrawColor(__renderer, &r, &g, &b, NULL);
     SDL_SetTextureColorMod(font->texture, r, g, b);
     SDL_RenderTexture(__renderer, font->texture, &src, &dst);
+    __profile_counts.draw_calls++;
 
     return (int)(font->ch_widths[ch] * font->scale);
 }
@@ -793,6 +795,7 @@ _RenderSprite(Sprite * spr, int cel, SDL_FlipMode flip, int x, int y)
         (float)(spr->location.h)
     };
     SDL_RenderTextureRotated(__renderer, spr->texture, &src, &dst, 0, NULL, flip);
+    __profile_counts.draw_calls++;
 }
 
 void RenderAnimatedSprite(const AnimState * anim, int x, int y)
@@ -814,27 +817,103 @@ void RenderSprite(int num, int cel, int x, int y)
 #pragma mark - TIME -
 #endif
 
-static Uint64 last;
+#define MAX_DT 0.1f // Longer frames are taken as this, so nothing jumps.
+
+static Uint64 last; // In nanoseconds.
+static Uint64 last_present; // In nanoseconds, or 0 if not counting.
 float __dt;
 
+static float frame_times[FRAME_HISTORY]; // Milliseconds, a ring.
+static int num_frame_times;
+static int next_frame_time;
+
 void
 InitTime(void)
 {
-    last = SDL_GetTicks();
+    last = SDL_GetTicksNS();
 }
 
 void
 LimitFrameRate(float fps)
 {
-    Uint64 now = SDL_GetTicks();
+    Uint64 period = (Uint64)((float)SDL_NS_PER_SECOND / fps);
+    Uint64 now = SDL_GetTicksNS();
+
+    if ( last == 0 ) {
+        last = now - period;
+    }
+
+    // With vsync, presenting already waits for the display, so only sleep if
+    // the frame came in well early: nothing was presented, or the window is
+    // hidden and the display isn't waited for.
+    int vsync = 0;
+    SDL_GetRenderVSync(__renderer, &vsync);
+
+    if ( vsync == 0 || now - last < period / 2 ) {
+        if ( now - last < period ) {
+            SDL_DelayPrecise(period - (now - last));
+            now = SDL_GetTicksNS();
+        }
+    }
+
     Uint64 elapsed = now - last;
-    Uint32 frame_ms = (Uint32)(1000.0f / fps);
+    last = now;
+
+    __dt = SDL_min((float)elapsed / (float)SDL_NS_PER_SECOND, MAX_DT);
+}
+
+void
+SkipFrameTime(void)
+{
+    last = SDL_GetTicksNS();
+    last_present = 0;
+}
+
+void
+RecordFrameTime(void)
+{
+    Uint64 now = SDL_GetTicksNS();
+
+    if ( last_present != 0 ) {
+        Uint64 elapsed = now - last_present;
+        frame_times[next_frame_time] = (float)elapsed / (float)SDL_NS_PER_MS;
+        next_frame_time = (next_frame_time + 1) % FRAME_HISTORY;
+        num_frame_times = SDL_min(num_frame_times + 1, FRAME_HISTORY);
+    }
+
+    last_present = now;
+}
+
+static int
+CompareFloat(const void * a, const void * b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+void
+GetFrameStats(FrameStats * stats)
+{
+    *stats = (FrameStats){ 0 };
+    if ( num_frame_times == 0 ) {
+        return;
+    }
+
+    float sorted[FRAME_HISTORY];
+    SDL_memcpy(sorted, frame_times, sizeof(float) * (size_t)num_frame_times);
+    qsort(sorted, (size_t)num_frame_times, sizeof(float), CompareFloat);
 
-    if ( elapsed < frame_ms ) {
-        SDL_Delay(frame_ms - (Uint32)elapsed);
+    float total = 0.0f;
+    for ( int i = 0; i < num_frame_times; i++ ) {
+        total += sorted[i];
     }
 
-    last = SDL_GetTicks();
-    __dt = 1.0f / fps;
+    int n = num_frame_times;
+    stats->count = n;
+    stats->min = sorted[0];
+    stats->avg = total / (float)n;
+    stats->p99 = sorted[(n * 99 + 99) / 100 - 1];
+    stats->worst = sorted[n - 1];
 }
 
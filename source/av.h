@@ -54,9 +54,35 @@ extern Sint8 __volume;
 
 void InitVideo(int w, int h, int scale);
 void ToggleFullscreen(void);
-void LimitFrameRate(float fps);
 SDL_Texture * LoadTextureFromBMP(const char * path);
 
+// TIME
+
+#define FRAME_HISTORY 256 // Frames kept for `GetFrameStats`.
+
+typedef struct {
+    float min; // Milliseconds between frames.
+    float avg;
+    float p99;
+    float worst;
+    int count; // Number of frames these are over.
+} FrameStats;
+
+/// Wait out the rest of the frame, if vsync didn't already, and set `__dt`
+/// to the real time since the last call.
+void LimitFrameRate(float fps);
+
+/// Don't count the time since the last frame towards `__dt` or the frame
+/// stats, as after sleeping until there's input.
+void SkipFrameTime(void);
+
+/// Count the time since the last frame was presented in the frame stats.
+/// Call after presenting one, so frames with nothing to draw aren't counted.
+void RecordFrameTime(void);
+
+/// Get the times between the last FRAME_HISTORY frames presented.
+void GetFrameStats(FrameStats * stats);
+
 static inline void SetColor(SDL_Color c)
 {
     SDL_SetRenderDrawColor(__renderer, c.r, c.g, c.b, c.a);
@@ -0,0 +1,25 @@
+//
+//  crc.h
+//  te
+//
+//  CRC-32C (Castagnoli) checksums, used to catch corrupt map files. Uses the
+//  CPU's CRC instructions where it has them.
+//
+
+#ifndef crc_h
+#define crc_h
+
+#include <SDL3/SDL.h>
+
+/// Continue the checksum `crc` over `size` more bytes of `data`. Start with a
+/// `crc` of 0. Checksumming data in pieces gives the same result as all at
+/// once.
+Uint32 CRC_Update(Uint32 crc, const void * data, size_t size);
+
+/// Get the checksum of `size` bytes of `data`.
+Uint32 CRC_Compute(const void * data, size_t size);
+
+/// Name of the implementation in use, for benchmarks.
+const char * CRC_KernelName(void);
+
+#endif /* crc_h */
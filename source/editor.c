@@ -51,9 +51,15 @@
 #include "config.h"
 #include "cursor.h"
 #include "font.h"
+#include "jobs.h"
 #include "map_list.h"
+#include "map_render.h"
 #include "misc.h"
 #include "parser.h"
+#include "profiler.h"
+#include "trace.h"
+#include "tile_atlas.h"
+#include "tile_batch.h"
 #include "view.h"
 #include "zoom.h"
 
@@ -64,7 +70,6 @@
 #include <SDL3/SDL.h>
 
 #define DEFAULT_PROJECT_FILE "main.teproj"
-#define MAP_VERSION 1
 #define PROJECT_VERSION 1
 
 #define GRAPHICS_SCALE 1
@@ -73,6 +78,8 @@
 #define STR_LEN 128
 #define PAL_WIDTH_STEP 32
 #define STATUS_LEN 64
+#define STATUS_MS 3000 // How long status messages stay up.
+#define MAX_IDLE_MS 1000 // Longest wait for events when idle.
 
 #define FOCUS_OPACITY_STEP 32
 #define FOCUS_OPACITY_MIN (FOCUS_OPACITY_STEP)
@@ -149,7 +156,9 @@ static int          _hover_tile_x;
 static int          _hover_tile_y;
 static int          _pal_width = 512;
 static char         _status[STATUS_LEN];
-static float        _status_timer;
+static Uint64       _status_end; // Tick the status message disappears.
+static bool         _redraw = true; // Something on screen has changed.
+static bool         _working; // Saving or paging in, last frame.
 static SDL_Rect     _window_frame;
 static Clipboard    _clipboard;
 
@@ -161,6 +170,7 @@ static struct {
 } _keys_held;
 
 static bool         _showing_clipboard;
+static bool         _showing_profiler;
 static bool         _showing_screen_lines;
 static bool         _showing_grid_lines = true;
 static int          _unfocused_opacity = 160; // Dim unfocused screens.
@@ -178,6 +188,8 @@ static int          _default_num_layers = 3;
 static int          _default_map_width = 128;
 static int          _default_map_height = 128;
 static SDL_Color    _default_bg_color;
+static MapCodec     _map_codec = MAP_CODEC_RLE; // Used for all maps.
+static MapFilter    _layer_filters[MAX_LAYERS]; // Used for all maps.
 
 // Selection box
 static int          _fixed_x; // Start tile of drag box
@@ -250,7 +262,6 @@ static void E_ResizeMap(int dx, int dy);
 static void E_CopyToClipboard(void);
 static TileRegion * E_CurrentBrush(void);
 static void E_DeleteRegion(const TileRegion * region);
-static void E_FloodFill_r(int x, int y, GID old, GID new);
 static GID E_GetTileSetGID(int x, int y);
 static void E_SetBrushFromMap(void);
 static void E_SetTile(int x, int y, GID gid);
@@ -272,6 +283,7 @@ static void UI_SelectLayer(SDL_Keycode key);
 static void UI_SetStatus(const char * fmt, ...);
 static void UI_ShowClipboard(void);
 static void UI_Toggle(bool * value, const char * message, const char * on, const char * off);
+static SDL_Rect UI_VisibleTiles(const View * view);
 
 #ifdef __APPLE__
 #pragma mark - User Interface
@@ -311,7 +323,17 @@ static void UI_SetStatus(const char * fmt, ...)
     vsnprintf(_status, STATUS_LEN, fmt, args);
     va_end(args);
 
-    _status_timer = 3.0f;
+    _status_end = SDL_GetTicks() + STATUS_MS;
+    _redraw = true;
+}
+
+static void UI_SaveCompleted(const EditorMap * map, bool succeeded)
+{
+    if ( succeeded ) {
+        UI_SetStatus("Saved '%s'", map->name);
+    } else {
+        UI_SetStatus("Failed to save '%s'!", map->name);
+    }
 }
 
 static void UI_ShowClipboard(void)
@@ -344,6 +366,21 @@ static int UI_Margin(void)
     return FontHeight(_font);
 }
 
+/// Get the region of map tiles visible in `view`.
+static SDL_Rect UI_VisibleTiles(const View * view)
+{
+    SDL_FRect r = GetVisibleRect(view);
+    float size = (float)_tile_size;
+
+    SDL_Rect tiles;
+    tiles.x = (int)SDL_floorf(r.x / size);
+    tiles.y = (int)SDL_floorf(r.y / size);
+    tiles.w = (int)SDL_ceilf((r.x + r.w) / size) - tiles.x;
+    tiles.h = (int)SDL_ceilf((r.y + r.h) / size) - tiles.y;
+
+    return tiles;
+}
+
 static void UI_PaletteNextItem(int direction)
 {
     if ( direction == -1 && _active_tileset->prev != NULL ) {
@@ -478,7 +515,8 @@ static void UI_RenderBrush(void)
     dst.x -= __map->view.origin.x * scale;
     dst.y -= __map->view.origin.y * scale;
 
-    SDL_RenderTexture(__renderer, _active_tileset->texture, &src, &dst);
+    BatchTexture(__renderer, _active_tileset->texture, &src, &dst);
+    FlushTileBatch(__renderer);
 }
 
 static void UI_RenderClipboard(void)
@@ -499,9 +537,11 @@ static void UI_RenderClipboard(void)
                                          dest_x,
                                          dest_y,
                                          _tile_size);
-            RenderTile(__renderer, gid, _tilesets, &dest);
+            BatchTile(__renderer, gid, &dest);
         }
     }
+
+    FlushTileBatch(__renderer);
 }
 
 static void UI_RenderBorder(SDL_Rect r)
@@ -536,23 +576,16 @@ static void UI_RenderMapView(void)
 
     RenderViewBackground(map_view, _default_bg_color);
 
-    // Render Map
-    // TODO: render only visible tiles
+    // Render Map: the chunks in view, from cached textures.
+    Uint8 layer_mask = 0;
     for ( int l = 0; l < __map->map.num_layers; l++ ) {
-
-        if ( !_layers[l].is_visible ) continue;
-
-        for ( int y = 0; y < __map->map.height; y++ ) {
-            for ( int x = 0; x < __map->map.width; x++ ) {
-                GID gid = GetMapTile(&__map->map, x, y, l);
-                if ( gid != 0 ) {
-                    SDL_FRect dest = GetTileRect(map_view, x, y, _tile_size);
-                    RenderTile(__renderer, gid, _tilesets, &dest);
-                }
-            }
+        if ( _layers[l].is_visible ) {
+            layer_mask |= (Uint8)(1 << l);
         }
     }
 
+    RenderMapChunks(&__map->map, map_view, _tilesets, _tile_size, layer_mask);
+
     if ( _showing_grid_lines ) {
         RenderGrid(map_view,
                    __map->map.bg_color,
@@ -664,12 +697,19 @@ static void UI_RenderHUD(void)
 
     if ( __map->is_dirty ) {
         SDL_SetRenderDrawColor(__renderer, 255, 0, 0, 255);
+    } else if ( __map->map.save != NULL ) {
+        SDL_SetRenderDrawColor(__renderer, 255, 255, 0, 255); // Saving
     } else {
         SDL_SetRenderDrawColor(__renderer, 255, 255, 255, 255);
     }
 
-    RenderString(_font, vp->x, top_text_y, "%s (%d*%d)",
-                 __map->name, __map->map.width, __map->map.height);
+    int name_w = RenderString(_font, vp->x, top_text_y, "%s (%d*%d)",
+                              __map->name, __map->map.width, __map->map.height);
+
+    SDL_SetRenderDrawColor(__renderer, 128, 128, 128, 255);
+    RenderString(_font, vp->x + name_w, top_text_y, "  Undo %d (%.1f MB)",
+                 __map->undo.count,
+                 (double)UndoMemoryUsed(__map) / (1 << 20));
 
     int status_w = StringWidth(_font, "%s", _status);
     if ( status_w != 0 ) {
@@ -709,6 +749,13 @@ static void UI_RenderHUD(void)
                       _layers[_layer].name,
                       gid, _hover_tile_x, _hover_tile_y, buf);
 
+    const Tileset * ts = GetGIDLocation(gid)->tileset;
+    if ( ts != NULL ) {
+        int i = gid - ts->first_gid;
+        x += RenderString(_font, vp->x + x, bottom_text_y, " %s (%d, %d)",
+                          ts->id, i % ts->columns, i / ts->columns);
+    }
+
     if ( _screen_w && _screen_h ) {
         x += RenderString(_font, vp->x + x, bottom_text_y, " Screen (%d, %d)",
                           __map->screen_x, __map->screen_y);
@@ -821,7 +868,7 @@ static void UI_RespondToGeneralEvent(const SDL_Event * event)
                 case SDLK_S:
                     if ( mods & CTRL_KEY ) {
                         SaveCurrentMap();
-                        UI_SetStatus("Saved '%s'\n", __map->name);
+                        UI_SetStatus("Saving '%s'...", __map->name);
                     } else if ( mods & SDL_KMOD_ALT ) {
                         __map->screen_y = SDL_min(__map->screen_y + 1, __map->map.height / _screen_h);
                         UI_SetStatus("Focused Screen (%d, %d)\n", __map->screen_x, __map->screen_y);
@@ -877,6 +924,10 @@ static void UI_RespondToGeneralEvent(const SDL_Event * event)
                     }
                     break;
 
+                case SDLK_F12:
+                    UI_Toggle(&_showing_profiler, "Profiler", "Shown", "Hidden");
+                    break;
+
                 // Change view selection
                 case SDLK_LEFTBRACKET:
                     key_view->next_item(-1);
@@ -962,6 +1013,13 @@ static void UI_RespondToGeneralEvent(const SDL_Event * event)
             A_UpdateWindowFrame();
             break;
 
+        // Render target textures may have lost their contents.
+        case SDL_EVENT_RENDER_TARGETS_RESET:
+        case SDL_EVENT_RENDER_DEVICE_RESET:
+            FlushMapRenderCache();
+            PackTilesets(__renderer, _tilesets);
+            break;
+
         case SDL_EVENT_MOUSE_WHEEL:
             if ( mouse_view ) {
                 // Convert to viewport space.
@@ -1082,7 +1140,9 @@ static void A_LoadProjectFile(void)
             char path[256] = { 0 };
             A_GetTilesetPath(set->id, path, sizeof(path));
 
+            TraceBegin("load tileset");
             set->texture = LoadTextureFromBMP(path);
+            TraceEnd("load tileset");
             if ( set->texture == NULL ) {
                 printf("Could not load tile set '%s'\n", path);
                 exit(EXIT_FAILURE);
@@ -1121,6 +1181,38 @@ static void A_LoadProjectFile(void)
             MatchSymbol(':');
             _default_num_layers = ExpectInt();
         }
+        else if ( STREQ(ident, "map_codec") ) {
+            MatchSymbol(':');
+            char name[STR_LEN];
+            ExpectIdent(name, sizeof(name));
+            if ( !GetMapCodec(name, &_map_codec) ) {
+                fprintf(stderr, "Unknown map codec in '%s': '%s'\n",
+                        _project_path, name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ( STREQ(ident, "layer_filter") ) {
+            int layer_num = ExpectInt();
+            MatchSymbol(':');
+            char name[STR_LEN];
+            ExpectIdent(name, sizeof(name));
+            if ( layer_num < 0 || layer_num >= MAX_LAYERS
+                || !GetMapFilter(name, &_layer_filters[layer_num]) ) {
+                fprintf(stderr, "Bad layer filter in '%s': %d '%s'\n",
+                        _project_path, layer_num, name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ( STREQ(ident, "map_memory_budget") ) {
+            MatchSymbol(':');
+            int megabytes = ExpectInt();
+            SetMapMemoryBudget((size_t)SDL_max(megabytes, 0) << 20);
+        }
+        else if ( STREQ(ident, "undo_memory_budget") ) {
+            MatchSymbol(':');
+            int megabytes = ExpectInt();
+            SetUndoMemoryBudget((size_t)SDL_max(megabytes, 0) << 20);
+        }
         else if ( STREQ(ident, "default_map_size") ) {
             MatchSymbol(':');
             _default_map_width = ExpectInt();
@@ -1144,6 +1236,14 @@ static void A_LoadProjectFile(void)
     }
 
     EndParsing();
+
+    TraceBegin("pack tilesets");
+    PackTilesets(__renderer, _tilesets);
+    TraceEnd("pack tilesets");
+    SetMapsCodec(_map_codec);
+    for ( int i = 0; i < MAX_LAYERS; i++ ) {
+        SetMapsLayerFilter(i, _layer_filters[i]);
+    }
 }
 
 void A_GetTilesetPath(const char * id, char * out, size_t len)
@@ -1280,29 +1380,97 @@ static void A_InitEditor(void)
     ClampViewOrigin(&_tileset_views[_tile_set_index]);
 }
 
+/// The map selection's marching ants move while the window has focus. The
+/// palette's brush box only moves along when something else is drawn.
+static bool A_AntsMarching(void)
+{
+    return __map->view.has_selection
+        && (SDL_GetWindowFlags(__window) & SDL_WINDOW_INPUT_FOCUS);
+}
+
+///
+/// How long the editor can wait for an event before something on screen
+/// changes by itself, in milliseconds, or 0 if it's changing now: while
+/// dragging, scrolling, saving or paging in chunks.
+///
+static Sint32 A_IdleTime(void)
+{
+    if ( _state != &S_Main
+        || _working
+        || _keys_held.left || _keys_held.right
+        || _keys_held.up || _keys_held.down ) {
+        return 0;
+    }
+
+    Uint64 now = SDL_GetTicks();
+    Sint32 time = MAX_IDLE_MS;
+
+    if ( _status[0] != '\0' ) {
+        Uint64 left = _status_end > now ? _status_end - now : 0;
+        time = (Sint32)SDL_min(left, (Uint64)time);
+    }
+
+    if ( A_AntsMarching() ) {
+        time = SDL_min(time, ANTS_STEP_MS - (Sint32)(now % ANTS_STEP_MS));
+    }
+
+    return time;
+}
+
+static void A_HandleEvent(const SDL_Event * event)
+{
+    _redraw = true;
+
+    if ( _state->respond && _state->respond(event) ) return;
+    UI_RespondToGeneralEvent(event);
+}
+
 static void A_DoEditorFrame(void)
 {
     SDL_Event event;
+
+    // Sleep until there's input if nothing would change in the meantime.
+    Sint32 idle_time = A_IdleTime();
+    bool woken = false;
+    if ( idle_time > 0 ) {
+        woken = SDL_WaitEventTimeout(&event, idle_time);
+        SkipFrameTime();
+    }
+
+    BeginProfileFrame(PHASE_EVENTS);
+
+    if ( woken ) {
+        A_HandleEvent(&event);
+    }
+
     while ( SDL_PollEvent(&event) ) {
-        if ( _state->respond && _state->respond(&event) ) continue;
-        UI_RespondToGeneralEvent(&event);
+        A_HandleEvent(&event);
     }
 
-    UpdateAntsPhase();
+    SetProfilePhase(PHASE_BACKGROUND);
 
-    // Run status message timer---disappear when done.
-    if ( _status[0] != '\0' ) {
-        _status_timer -= __dt;
-        if ( _status_timer <= 0.0f ) {
-            _status_timer = 0.0f;
-            _status[0] = '\0';
-        }
+    SDL_Rect visible = UI_VisibleTiles(&__map->view);
+    bool saving = UpdateMapSaves(UI_SaveCompleted);
+    bool paging = UpdateMapStream(&__map->map, &visible);
+    _working = saving || paging;
+
+    if ( A_AntsMarching() || _working || idle_time == 0 ) {
+        _redraw = true;
+    }
+
+    // Clear the status message when its time is up.
+    if ( _status[0] != '\0' && SDL_GetTicks() >= _status_end ) {
+        _status[0] = '\0';
+        _redraw = true;
     }
 
     // Resize things in case the window size changed.
     // TODO: only if the window size changed!
+    SetProfilePhase(PHASE_VIEW_SIZES);
     A_UpdateViewSizes();
 
+    SetProfilePhase(PHASE_STATE);
+
     // Update the current mouse tile.
     View * mouse_view = UI_MouseView();
     GetMouseTile(mouse_view, &_hover_tile_x, &_hover_tile_y, _tile_size);
@@ -1311,16 +1479,36 @@ static void A_DoEditorFrame(void)
         _state->update();
     }
 
+    if ( !_redraw ) {
+        return;
+    }
+
+    UpdateAntsPhase();
+
     SDL_SetRenderDrawColor(__renderer, 38, 38, 38, 255);
     SDL_RenderClear(__renderer);
 
+    SetProfilePhase(PHASE_MAP);
     UI_RenderMapView();
+    SetProfilePhase(PHASE_PALETTE);
     UI_RenderPaletteView();
+    SetProfilePhase(PHASE_HUD);
     UI_RenderHUD();
 
+    SetProfilePhase(PHASE_OVERLAYS);
     _state->render();
 
+    if ( _showing_profiler ) {
+        SDL_SetRenderViewport(__renderer, NULL);
+        RenderProfiler(_font);
+    }
+
+    SetProfilePhase(PHASE_PRESENT);
     SDL_RenderPresent(__renderer);
+    RecordFrameTime();
+    _redraw = false;
+
+    EndProfileFrame();
 }
 
 #ifdef __APPLE__
@@ -1381,12 +1569,10 @@ static void E_ApplyClipboard(void)
             int dest_x = _hover_tile_x + x;
             if ( dest_x >= __map->map.width ) continue;
 
-            // TODO: convert to get/set tile
-            int l = _layer;
-            GID * dst = &__map->map.tiles[l][dest_y * __map->map.width + dest_x];
-            GID * src = &cb->tiles[y * cb->width + x];
-            AddTileChange(dest_x, dest_y, _layer, *dst, *src);
-            *dst = *src;
+            GID old = GetMapTile(&__map->map, dest_x, dest_y, _layer);
+            GID new = cb->tiles[y * cb->width + x];
+            AddTileChange(dest_x, dest_y, _layer, old, new);
+            SetMapTile(&__map->map, dest_x, dest_y, _layer, new);
             __map->is_dirty = true;
         }
     }
@@ -1415,12 +1601,12 @@ static void E_ApplyBrush(void)
         for ( ; src_x <= brush->max_x; src_x++, dst_x++ ) {
             if ( src_x >= m->width ) break;
 
-            // TODO: get/set funcs
-            Uint16 dst_index = (Uint16)(dst_y * m->width + dst_x);
-            Uint16 gid = E_GetTileSetGID(src_x, src_y);
-            if ( m->tiles[_layer][dst_index] != gid ) {
-                GID old = m->tiles[_layer][dst_index];
-                m->tiles[_layer][dst_index] = gid;
+            if ( !IsValidPosition(m, dst_x, dst_y) ) continue;
+
+            GID gid = E_GetTileSetGID(src_x, src_y);
+            GID old = GetMapTile(m, dst_x, dst_y, _layer);
+            if ( old != gid ) {
+                SetMapTile(m, dst_x, dst_y, _layer, gid);
                 AddTileChange(dst_x, dst_y, _layer, old, gid);
                 __map->is_dirty = true;
             }
@@ -1428,42 +1614,30 @@ static void E_ApplyBrush(void)
     }
 }
 
-static void E_FloodFill_r(int x, int y, GID old, GID new)
-{
-    if ( !IsValidPosition(&__map->map, x, y) ) {
-        return;
-    }
-
-    GID tile = GetMapTile(&__map->map, x, y, _layer);
-    if ( tile != old ) {
-        return;
-    }
-
-    SetMapTile(&__map->map, x, y, _layer, new);
-    AddTileChange(x, y, _layer, old, new);
-
-    E_FloodFill_r(x + 1, y, old, new);
-    E_FloodFill_r(x, y + 1, old, new);
-    E_FloodFill_r(x - 1, y, old, new);
-    E_FloodFill_r(x, y - 1, old, new);
-}
-
 static void E_SetBrushFromMap(void)
 {
     GID tile = GetMapTile(&__map->map, _hover_tile_x, _hover_tile_y, _layer);
 
-    int x, y;
-    GetGIDLocation(_tilesets, tile, &x, &y);
+    Tileset * tileset = GetGIDLocation(tile)->tileset;
+    if ( tileset == NULL ) {
+        return; // Empty
+    }
+
+    int x = (tile - tileset->first_gid) % tileset->columns;
+    int y = (tile - tileset->first_gid) / tileset->columns;
 
-    // Get the "index" of the current tileset.
+    // Switch to the tile's tileset and get its "index".
     int i = 0;
     FOR_EACH_TILESET(ts) {
-        if ( ts == _active_tileset ) {
+        if ( ts == tileset ) {
             break;
         }
         i++;
     }
 
+    _active_tileset = tileset;
+    _tile_set_index = i;
+
     _tileset_views[i].selection_box.min_x = x;
     _tileset_views[i].selection_box.min_y = y;
     _tileset_views[i].selection_box.max_x = x;
@@ -1643,7 +1817,7 @@ static void S_DragLine_RenderTile(int x, int y, void * user)
 {
     GID tile = *(GID *)user;
     SDL_FRect rect = GetTileRect(&__map->view, x, y, _tile_size);
-    RenderTile(__renderer, tile, _tilesets, &rect);
+    BatchTile(__renderer, tile, &rect);
 }
 
 static bool S_DragLine_Respond(const SDL_Event * event)
@@ -1687,6 +1861,7 @@ static void S_DragLine_Render(void)
         TileRegion * br = E_CurrentBrush();
         GID tile = E_GetTileSetGID(br->min_x, br->min_y);
         BresenhamLine(_fixed_x, _fixed_y, _drag_x, _drag_y, S_DragLine_RenderTile, &tile);
+        FlushTileBatch(__renderer);
         SDL_SetRenderViewport(__renderer, &old_vp);
     }
 }
@@ -1731,11 +1906,10 @@ static bool S_Main_LeftMouseDown(void)
                 break;
 
             case TOOL_FILL: {
-                GID old = GetMapTile(&__map->map, tx, ty, _layer);
                 TileRegion * brush = E_CurrentBrush();
                 GID new = E_GetTileSetGID(brush->min_x, brush->min_y);
                 BeginChange(__map, CHANGE_SET_TILES);
-                E_FloodFill_r(tx, ty, old, new);
+                FloodFillMap(&__map->map, tx, ty, _layer, new, AddTileRunChange);
                 EndChange(__map);
                 break;
             }
@@ -1933,6 +2107,8 @@ static void S_DragPaint_Render(void)
 
 int main(int argc, char ** argv)
 {
+    InitProfiler();
+
     printf("[te] Tile Editor\n");
     printf("(C) 2026 Tom Foster (github.com/teefoss)\n\n");
 
@@ -1953,8 +2129,14 @@ int main(int argc, char ** argv)
         return EXIT_SUCCESS;
     }
 
+    const char * trace_path = GetStrOption("--trace", NULL);
+    if ( trace_path != NULL && !StartTrace(trace_path) ) {
+        return EXIT_FAILURE;
+    }
+
     InitVideo(1280, 800, 1);
     InitSound();
+    InitJobs();
     A_InitEditor();
 
     while ( _is_running ) {
@@ -1969,7 +2151,11 @@ int main(int argc, char ** argv)
     SaveConfig(config, full_path);
     SaveMapState();
 
+    FlushMapRenderCache();
+    FreeTileAtlases(_tilesets);
     FreeMaps();
+    ShutdownJobs();
+    StopTrace();
 
     return 0;
 }
@@ -0,0 +1,169 @@
+//
+//  jobs.c
+//  te
+//
+//  A batch of jobs is posted by setting up `_pool` and bumping `batch`. Idle
+//  workers wake, join the batch while it's open, and pull indices off `next`
+//  until there are none left. The caller closes the batch once it runs out of
+//  indices itself and waits for the workers that joined to finish, so a late
+//  worker never sees a batch that's already over.
+//
+
+#include "jobs.h"
+
+#include <stdio.h>
+
+#define MAX_WORKERS 31
+
+static struct {
+    SDL_Thread * threads[MAX_WORKERS];
+    int num_threads;
+
+    SDL_Mutex * run_lock; // Held while a batch is running.
+    SDL_Mutex * lock;
+    SDL_Condition * wake;
+    SDL_Condition * finished;
+
+    // The current batch. Guarded by `lock`, except `next`.
+    JobFunc func;
+    void * data;
+    int count;
+    SDL_AtomicInt next;
+    Uint32 batch;
+    bool open;
+    int busy; // Number of workers in the batch.
+    bool quit;
+} _pool;
+
+static void DoJobs(JobFunc func, void * data, int count)
+{
+    int i;
+    while ( (i = SDL_AddAtomicInt(&_pool.next, 1)) < count ) {
+        func(data, i);
+    }
+}
+
+static int WorkerThread(void * unused)
+{
+    (void)unused;
+    Uint32 seen = 0;
+
+    SDL_LockMutex(_pool.lock);
+
+    while ( true ) {
+        while ( !_pool.quit && (!_pool.open || _pool.batch == seen) ) {
+            SDL_WaitCondition(_pool.wake, _pool.lock);
+        }
+
+        if ( _pool.quit ) {
+            break;
+        }
+
+        seen = _pool.batch;
+        _pool.busy++;
+        JobFunc func = _pool.func;
+        void * data = _pool.data;
+        int count = _pool.count;
+        SDL_UnlockMutex(_pool.lock);
+
+        DoJobs(func, data, count);
+
+        SDL_LockMutex(_pool.lock);
+        if ( --_pool.busy == 0 ) {
+            SDL_SignalCondition(_pool.finished);
+        }
+    }
+
+    SDL_UnlockMutex(_pool.lock);
+
+    return 0;
+}
+
+void InitJobs(void)
+{
+    if ( _pool.lock != NULL ) {
+        return;
+    }
+
+    _pool.run_lock = SDL_CreateMutex();
+    _pool.lock = SDL_CreateMutex();
+    _pool.wake = SDL_CreateCondition();
+    _pool.finished = SDL_CreateCondition();
+
+    if ( _pool.run_lock == NULL
+        || _pool.lock == NULL
+        || _pool.wake == NULL
+        || _pool.finished == NULL ) {
+        fprintf(stderr, "%s: failed to create pool (%s)\n",
+                __func__, SDL_GetError());
+        ShutdownJobs();
+        return;
+    }
+
+    int num_workers = SDL_GetNumLogicalCPUCores() - 1;
+    num_workers = SDL_clamp(num_workers, 0, MAX_WORKERS);
+
+    for ( int i = 0; i < num_workers; i++ ) {
+        SDL_Thread * thread = SDL_CreateThread(WorkerThread, "te worker", NULL);
+        if ( thread == NULL ) {
+            fprintf(stderr, "%s: failed to create worker thread (%s)\n",
+                    __func__, SDL_GetError());
+            break;
+        }
+
+        _pool.threads[_pool.num_threads++] = thread;
+    }
+}
+
+void ShutdownJobs(void)
+{
+    if ( _pool.lock != NULL ) {
+        SDL_LockMutex(_pool.lock);
+        _pool.quit = true;
+        SDL_BroadcastCondition(_pool.wake);
+        SDL_UnlockMutex(_pool.lock);
+    }
+
+    for ( int i = 0; i < _pool.num_threads; i++ ) {
+        SDL_WaitThread(_pool.threads[i], NULL);
+    }
+
+    SDL_DestroyCondition(_pool.finished);
+    SDL_DestroyCondition(_pool.wake);
+    SDL_DestroyMutex(_pool.lock);
+    SDL_DestroyMutex(_pool.run_lock);
+    SDL_zero(_pool);
+}
+
+void RunJobs(JobFunc func, void * data, int count)
+{
+    if ( _pool.num_threads == 0
+        || count <= 1
+        || !SDL_TryLockMutex(_pool.run_lock) ) {
+        for ( int i = 0; i < count; i++ ) {
+            func(data, i);
+        }
+        return;
+    }
+
+    SDL_LockMutex(_pool.lock);
+    _pool.func = func;
+    _pool.data = data;
+    _pool.count = count;
+    SDL_SetAtomicInt(&_pool.next, 0);
+    _pool.batch++;
+    _pool.open = true;
+    SDL_BroadcastCondition(_pool.wake);
+    SDL_UnlockMutex(_pool.lock);
+
+    DoJobs(func, data, count);
+
+    SDL_LockMutex(_pool.lock);
+    _pool.open = false;
+    while ( _pool.busy > 0 ) {
+        SDL_WaitCondition(_pool.finished, _pool.lock);
+    }
+    SDL_UnlockMutex(_pool.lock);
+
+    SDL_UnlockMutex(_pool.run_lock);
+}
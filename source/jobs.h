@@ -0,0 +1,28 @@
+//
+//  jobs.h
+//  te
+//
+//  A small pool of worker threads for splitting work like map compression
+//  across CPU cores.
+//
+
+#ifndef jobs_h
+#define jobs_h
+
+#include <SDL3/SDL.h>
+
+typedef void (* JobFunc)(void * data, int index);
+
+/// Start one worker thread per additional logical CPU core.
+void InitJobs(void);
+void ShutdownJobs(void);
+
+/// Call `func(data, i)` for each `i` in [0, `count`) across the worker
+/// threads and wait until all calls are finished. The calling thread does its
+/// share of the work. Indices are handed out in no particular order.
+///
+/// If the pool isn't running, or is already in use by another thread, the
+/// jobs are run on the calling thread.
+void RunJobs(JobFunc func, void * data, int count);
+
+#endif /* jobs_h */
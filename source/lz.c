@@ -0,0 +1,205 @@
+//
+//  lz.c
+//  te
+//
+//  The data is a series of sequences, each a run of literal tiles followed
+//  by a match: a copy of earlier output.
+//
+//  Token           1 byte: literal count (high 4 bits), match length - 2
+//                  (low 4 bits). A value of 15 is continued in the following
+//                  bytes, which are added on until one isn't 255.
+//  Literals        Literal count tiles.
+//  Match offset    2 bytes, little endian: how many tiles back to copy from.
+//                  Matches may overlap their own output, so an offset of 1
+//                  repeats a tile.
+//
+//  The last sequence has literals only and ends the data.
+//
+
+#include "lz.h"
+
+#define MIN_MATCH 2 // In tiles.
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+
+static Uint32 Hash(const Uint16 * p)
+{
+    Uint32 pair = (Uint32)p[0] | (Uint32)p[1] << 16;
+    return (pair * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static Uint8 * WriteLength(Uint8 * p, size_t length)
+{
+    while ( length >= 255 ) {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (Uint8)length;
+
+    return p;
+}
+
+static bool ReadLength(const Uint8 ** src, const Uint8 * end, size_t * length)
+{
+    Uint8 byte;
+    do {
+        if ( *src == end ) {
+            return false;
+        }
+        byte = *(*src)++;
+        *length += byte;
+    } while ( byte == 255 );
+
+    return true;
+}
+
+/// Write a sequence. A `match_length` of 0 ends the data.
+static bool WriteSequence(Uint8 ** out, const Uint8 * out_end,
+                          const Uint16 * literals, size_t num_literals,
+                          size_t offset, size_t match_length)
+{
+    // Worst case size.
+    size_t needed = 1
+        + num_literals / 255 + 1
+        + num_literals * sizeof(*literals)
+        + 2
+        + match_length / 255 + 1;
+    if ( needed > (size_t)(out_end - *out) ) {
+        return false;
+    }
+
+    size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+    Uint8 * p = *out;
+    *p++ = (Uint8)(SDL_min(num_literals, 15) << 4 | SDL_min(match_code, 15));
+
+    if ( num_literals >= 15 ) {
+        p = WriteLength(p, num_literals - 15);
+    }
+
+    memcpy(p, literals, num_literals * sizeof(*literals));
+    p += num_literals * sizeof(*literals);
+
+    if ( match_length ) {
+        *p++ = (Uint8)(offset & 0xFF);
+        *p++ = (Uint8)(offset >> 8);
+        if ( match_code >= 15 ) {
+            p = WriteLength(p, match_code - 15);
+        }
+    }
+
+    *out = p;
+    return true;
+}
+
+size_t LZ_Encode(const Uint16 * src, size_t count,
+                 Uint8 * dest, size_t dest_capacity)
+{
+    // Most recent position + 1 of each hashed pair of tiles, 0 if none.
+    Uint32 table[1 << HASH_BITS] = { 0 };
+
+    Uint8 * out = dest;
+    const Uint8 * out_end = dest + dest_capacity;
+    size_t anchor = 0; // Start of pending literals.
+    size_t i = 0;
+
+    // Greedy parse: take the first match the hash table turns up.
+    while ( i + MIN_MATCH <= count ) {
+        Uint32 hash = Hash(src + i);
+        size_t candidate = table[hash];
+        table[hash] = (Uint32)(i + 1);
+
+        if ( candidate == 0
+            || i - (candidate - 1) > MAX_OFFSET
+            || src[candidate - 1] != src[i]
+            || src[candidate] != src[i + 1] ) {
+            i++;
+            continue;
+        }
+
+        size_t ref = candidate - 1;
+        size_t length = MIN_MATCH;
+        while ( i + length < count && src[ref + length] == src[i + length] ) {
+            length++;
+        }
+
+        if ( !WriteSequence(&out, out_end,
+                            src + anchor, i - anchor,
+                            i - ref, length) ) {
+            return 0;
+        }
+
+        i += length;
+        anchor = i;
+
+        // Keep the table current with the end of the match.
+        table[Hash(src + i - MIN_MATCH)] = (Uint32)(i - MIN_MATCH + 1);
+    }
+
+    if ( !WriteSequence(&out, out_end, src + anchor, count - anchor, 0, 0) ) {
+        return 0;
+    }
+
+    return (size_t)(out - dest);
+}
+
+bool LZ_Decode(const Uint8 * src, size_t size,
+               Uint16 * dest, size_t dest_count)
+{
+    const Uint8 * end = src + size;
+    Uint16 * out = dest;
+    Uint16 * out_end = dest + dest_count;
+
+    while ( src < end ) {
+        Uint8 token = *src++;
+
+        size_t num_literals = token >> 4;
+        if ( num_literals == 15 && !ReadLength(&src, end, &num_literals) ) {
+            return false;
+        }
+
+        if ( num_literals > (size_t)(end - src) / sizeof(*out)
+            || num_literals > (size_t)(out_end - out) ) {
+            return false; // Truncated, or overflows the destination.
+        }
+
+        memcpy(out, src, num_literals * sizeof(*out));
+        out += num_literals;
+        src += num_literals * sizeof(*out);
+
+        if ( src == end ) {
+            break; // Last sequence.
+        }
+
+        if ( end - src < 2 ) {
+            return false;
+        }
+
+        size_t offset = (size_t)src[0] | (size_t)src[1] << 8;
+        src += 2;
+
+        size_t length = token & 15;
+        if ( length == 15 && !ReadLength(&src, end, &length) ) {
+            return false;
+        }
+        length += MIN_MATCH;
+
+        if ( offset == 0
+            || offset > (size_t)(out - dest)
+            || length > (size_t)(out_end - out) ) {
+            return false;
+        }
+
+        const Uint16 * ref = out - offset;
+        if ( offset >= length ) {
+            memcpy(out, ref, length * sizeof(*out));
+        } else {
+            // Overlapping: copy forward one tile at a time.
+            for ( size_t i = 0; i < length; i++ ) {
+                out[i] = ref[i];
+            }
+        }
+        out += length;
+    }
+
+    return out == out_end;
+}
@@ -0,0 +1,32 @@
+//
+//  lz.h
+//  te
+//
+//  LZ77-style coding of 16-bit tile data, in the manner of LZ4 but working
+//  in whole tiles. Catches repeated patterns, like brick walls, checkerboards
+//  or rows that repeat the row above, that run-length coding can't.
+//
+
+#ifndef lz_h
+#define lz_h
+
+#include <SDL3/SDL.h>
+
+// Bump when the format changes. Data from a newer version is rejected.
+#define LZ_VERSION 1
+
+/// Encode `count` values from `src` into `dest`.
+///
+/// - returns: The number of bytes written to `dest`, or 0 if the result
+///   does not fit in `dest_capacity` bytes.
+size_t LZ_Encode(const Uint16 * src, size_t count,
+                 Uint8 * dest, size_t dest_capacity);
+
+/// Decode `size` bytes from `src` into `dest`.
+///
+/// - returns: false if the data is malformed or doesn't decode to exactly
+///   `dest_count` values.
+bool LZ_Decode(const Uint8 * src, size_t size,
+               Uint16 * dest, size_t dest_count);
+
+#endif /* lz_h */
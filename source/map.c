@@ -9,319 +9,2569 @@
  MAP FORMAT
 -----------
  Header             (`MapHeader`)
- Layer Info Table   (`Layer` * num_layers)
+ Chunk Table        (`ChunkInfo` * chunks_w * chunks_h * num_layers)
+ Chunk data         (`ChunkHeader`, compressed tiles)
+ ...
+
+ Each layer is split into chunk_size * chunk_size tile chunks. The chunk table
+ lists each layer's chunks in row-major order. Chunks are compressed on their
+ own so a save only needs to encode the ones that changed. Each chunk records
+ the codec it was compressed with, so a file can mix codecs, and the filter
+ applied to its tiles first, set per layer.
+
+ A save to the file the map came from appends the chunks that changed and then
+ a new chunk table, which lists the rest where they already are. Only once
+ that's on disk is the header rewritten to point at the new table, so until
+ then the file reads as it did. When more than half of the file would be
+ chunks and tables no longer in use, the save writes a new file instead.
+
+ The header holds a checksum of itself and the chunk table, and the table one
+ of each chunk's data. Chunks are checked before they're decoded, which for
+ streamed maps is when they're paged in.
+
+ VERSION 5: The header ends before `table_offset`, and the table follows it.
+
+ VERSION 4: The header ends before `checksum`. The table has each chunk's size
+ where its checksum would be.
+
+ VERSION 3: The header ends before `filters`. No chunks are filtered.
+
+ VERSION 2: The header ends before `codec`. All chunks are RLE.
+
+ VERSION 1 (loaded and converted on the next save)
+ Header             (`LegacyMapHeader`)
+ Layer Info Table   (`LayerInfo` * num_layers)
  Layer 0 data (compressed)
  Layer 1 data (compressed)
  ...
  */
 
-#include "map.h"
+#include "map.h"
+#include "crc.h"
+#include "jobs.h"
+#include "lz.h"
+#include "rle.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Tiles tend to match the ones above them, and high bytes tend to match each
+// other. Filters turn both into runs of zeros.
+void FilterTiles(MapFilter filter, const GID * src, GID * dest, size_t count)
+{
+    const size_t w = SDL_min(count, CHUNK_SIZE);
+
+    switch ( filter ) {
+        case MAP_FILTER_XOR:
+            memcpy(dest, src, w * sizeof(GID));
+            for ( size_t i = w; i < count; i++ ) {
+                dest[i] = (GID)(src[i] ^ src[i - w]);
+            }
+            break;
+        case MAP_FILTER_DELTA:
+            memcpy(dest, src, w * sizeof(GID));
+            for ( size_t i = w; i < count; i++ ) {
+                dest[i] = (GID)(src[i] - src[i - w]);
+            }
+            break;
+        case MAP_FILTER_PLANES: {
+            Uint8 * low = (Uint8 *)dest;
+            Uint8 * high = low + count;
+            for ( size_t i = 0; i < count; i++ ) {
+                low[i] = (Uint8)src[i];
+                high[i] = (Uint8)(src[i] >> 8);
+            }
+            break;
+        }
+        default:
+            memcpy(dest, src, count * sizeof(GID));
+            break;
+    }
+}
+
+void UnfilterTiles(MapFilter filter, const GID * src, GID * dest, size_t count)
+{
+    const size_t w = SDL_min(count, CHUNK_SIZE);
+
+    switch ( filter ) {
+        case MAP_FILTER_XOR:
+            memcpy(dest, src, w * sizeof(GID));
+            for ( size_t i = w; i < count; i++ ) {
+                dest[i] = (GID)(src[i] ^ dest[i - w]);
+            }
+            break;
+        case MAP_FILTER_DELTA:
+            memcpy(dest, src, w * sizeof(GID));
+            for ( size_t i = w; i < count; i++ ) {
+                dest[i] = (GID)(src[i] + dest[i - w]);
+            }
+            break;
+        case MAP_FILTER_PLANES: {
+            const Uint8 * low = (const Uint8 *)src;
+            const Uint8 * high = low + count;
+            for ( size_t i = 0; i < count; i++ ) {
+                dest[i] = (GID)(low[i] | high[i] << 8);
+            }
+            break;
+        }
+        default:
+            memcpy(dest, src, count * sizeof(GID));
+            break;
+    }
+}
+
+/// Compress a chunk's `data` with `filter` and `codec` into a new buffer,
+/// which starts with a `ChunkHeader`. If that wouldn't save any space, the
+/// data is stored as is.
+static Uint8 *
+Compress(const Uint16 * data,
+         size_t data_size,
+         MapCodec codec,
+         MapFilter filter,
+         size_t * compressed_size)
+{
+    if ( data == NULL || data_size == 0 ) {
+        *compressed_size = 0;
+        return NULL;
+    }
+
+    const size_t header_size = sizeof(ChunkHeader);
+    Uint8 * buffer = SDL_malloc(header_size + data_size);
+    if ( buffer == NULL ) {
+        return NULL;
+    }
+
+    ChunkHeader header = {
+        .size = (Uint32)data_size,
+        .codec = (Uint8)codec,
+    };
+
+    size_t count = data_size / sizeof(Uint16);
+    const Uint16 * source = data;
+
+    GID filtered[CHUNK_TILES];
+    if ( filter != MAP_FILTER_NONE && data_size == sizeof(filtered) ) {
+        FilterTiles(filter, data, filtered, count);
+        source = filtered;
+        header.filter = (Uint8)filter;
+    }
+
+    Uint8 * dest = buffer + header_size;
+    size_t n = 0;
+
+    switch ( codec ) {
+        case MAP_CODEC_LZ:
+            header.codec_version = LZ_VERSION;
+            n = LZ_Encode(source, count, dest, data_size);
+            break;
+        default:
+            n = RLE_Encode(RLE_GetKernel(), source, count, (Uint16 *)dest, count);
+            n *= sizeof(Uint16);
+            break;
+    }
+
+    *compressed_size = header_size + n;
+
+    // Compression didn't save space, just return the original data.
+    if ( n == 0 || *compressed_size >= data_size ) {
+        *compressed_size = header_size + data_size;
+        header.filter = MAP_FILTER_NONE;
+        memcpy(dest, data, data_size);
+    }
+
+    memcpy(buffer, &header, header_size);
+
+    return buffer;
+}
+
+/// Decode the RLE compressed `data` of `size` bytes, after its 8-byte
+/// header, directly into `dest`, which has room for `dest_size` bytes.
+///
+/// - returns: false if the data doesn't decode to exactly `dest_size` bytes.
+static bool
+Decompress(GID * dest, size_t dest_size, const Uint8 * data, size_t size)
+{
+    size_t header_size = sizeof(Uint64);
+    const Uint8 * payload = data + header_size;
+    size_t count = (size - header_size) / sizeof(Uint16);
+
+    // RLE data is read a word at a time, but it can start at any byte of a
+    // file, so data that isn't aligned is decoded from a copy.
+    Uint16 scratch[CHUNK_TILES];
+    Uint16 * copy = NULL;
+    if ( (uintptr_t)payload % sizeof(Uint16) != 0 ) {
+        if ( count <= CHUNK_TILES ) {
+            copy = scratch;
+        } else {
+            copy = SDL_malloc(count * sizeof(Uint16));
+            if ( copy == NULL ) {
+                fprintf(stderr, "%s: malloc failed\n", __func__);
+                return false;
+            }
+        }
+
+        memcpy(copy, payload, count * sizeof(Uint16));
+        payload = (const Uint8 *)copy;
+    }
+
+    bool ok = RLE_Decode(RLE_GetKernel(),
+                         (const Uint16 *)payload, count,
+                         dest, dest_size / sizeof(GID));
+
+    if ( copy != scratch ) {
+        SDL_free(copy);
+    }
+
+    return ok;
+}
+
+/// Map the file at `path` read-only into memory.
+static Uint8 * MapFile(const char * path, size_t * size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE ) {
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size;
+    if ( !GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0 ) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if ( mapping == NULL ) {
+        return NULL;
+    }
+
+    void * data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // The view keeps the mapping alive.
+    if ( data == NULL ) {
+        return NULL;
+    }
+
+    *size = (size_t)file_size.QuadPart;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if ( fd == -1 ) {
+        return NULL;
+    }
+
+    struct stat st;
+    if ( fstat(fd, &st) == -1 || st.st_size == 0 ) {
+        close(fd);
+        return NULL;
+    }
+
+    void * data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive.
+    if ( data == MAP_FAILED ) {
+        return NULL;
+    }
+
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+static void UnmapFile(Uint8 * data, size_t size)
+{
+    if ( data == NULL ) {
+        return;
+    }
+
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+/// Decode a version 1 map layer into `dest`.
+static bool
+DecodeLayer(GID * dest, size_t dest_size, const Uint8 * data, size_t size)
+{
+    Uint64 decompressed_size;
+    if ( size < sizeof(decompressed_size) ) {
+        return false;
+    }
+
+    memcpy(&decompressed_size, data, sizeof(decompressed_size));
+    if ( decompressed_size != dest_size ) {
+        return false;
+    }
+
+    // Compress stores the data as is when RLE wouldn't make it smaller.
+    if ( size == sizeof(Uint64) + dest_size ) {
+        memcpy(dest, data + sizeof(Uint64), dest_size);
+        return true;
+    }
+
+    return Decompress(dest, dest_size, data, size);
+}
+
+/// Decode chunk data, as written by `Compress`, into `dest`.
+static bool
+DecodeChunk(GID * dest, size_t dest_size, const Uint8 * data, size_t size)
+{
+    ChunkHeader header;
+    if ( size < sizeof(header) ) {
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if ( header.size != dest_size ) {
+        return false;
+    }
+
+    if ( size == sizeof(header) + dest_size ) {
+        memcpy(dest, data + sizeof(header), dest_size);
+        return true;
+    }
+
+    // Filtered chunks decode into a scratch buffer first.
+    GID filtered[CHUNK_TILES];
+    GID * decoded = dest;
+    if ( header.filter != MAP_FILTER_NONE ) {
+        if ( header.filter >= MAP_NUM_FILTERS || dest_size != sizeof(filtered) ) {
+            return false;
+        }
+        decoded = filtered;
+    }
+
+    bool ok;
+    switch ( header.codec ) {
+        case MAP_CODEC_RLE:
+            ok = Decompress(decoded, dest_size, data, size);
+            break;
+        case MAP_CODEC_LZ:
+            ok = header.codec_version <= LZ_VERSION
+                && LZ_Decode(data + sizeof(header), size - sizeof(header),
+                             decoded, dest_size / sizeof(GID));
+            break;
+        default:
+            return false; // From a newer version of te.
+    }
+
+    if ( ok && decoded != dest ) {
+        UnfilterTiles(header.filter, decoded, dest, dest_size / sizeof(GID));
+    }
+
+    return ok;
+}
+
+/// Decode a chunk's `blob` into `dest`, if it matches its checksum.
+static bool
+DecodeBlob(GID * dest,
+           size_t dest_size,
+           const Uint8 * blob,
+           Uint32 blob_size,
+           Uint32 checksum)
+{
+    TraceBegin("decompress chunk");
+    bool ok = CRC_Compute(blob, blob_size) == checksum
+        && DecodeChunk(dest, dest_size, blob, blob_size);
+    TraceEnd("decompress chunk");
+
+    return ok;
+}
+
+// (Save snapshot only) The save encoded a new blob for the chunk.
+#define CHUNK_ENCODED 0x80
+// (Streaming) Queued to be paged in by the stream thread.
+#define CHUNK_REQUESTED 0x40
+// (Streaming) In the stream's list of chunks with decoded tiles.
+#define CHUNK_RESIDENT 0x20
+
+struct map_save {
+    SDL_Thread * thread;
+    SDL_AtomicInt finished;
+    bool succeeded;
+    char * path;
+
+    // Whether to add to the end of the map's file rather than write a new
+    // one, and where the data in the file ends, before the save and after.
+    bool append;
+    Uint64 file_end;
+
+    // A copy of the map's chunk grid. The tiles and blobs are shared with the
+    // map until it writes to them or frees them.
+    Map snapshot;
+
+    // Buffers the map let go of while the save might still be using them.
+    void ** retired;
+    int num_retired;
+    int retired_capacity;
+};
+
+typedef struct {
+    Uint32 index; // In the chunk table.
+    Uint32 generation;
+    const Uint8 * blob; // In the map's file, or a copy owned by the request.
+    Uint32 blob_size;
+    Uint32 checksum;
+    bool owns_blob;
+    GID * tiles; // Decoded tiles, or NULL if decoding failed.
+} PageRequest;
+
+struct map_stream {
+    SDL_Thread * thread;
+    SDL_Mutex * lock;
+    SDL_Condition * wake;
+    SDL_Condition * idle;
+
+    // Protected by `lock`. Requests are taken newest first, so that the
+    // chunks that came into view last are paged in first. There's always room
+    // in `done` for every request.
+    PageRequest * pending;
+    int num_pending;
+    PageRequest * done;
+    int num_done;
+    int capacity;
+    bool busy; // Decoding a request.
+    bool quit;
+
+    // Main thread only.
+    Uint32 generation; // Bumped when the chunk grid changes.
+    Uint32 tick; // Bumped every update.
+    Uint32 * resident; // Table indices of chunks with decoded tiles.
+    size_t num_resident;
+    size_t resident_capacity;
+};
+
+// Decoded tiles a map loaded from now on can keep, or 0 for no limit.
+static size_t memory_budget;
+
+static bool FinishSave(Map * map);
+static bool StartStream(Map * map);
+static void CancelRequests(Map * map);
+static void StopStream(Map * map);
+static bool PageInChunk(Map * map, size_t table_index);
+static void AddResident(Map * map, size_t table_index);
+
+static size_t NumChunks(const Map * map)
+{
+    return (size_t)map->chunks_w * (size_t)map->chunks_h;
+}
+
+/// Get the chunk containing tile (`x`, `y`).
+static Chunk * ChunkAt(const Map * map, int x, int y, int layer)
+{
+    int cx = x >> CHUNK_SHIFT;
+    int cy = y >> CHUNK_SHIFT;
+    return &map->chunks[layer][cy * map->chunks_w + cx];
+}
+
+/// Get the chunk table index of the chunk containing tile (`x`, `y`).
+static size_t ChunkIndex(const Map * map, int x, int y, int layer)
+{
+    size_t cx = (size_t)(x >> CHUNK_SHIFT);
+    size_t cy = (size_t)(y >> CHUNK_SHIFT);
+    return (size_t)layer * NumChunks(map) + cy * (size_t)map->chunks_w + cx;
+}
+
+/// Get the chunk at `table_index` in the map file's chunk table.
+static Chunk * TableChunk(const Map * map, size_t table_index)
+{
+    size_t num_chunks = NumChunks(map);
+    return &map->chunks[table_index / num_chunks][table_index % num_chunks];
+}
+
+static int TileIndex(int x, int y)
+{
+    return (y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK);
+}
+
+/// Whether `buffer` points into the map's file mapping.
+static bool IsFileData(const Map * map, const void * buffer)
+{
+    const Uint8 * p = buffer;
+    return p != NULL
+        && p >= map->file_data
+        && p < map->file_data + map->file_size;
+}
+
+static void FreeBuffer(const Map * map, void * buffer)
+{
+    if ( !IsFileData(map, buffer) ) {
+        SDL_free(buffer);
+    }
+}
+
+/// Free a buffer the map no longer needs, or hold on to it until the save in
+/// progress is done, as it might be using it.
+static void RetireBuffer(Map * map, void * buffer)
+{
+    MapSave * save = map->save;
+    if ( save == NULL || buffer == NULL || IsFileData(map, buffer) ) {
+        FreeBuffer(map, buffer);
+        return;
+    }
+
+    if ( save->num_retired == save->retired_capacity ) {
+        int new_capacity = save->retired_capacity ? save->retired_capacity * 2 : 64;
+        void ** new_list = SDL_realloc(save->retired,
+                                       (size_t)new_capacity * sizeof(*new_list));
+        if ( new_list == NULL ) {
+            fprintf(stderr, "%s: realloc failed, waiting for save\n", __func__);
+            FinishSave(map);
+            SDL_free(buffer);
+            return;
+        }
+
+        save->retired = new_list;
+        save->retired_capacity = new_capacity;
+    }
+
+    save->retired[save->num_retired++] = buffer;
+}
+
+static Uint16 CountUsedTiles(const GID * tiles)
+{
+    int count = 0;
+    for ( int i = 0; i < CHUNK_TILES; i++ ) {
+        count += tiles[i] != 0;
+    }
+
+    return (Uint16)count;
+}
+
+/// Count the chunk's non-empty tiles, freeing them if there are none.
+static void TrimChunk(Map * map, Chunk * chunk)
+{
+    if ( chunk->tiles == NULL ) {
+        chunk->num_used = 0;
+        return;
+    }
+
+    chunk->num_used = CountUsedTiles(chunk->tiles);
+    if ( chunk->num_used == 0 ) {
+        if ( chunk->flags & CHUNK_SHARED ) {
+            RetireBuffer(map, chunk->tiles);
+        } else {
+            FreeBuffer(map, chunk->tiles);
+        }
+        chunk->tiles = NULL;
+    }
+}
+
+/// Give `chunk` its own copy of its tiles if they still belong to the map's
+/// file or to a save in progress, so that they can be written to. Empty
+/// chunks have nothing to copy.
+static bool DetachChunk(Map * map, Chunk * chunk)
+{
+    bool shared = chunk->flags & CHUNK_SHARED;
+    if ( chunk->tiles == NULL || (!shared && !IsFileData(map, chunk->tiles)) ) {
+        return true;
+    }
+
+    GID * tiles = SDL_malloc(CHUNK_TILES * sizeof(GID));
+    if ( tiles == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    memcpy(tiles, chunk->tiles, CHUNK_TILES * sizeof(GID));
+    if ( shared ) {
+        RetireBuffer(map, chunk->tiles);
+    }
+
+    chunk->tiles = tiles;
+    chunk->num_used = CountUsedTiles(tiles);
+    chunk->flags &= (Uint8)~CHUNK_SHARED;
+    return true;
+}
+
+/// Copy a chunk's blob out of the map's file.
+static bool DetachBlob(Map * map, Chunk * chunk)
+{
+    if ( !IsFileData(map, chunk->blob) ) {
+        return true;
+    }
+
+    Uint8 * blob = SDL_malloc(chunk->blob_size);
+    if ( blob == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    memcpy(blob, chunk->blob, chunk->blob_size);
+    chunk->blob = blob;
+    return true;
+}
+
+/// Detach all chunks from the map's file and unmap it.
+static bool ReleaseFileData(Map * map)
+{
+    size_t num_chunks = NumChunks(map);
+
+    if ( map->stream != NULL ) {
+        CancelRequests(map); // Stop reading from the file.
+    }
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        for ( size_t i = 0; i < num_chunks; i++ ) {
+            Chunk * chunk = &map->chunks[l][i];
+            if ( !DetachChunk(map, chunk) || !DetachBlob(map, chunk) ) {
+                return false;
+            }
+        }
+    }
+
+    UnmapFile(map->file_data, map->file_size);
+    map->file_data = NULL;
+    map->file_size = 0;
+
+    return true;
+}
+
+/// Free `count` chunks and the array holding them.
+static void FreeChunks(Map * map, Chunk * chunks, size_t count)
+{
+    if ( chunks == NULL ) {
+        return;
+    }
+
+    for ( size_t i = 0; i < count; i++ ) {
+        if ( chunks[i].flags & CHUNK_SHARED ) {
+            RetireBuffer(map, chunks[i].tiles);
+        } else {
+            FreeBuffer(map, chunks[i].tiles);
+        }
+
+        RetireBuffer(map, chunks[i].blob);
+    }
+
+    SDL_free(chunks);
+}
+
+/// Allocate the chunk grid of each layer for the map's current size. All
+/// chunks start out empty, and are marked `dirty` if they need to be saved.
+static bool InitChunks(Map * map, bool dirty)
+{
+    map->chunks_w = (map->width + CHUNK_MASK) >> CHUNK_SHIFT;
+    map->chunks_h = (map->height + CHUNK_MASK) >> CHUNK_SHIFT;
+    size_t num_chunks = NumChunks(map);
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        map->chunks[l] = SDL_calloc(num_chunks, sizeof(Chunk));
+        if ( map->chunks[l] == NULL ) {
+            fprintf(stderr, "%s: calloc failed\n", __func__);
+            return false;
+        }
+
+        for ( size_t i = 0; i < num_chunks; i++ ) {
+            map->chunks[l][i].flags = dirty
+                ? CHUNK_DIRTY | CHUNK_REDRAW
+                : CHUNK_REDRAW;
+        }
+    }
+
+    return true;
+}
+
+void FreeMap(Map * map)
+{
+    if ( map->save != NULL ) {
+        FinishSave(map);
+    }
+
+    if ( map->stream != NULL ) {
+        StopStream(map);
+    }
+
+    for ( int i = 0; i < map->num_layers; i++ ) {
+        FreeChunks(map, map->chunks[i], NumChunks(map));
+    }
+
+    UnmapFile(map->file_data, map->file_size);
+    SDL_free(map->path);
+    memset(map, 0, sizeof(Map));
+}
+
+#ifdef __APPLE__
+#pragma mark - SAVING
+#endif
+
+typedef struct {
+    Map * map;
+    SDL_AtomicInt errors;
+} EncodeJobs;
+
+/// Encode a new blob for a dirty chunk.
+static void EncodeChunkJob(void * data, int index)
+{
+    static const GID empty_tiles[CHUNK_TILES];
+
+    EncodeJobs * jobs = data;
+    Chunk * chunk = TableChunk(jobs->map, (size_t)index);
+
+    if ( !(chunk->flags & CHUNK_DIRTY) ) {
+        return;
+    }
+
+    const GID * tiles = chunk->tiles ? chunk->tiles : empty_tiles;
+
+    // Recompressing a chunk that isn't paged in.
+    GID decoded[CHUNK_TILES];
+    if ( chunk->flags & CHUNK_PAGED_OUT ) {
+        if ( !DecodeBlob(decoded, sizeof(decoded),
+                         chunk->blob, chunk->blob_size, chunk->checksum) ) {
+            SDL_AddAtomicInt(&jobs->errors, 1);
+            return;
+        }
+        tiles = decoded;
+    }
+
+    size_t layer = (size_t)index / NumChunks(jobs->map);
+    size_t size = 0;
+    TraceBegin("compress chunk");
+    Uint8 * blob = Compress(tiles,
+                            CHUNK_TILES * sizeof(GID),
+                            jobs->map->codec,
+                            jobs->map->filters[layer],
+                            &size);
+    TraceEnd("compress chunk");
+    if ( blob == NULL ) {
+        SDL_AddAtomicInt(&jobs->errors, 1);
+        return;
+    }
+
+    chunk->blob = blob;
+    chunk->blob_size = (Uint32)size;
+    chunk->checksum = CRC_Compute(blob, size);
+    chunk->flags &= (Uint8)~CHUNK_DIRTY;
+    chunk->flags |= CHUNK_ENCODED;
+}
+
+/// Flush `file` all the way to disk, so that it can safely replace another.
+static bool SyncFile(FILE * file)
+{
+    if ( fflush(file) != 0 ) {
+        return false;
+    }
+#ifdef _WIN32
+    return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file)));
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+static bool ReplaceFile(const char * src, const char * dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(src, dst,
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    return rename(src, dst) == 0;
+#endif
+}
+
+/// The space a blob of `size` bytes takes in a map file: a whole number of
+/// words, so that the next one starts on a word boundary.
+static Uint64 PaddedSize(Uint32 size)
+{
+    return size + size % sizeof(Uint16);
+}
+
+/// Write a chunk's blob and its padding.
+static bool WriteBlob(FILE * file, const Chunk * chunk)
+{
+    static const Uint8 padding[sizeof(Uint16)];
+    size_t padding_size = chunk->blob_size % sizeof(Uint16);
+
+    return fwrite(chunk->blob, chunk->blob_size, 1, file) == 1
+        && fwrite(padding, 1, padding_size, file) == padding_size;
+}
+
+/// Move `file`'s position to `offset` bytes from the start.
+static bool SeekFile(FILE * file, Uint64 offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/// The header for the map, with its checksum of itself and `table`.
+static MapHeader
+MakeHeader(const Map * map,
+           const ChunkInfo * table,
+           size_t table_count,
+           Uint64 table_offset)
+{
+    MapHeader header = {
+        .magic = MAP_MAGIC,
+        .version = MAP_VERSION,
+        .width = map->width,
+        .height = map->height,
+        .bg_color[0] = map->bg_color.r,
+        .bg_color[1] = map->bg_color.g,
+        .bg_color[2] = map->bg_color.b,
+        .num_layers = map->num_layers,
+        .chunk_size = CHUNK_SIZE,
+        .codec = map->codec,
+        .table_offset = table_offset,
+    };
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        header.filters[l] = (Uint8)map->filters[l];
+    }
+
+    Uint32 checksum = CRC_Compute(&header, sizeof(header));
+    header.checksum = CRC_Update(checksum, table, sizeof(*table) * table_count);
+
+    return header;
+}
+
+/// Write the whole map to a temporary file and move it over the save's path
+/// once complete.
+static bool RewriteMapFile(MapSave * save, ChunkInfo * table, size_t table_count)
+{
+    Map * map = &save->snapshot;
+    const char * path = save->path;
+
+    Uint64 table_offset = sizeof(MapHeader);
+    Uint64 offset = table_offset + sizeof(*table) * table_count;
+    for ( size_t i = 0; i < table_count; i++ ) {
+        Chunk * chunk = TableChunk(map, i);
+        chunk->offset = offset;
+        table[i].offset = offset;
+        table[i].size = chunk->blob_size;
+        table[i].checksum = chunk->checksum;
+        offset += PaddedSize(chunk->blob_size);
+    }
+
+    MapHeader header = MakeHeader(map, table, table_count, table_offset);
+
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE * file = fopen(temp_path, "wb");
+    if ( file == NULL ) {
+        fprintf(stderr,
+                "%s: failed to create file at path '%s'\n", __func__, temp_path);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(table, sizeof(*table), table_count, file) == table_count;
+
+    for ( size_t i = 0; ok && i < table_count; i++ ) {
+        ok = WriteBlob(file, TableChunk(map, i));
+    }
+
+    ok = ok && SyncFile(file);
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && ReplaceFile(temp_path, path);
+
+    if ( !ok ) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path);
+        remove(temp_path);
+        return false;
+    }
+
+    save->file_end = offset;
+    return true;
+}
+
+/// Add the chunks the save encoded and a new chunk table to the end of the
+/// file at the save's path, then point its header at them. The rest of the
+/// chunks stay where they are.
+static bool AppendMapFile(MapSave * save, ChunkInfo * table, size_t table_count)
+{
+    Map * map = &save->snapshot;
+    const char * path = save->path;
+
+    FILE * file = fopen(path, "r+b");
+    if ( file == NULL ) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path);
+        return false;
+    }
+
+    Uint64 offset = save->file_end + save->file_end % sizeof(Uint16);
+    bool ok = SeekFile(file, offset);
+
+    for ( size_t i = 0; ok && i < table_count; i++ ) {
+        Chunk * chunk = TableChunk(map, i);
+        if ( chunk->flags & CHUNK_ENCODED ) {
+            chunk->offset = offset;
+            ok = WriteBlob(file, chunk);
+            offset += PaddedSize(chunk->blob_size);
+        }
+
+        table[i].offset = chunk->offset;
+        table[i].size = chunk->blob_size;
+        table[i].checksum = chunk->checksum;
+    }
+
+    Uint64 table_offset = offset;
+    offset += sizeof(*table) * table_count;
+    ok = ok && fwrite(table, sizeof(*table), table_count, file) == table_count;
+
+    // The new chunks and table have to be on disk before the header points
+    // at them.
+    MapHeader header = MakeHeader(map, table, table_count, table_offset);
+    ok = ok
+        && SyncFile(file)
+        && SeekFile(file, 0)
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && SyncFile(file);
+    ok = (fclose(file) == 0) && ok;
+
+    if ( !ok ) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path);
+        return false;
+    }
+
+    save->file_end = offset;
+    return true;
+}
+
+/// Write the map saved by `save`, encoding any dirty chunks, either at the
+/// end of the file at the save's path or to a new one.
+static bool WriteMapFile(MapSave * save)
+{
+    Map * map = &save->snapshot;
+
+    // Chunks that haven't changed are written as is; the rest are encoded in
+    // parallel first.
+    size_t table_count = NumChunks(map) * map->num_layers;
+    EncodeJobs jobs = { .map = map };
+    SDL_SetAtomicInt(&jobs.errors, 0);
+    RunJobs(EncodeChunkJob, &jobs, (int)table_count);
+
+    if ( SDL_GetAtomicInt(&jobs.errors) > 0 ) {
+        fprintf(stderr, "%s: failed to compress chunks\n", __func__);
+        return false;
+    }
+
+    ChunkInfo * table = SDL_calloc(table_count, sizeof(*table));
+    if ( table == NULL ) {
+        fprintf(stderr, "%s: calloc failed\n", __func__);
+        return false;
+    }
+
+    bool ok = save->append
+        ? AppendMapFile(save, table, table_count)
+        : RewriteMapFile(save, table, table_count);
+    SDL_free(table);
+
+    return ok;
+}
+
+static int SaveThread(void * data)
+{
+    MapSave * save = data;
+    TraceBegin("write map");
+    save->succeeded = WriteMapFile(save);
+    TraceEnd("write map");
+    SDL_SetAtomicInt(&save->finished, 1);
+
+    return 0;
+}
+
+/// Wait for the map's save to finish and hand the chunk blobs it encoded,
+/// and where it wrote each chunk, over to the map.
+///
+/// - returns: Whether the save succeeded.
+static bool FinishSave(Map * map)
+{
+    MapSave * save = map->save;
+    if ( save->thread != NULL ) {
+        TraceBegin("wait for save");
+        SDL_WaitThread(save->thread, NULL);
+        TraceEnd("wait for save");
+    }
+
+    map->save = NULL;
+
+    Map * snapshot = &save->snapshot;
+    size_t num_chunks = NumChunks(snapshot);
+    bool same_layout = snapshot->chunks_w == map->chunks_w
+        && snapshot->chunks_h == map->chunks_h;
+
+    for ( int l = 0; l < snapshot->num_layers; l++ ) {
+        for ( size_t i = 0; i < num_chunks; i++ ) {
+            Chunk * saved = &snapshot->chunks[l][i];
+
+            // A chunk that the map hasn't written to since is now clean.
+            Chunk * chunk = same_layout ? &map->chunks[l][i] : NULL;
+            bool adopt = save->succeeded
+                && chunk != NULL
+                && (chunk->flags & CHUNK_SHARED);
+
+            if ( adopt ) {
+                chunk->offset = saved->offset;
+            }
+
+            if ( !(saved->flags & CHUNK_ENCODED) ) {
+                continue;
+            }
+
+            if ( adopt ) {
+                FreeBuffer(map, chunk->blob);
+                chunk->blob = saved->blob;
+                chunk->blob_size = saved->blob_size;
+                chunk->checksum = saved->checksum;
+                chunk->flags &= (Uint8)~CHUNK_DIRTY;
+            } else {
+                SDL_free(saved->blob);
+            }
+        }
+    }
+
+    // Later saves to the file add to it, as long as each clean chunk knows
+    // where it is in there. After a failed save, it's not certain what the
+    // file's header points at.
+    SDL_free(map->path);
+    map->path = NULL;
+    if ( save->succeeded && same_layout ) {
+        map->path = save->path;
+        map->file_end = save->file_end;
+        save->path = NULL;
+    }
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        for ( size_t i = 0; i < NumChunks(map); i++ ) {
+            map->chunks[l][i].flags &= (Uint8)~CHUNK_SHARED;
+        }
+    }
+
+    for ( int i = 0; i < save->num_retired; i++ ) {
+        SDL_free(save->retired[i]);
+    }
+
+    for ( int l = 0; l < snapshot->num_layers; l++ ) {
+        SDL_free(snapshot->chunks[l]);
+    }
+
+    bool succeeded = save->succeeded;
+    SDL_free(save->retired);
+    SDL_free(save->path);
+    SDL_free(save);
+
+    return succeeded;
+}
+
+/// Whether saving the map to `path` can add to the end of the file: it's
+/// the file the map's clean chunks are in, and no more than half of it is
+/// out of date.
+static bool CanAppend(const Map * map, const char * path)
+{
+    if ( map->path == NULL || strcmp(map->path, path) != 0 ) {
+        return false;
+    }
+
+    size_t table_count = NumChunks(map) * map->num_layers;
+    Uint64 in_use = sizeof(MapHeader) + sizeof(ChunkInfo) * table_count;
+    for ( size_t i = 0; i < table_count; i++ ) {
+        const Chunk * chunk = TableChunk(map, i);
+        if ( !(chunk->flags & CHUNK_DIRTY) ) {
+            in_use += chunk->blob_size;
+        }
+    }
+
+    return map->file_end <= in_use * 2;
+}
+
+bool StartSaveMap(Map * map, const char * path)
+{
+    if ( map->save != NULL ) {
+        FinishSave(map); // One at a time.
+    }
+
+    bool append = CanAppend(map, path);
+
+#ifdef _WIN32
+    // Windows won't replace a file that's still mapped.
+    if ( !append && !ReleaseFileData(map) ) {
+        return false;
+    }
+#endif
+
+    MapSave * save = SDL_calloc(1, sizeof(*save));
+    if ( save == NULL ) {
+        fprintf(stderr, "%s: calloc failed\n", __func__);
+        return false;
+    }
+
+    save->path = SDL_strdup(path);
+    save->append = append;
+    save->file_end = map->file_end;
+    save->snapshot = (Map){
+        .width = map->width,
+        .height = map->height,
+        .num_layers = map->num_layers,
+        .bg_color = map->bg_color,
+        .codec = map->codec,
+        .chunks_w = map->chunks_w,
+        .chunks_h = map->chunks_h,
+    };
+    memcpy(save->snapshot.filters, map->filters, sizeof(map->filters));
+
+    // Take the snapshot: a copy of the chunk grid. From here on, the map
+    // copies a chunk's tiles before writing to them. SDL_malloc(0) returns a
+    // pointer, like SDL_calloc in InitChunks, so a map with no chunks works.
+    TraceBegin("snapshot map");
+    size_t num_chunks = NumChunks(map);
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        save->snapshot.chunks[l] = SDL_malloc(num_chunks * sizeof(Chunk));
+        if ( save->snapshot.chunks[l] == NULL ) {
+            fprintf(stderr, "%s: malloc failed\n", __func__);
+            for ( int i = 0; i < l; i++ ) {
+                SDL_free(save->snapshot.chunks[i]);
+            }
+            SDL_free(save->path);
+            SDL_free(save);
+            TraceEnd("snapshot map");
+            return false;
+        }
+
+        for ( size_t i = 0; i < num_chunks; i++ ) {
+            map->chunks[l][i].flags |= CHUNK_SHARED;
+        }
+
+        memcpy(save->snapshot.chunks[l],
+               map->chunks[l],
+               num_chunks * sizeof(Chunk));
+    }
+    TraceEnd("snapshot map");
+
+    SDL_SetAtomicInt(&save->finished, 0);
+    map->save = save;
+
+    save->thread = SDL_CreateThread(SaveThread, "te save", save);
+    if ( save->thread == NULL ) {
+        fprintf(stderr, "%s: could not start save thread (%s), saving now\n",
+                __func__, SDL_GetError());
+        SaveThread(save);
+    }
+
+    return true;
+}
+
+SaveStatus UpdateSaveMap(Map * map)
+{
+    if ( map->save == NULL ) {
+        return SAVE_IDLE;
+    }
+
+    if ( !SDL_GetAtomicInt(&map->save->finished) ) {
+        return SAVE_IN_PROGRESS;
+    }
+
+    return FinishSave(map) ? SAVE_SUCCEEDED : SAVE_FAILED;
+}
+
+bool SaveMap(Map * map, const char * path)
+{
+    return StartSaveMap(map, path) && FinishSave(map);
+}
+
+#ifdef __APPLE__
+#pragma mark - LOADING
+#endif
+
+/// Point `chunk` at its data in the map's file, or decompress it from there.
+/// If not `decode`, compressed chunks are left paged out, to be checked
+/// against their checksum when they're paged in.
+static bool
+LoadChunk(Map * map,
+          Chunk * chunk,
+          const ChunkInfo * info,
+          int version,
+          bool decode)
+{
+    const size_t tiles_size = CHUNK_TILES * sizeof(GID);
+
+    if ( info->offset > map->file_size
+        || info->size > map->file_size - info->offset ) {
+        return false;
+    }
+
+    Uint8 * data = map->file_data + info->offset;
+    const Uint8 * payload = data + sizeof(ChunkHeader);
+    bool in_place = info->size == sizeof(ChunkHeader) + tiles_size
+        && (uintptr_t)payload % sizeof(GID) == 0;
+
+    // Until the chunk changes, saves write this data back out as is.
+    chunk->blob = data;
+    chunk->blob_size = info->size;
+    chunk->offset = info->offset;
+
+    if ( version < 5 ) {
+        // Older files have no checksums, so there's nothing to check against.
+        chunk->checksum = CRC_Compute(data, info->size);
+    } else {
+        chunk->checksum = info->checksum;
+        if ( (decode || in_place)
+            && CRC_Compute(data, info->size) != info->checksum ) {
+            return false;
+        }
+    }
+
+    // Uncompressed chunks are used in place; SetMapTile copies them on the
+    // first write.
+    if ( in_place ) {
+        ChunkHeader header;
+        memcpy(&header, data, sizeof(header));
+        chunk->tiles = (GID *)payload;
+        return header.size == tiles_size && header.filter == MAP_FILTER_NONE;
+    }
+
+    if ( !decode ) {
+        chunk->flags |= CHUNK_PAGED_OUT;
+        return true;
+    }
+
+    chunk->tiles = SDL_malloc(tiles_size);
+    if ( chunk->tiles == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    if ( !DecodeChunk(chunk->tiles, tiles_size, data, info->size) ) {
+        return false;
+    }
+
+    TrimChunk(map, chunk); // Don't keep empty chunks around.
+    return true;
+}
+
+typedef struct {
+    Map * map;
+    const Uint8 * table;
+    int version;
+    bool streaming;
+    SDL_AtomicInt errors;
+} LoadJobs;
+
+static void LoadChunkJob(void * data, int index)
+{
+    LoadJobs * jobs = data;
+    Chunk * chunk = TableChunk(jobs->map, (size_t)index);
+
+    ChunkInfo info;
+    memcpy(&info, jobs->table + sizeof(info) * (size_t)index, sizeof(info));
+
+    if ( !LoadChunk(jobs->map, chunk, &info, jobs->version, !jobs->streaming) ) {
+        SDL_AddAtomicInt(&jobs->errors, 1);
+    }
+}
+
+/// The size of the `MapHeader` in files of `version`, which only grows.
+static size_t HeaderSize(int version)
+{
+    if ( version <= 2 ) {
+        return offsetof(MapHeader, codec);
+    } else if ( version == 3 ) {
+        return offsetof(MapHeader, filters);
+    } else if ( version == 4 ) {
+        return offsetof(MapHeader, checksum);
+    } else if ( version == 5 ) {
+        return offsetof(MapHeader, table_offset);
+    }
+
+    return sizeof(MapHeader);
+}
+
+static bool LoadChunkedMap(Map * map, const char * path)
+{
+    // Read the part common to all versions first.
+    MapHeader header = { 0 };
+    size_t header_size = HeaderSize(2);
+    if ( map->file_size < header_size ) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, path);
+        return false;
+    }
+    memcpy(&header, map->file_data, header_size);
+
+    if ( header.version > MAP_VERSION ) {
+        fprintf(stderr, "%s: '%s' is from a newer version of te (%d)\n",
+                __func__, path, header.version);
+        return false;
+    }
+
+    if ( HeaderSize(header.version) > header_size ) {
+        header_size = HeaderSize(header.version);
+        if ( map->file_size < header_size ) {
+            fprintf(stderr, "%s: '%s' is truncated\n", __func__, path);
+            return false;
+        }
+        memcpy(&header, map->file_data, header_size);
+    }
+
+    if ( header.chunk_size != CHUNK_SIZE ) {
+        fprintf(stderr, "%s: unsupported chunk size (%d)\n",
+                __func__, header.chunk_size);
+        return false;
+    }
+
+    if ( header.num_layers > MAX_LAYERS ) {
+        fprintf(stderr, "%s: invalid number of layers (%d)\n",
+                __func__, header.num_layers);
+        return false;
+    }
+
+    map->num_layers = header.num_layers;
+    map->width = header.width;
+    map->height = header.height;
+    map->bg_color.r = header.bg_color[0];
+    map->bg_color.g = header.bg_color[1];
+    map->bg_color.b = header.bg_color[2];
+    map->bg_color.a = 255;
+    map->codec = header.codec < MAP_NUM_CODECS ? header.codec : MAP_CODEC_RLE;
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        Uint8 filter = header.filters[l];
+        map->filters[l] = filter < MAP_NUM_FILTERS ? filter : MAP_FILTER_NONE;
+    }
+
+    printf("Loading %d x %d map with %d layers\n",
+           map->width, map->height, map->num_layers);
+
+    // Read chunk table.
+    map->chunks_w = (map->width + CHUNK_MASK) >> CHUNK_SHIFT;
+    map->chunks_h = (map->height + CHUNK_MASK) >> CHUNK_SHIFT;
+    size_t num_chunks = NumChunks(map);
+    size_t table_count = num_chunks * map->num_layers;
+    size_t table_size = sizeof(ChunkInfo) * table_count;
+    Uint64 table_offset = header.version >= 6 ? header.table_offset : header_size;
+    if ( table_offset > map->file_size
+        || map->file_size - table_offset < table_size ) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, path);
+        return false;
+    }
+
+    const Uint8 * table = map->file_data + table_offset;
+    if ( header.version >= 5 ) {
+        Uint32 checksum = header.checksum;
+        header.checksum = 0;
+        Uint32 actual = CRC_Compute(&header, header_size);
+        actual = CRC_Update(actual, table, table_size);
+        if ( actual != checksum ) {
+            fprintf(stderr, "%s: '%s' has a corrupt header\n", __func__, path);
+            return false;
+        }
+    }
+
+    if ( !InitChunks(map, false) ) {
+        return false;
+    }
+
+    // Maps that would go over budget are streamed: their chunks stay in the
+    // file until they come into view.
+    size_t decoded_size = table_count * CHUNK_TILES * sizeof(GID);
+    bool streaming = memory_budget != 0 && decoded_size > memory_budget;
+
+    // Using the chunk table, decompress each chunk straight from the mapped
+    // file into its final buffer. Chunks are independent, so they are
+    // spread across the worker threads.
+    LoadJobs jobs = {
+        .map = map,
+        .table = table,
+        .version = header.version,
+        .streaming = streaming,
+    };
+    SDL_SetAtomicInt(&jobs.errors, 0);
+    RunJobs(LoadChunkJob, &jobs, (int)table_count);
+
+    if ( SDL_GetAtomicInt(&jobs.errors) > 0 ) {
+        fprintf(stderr, "%s: '%s' has %d corrupt chunk(s)\n",
+                __func__, path, SDL_GetAtomicInt(&jobs.errors));
+        return false;
+    }
+
+    // Saves can add to files of this version rather than rewrite them.
+    if ( header.version == MAP_VERSION ) {
+        map->path = SDL_strdup(path);
+        map->file_end = map->file_size;
+    }
+
+    if ( streaming ) {
+        printf("Streaming map: %zu MB decoded, %zu MB budget\n",
+               decoded_size >> 20, memory_budget >> 20);
+        map->memory_budget = memory_budget;
+        return StartStream(map);
+    }
+
+    return true;
+}
+
+/// Copy a row of `count` tiles from `tiles` into the map, starting at tile
+/// (`x`, `y`). Chunks are allocated once a non-empty tile lands in them.
+static bool CopyRowToChunks(Map * map, int x, int y, int layer,
+                            const GID * tiles, int count)
+{
+    while ( count > 0 ) {
+        int n = SDL_min(CHUNK_SIZE - (x & CHUNK_MASK), count);
+        Chunk * chunk = ChunkAt(map, x, y, layer);
+
+        if ( chunk->tiles == NULL ) {
+            bool empty = true;
+            for ( int i = 0; empty && i < n; i++ ) {
+                empty = tiles[i] == 0;
+            }
+
+            if ( !empty ) {
+                chunk->tiles = SDL_calloc(CHUNK_TILES, sizeof(GID));
+                if ( chunk->tiles == NULL ) {
+                    fprintf(stderr, "%s: calloc failed\n", __func__);
+                    return false;
+                }
+            }
+        }
+
+        if ( chunk->tiles != NULL ) {
+            memcpy(&chunk->tiles[TileIndex(x, y)], tiles, (size_t)n * sizeof(GID));
+        }
+
+        tiles += n;
+        x += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+typedef struct {
+    Map * map;
+    const LayerInfo * layer_info;
+    SDL_AtomicInt errors;
+} LegacyLoadJobs;
+
+static void LoadLegacyLayerJob(void * data, int layer)
+{
+    LegacyLoadJobs * jobs = data;
+    Map * map = jobs->map;
+    size_t offset = jobs->layer_info[layer].offset;
+    size_t data_size = jobs->layer_info[layer].size;
+
+    size_t layer_size = (size_t)map->width * map->height * sizeof(GID);
+
+    // Check the layer's size before allocating it.
+    Uint64 decompressed_size = 0;
+    bool in_file = offset <= map->file_size
+        && data_size <= map->file_size - offset
+        && data_size >= sizeof(decompressed_size);
+    if ( in_file ) {
+        memcpy(&decompressed_size, map->file_data + offset, sizeof(Uint64));
+    }
+
+    GID * tiles = NULL;
+    if ( in_file && decompressed_size == layer_size ) {
+        tiles = SDL_malloc(layer_size + sizeof(GID));
+        if ( tiles == NULL ) {
+            fprintf(stderr, "%s: malloc failed\n", __func__);
+            SDL_AddAtomicInt(&jobs->errors, 1);
+            return;
+        }
+    }
+
+    if ( tiles == NULL
+        || !DecodeLayer(tiles, layer_size, map->file_data + offset, data_size) ) {
+        fprintf(stderr, "%s: layer %d data is corrupt\n", __func__, layer);
+        SDL_AddAtomicInt(&jobs->errors, 1);
+        SDL_free(tiles);
+        return;
+    }
+
+    for ( int y = 0; y < map->height; y++ ) {
+        if ( !CopyRowToChunks(map, 0, y, layer, &tiles[y * map->width], map->width) ) {
+            SDL_AddAtomicInt(&jobs->errors, 1);
+            break;
+        }
+    }
+
+    for ( size_t i = 0; i < NumChunks(map); i++ ) {
+        TrimChunk(map, &map->chunks[layer][i]);
+    }
+
+    SDL_free(tiles);
+}
+
+static bool LoadLegacyMap(Map * map, const char * path)
+{
+    LegacyMapHeader header;
+    if ( map->file_size < sizeof(header) ) {
+        fprintf(stderr, "%s: '%s' is too small to be a map\n", __func__, path);
+        return false;
+    }
+    memcpy(&header, map->file_data, sizeof(header));
+
+    if ( header.num_layers > MAX_LAYERS ) {
+        fprintf(stderr, "%s: invalid number of layers (%d)\n",
+                __func__, header.num_layers);
+        return false;
+    }
+
+    map->num_layers = header.num_layers;
+    map->width = header.width;
+    map->height = header.height;
+    map->bg_color.r = header.bg_color[0];
+    map->bg_color.g = header.bg_color[1];
+    map->bg_color.b = header.bg_color[2];
+    map->bg_color.a = 255;
+
+    printf("Loading %d x %d map with %d layers (version 1)\n",
+           map->width, map->height, map->num_layers);
+
+    // Read layer info table.
+    LayerInfo layer_info[MAX_LAYERS];
+    size_t table_size = sizeof(layer_info[0]) * map->num_layers;
+    if ( map->file_size < sizeof(header) + table_size ) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, path);
+        return false;
+    }
+    memcpy(layer_info, map->file_data + sizeof(header), table_size);
+
+    if ( !InitChunks(map, true) ) {
+        return false;
+    }
+
+    // Decompress each layer and split it into chunks, one layer per job.
+    LegacyLoadJobs jobs = { .map = map, .layer_info = layer_info };
+    SDL_SetAtomicInt(&jobs.errors, 0);
+    RunJobs(LoadLegacyLayerJob, &jobs, map->num_layers);
+
+    if ( SDL_GetAtomicInt(&jobs.errors) > 0 ) {
+        return false;
+    }
+
+    // Nothing points into the old file, and the next save replaces it.
+    return ReleaseFileData(map);
+}
+
+static bool LoadMapFile(Map * map, const char * path)
+{
+    if ( map == NULL ) {
+        // TODO: assert
+        fprintf(stderr, "%s: map parameter is NULL\n", __func__);
+        return false;
+    }
+
+    // Free previously loaded map.
+    FreeMap(map);
+
+    map->file_data = MapFile(path, &map->file_size);
+    if ( map->file_data == NULL ) {
+        // TODO: error
+        return false;
+    }
+
+    Uint32 magic = 0;
+    if ( map->file_size >= sizeof(magic) ) {
+        memcpy(&magic, map->file_data, sizeof(magic));
+    }
+
+    bool loaded;
+    if ( magic == MAP_MAGIC ) {
+        loaded = LoadChunkedMap(map, path);
+    } else {
+        loaded = LoadLegacyMap(map, path);
+    }
+
+    if ( !loaded ) {
+        FreeMap(map);
+    }
+
+    return loaded;
+}
+
+bool LoadMap(Map * map, const char * path)
+{
+    TraceBegin("load map");
+    bool loaded = LoadMapFile(map, path);
+    TraceEnd("load map");
+
+    return loaded;
+}
+
+bool CreateMap(const char * path, Uint16 w, Uint16 h, Uint8 num_layers)
+{
+    FILE * file = fopen(path, "rb");
+    if ( file != NULL ) {
+        fclose(file); // File already exists, do nothing.
+        return false;
+    }
+
+    if ( num_layers == 0 || num_layers > MAX_LAYERS ) {
+        fprintf(stderr, "%s: invalid number of layers (%d)\n",
+                __func__, num_layers);
+        return false;
+    }
+
+    Map map = {
+        .width = w,
+        .height = h,
+        .num_layers = num_layers,
+    };
+
+    // TODO: bg_color
+
+    // Chunks start out empty and take no memory until they're drawn in.
+    if ( !InitChunks(&map, true) ) {
+        FreeMap(&map);
+        return false;
+    }
+
+    SaveMap(&map, path); // Create the file
+    FreeMap(&map);
+
+    return true;
+}
+
+#ifdef __APPLE__
+#pragma mark - STREAMING
+#endif
+
+void SetMapMemoryBudget(size_t bytes)
+{
+    memory_budget = bytes;
+}
+
+static int StreamThread(void * data)
+{
+    MapStream * stream = data;
+    const size_t tiles_size = CHUNK_TILES * sizeof(GID);
+
+    SDL_LockMutex(stream->lock);
+    while ( !stream->quit ) {
+        if ( stream->num_pending == 0 ) {
+            SDL_WaitCondition(stream->wake, stream->lock);
+            continue;
+        }
+
+        PageRequest request = stream->pending[--stream->num_pending];
+        stream->busy = true;
+        SDL_UnlockMutex(stream->lock);
+
+        request.tiles = SDL_malloc(tiles_size);
+        if ( request.tiles != NULL
+            && !DecodeBlob(request.tiles, tiles_size,
+                           request.blob, request.blob_size,
+                           request.checksum) ) {
+            SDL_free(request.tiles);
+            request.tiles = NULL;
+        }
+
+        SDL_LockMutex(stream->lock);
+        stream->done[stream->num_done++] = request;
+        stream->busy = false;
+        SDL_BroadcastCondition(stream->idle);
+    }
+    SDL_UnlockMutex(stream->lock);
+
+    return 0;
+}
+
+static bool StartStream(Map * map)
+{
+    MapStream * stream = SDL_calloc(1, sizeof(*stream));
+    if ( stream == NULL ) {
+        fprintf(stderr, "%s: calloc failed\n", __func__);
+        return false;
+    }
+
+    map->stream = stream;
+    stream->lock = SDL_CreateMutex();
+    stream->wake = SDL_CreateCondition();
+    stream->idle = SDL_CreateCondition();
+    if ( stream->lock == NULL || stream->wake == NULL || stream->idle == NULL ) {
+        fprintf(stderr, "%s: %s\n", __func__, SDL_GetError());
+        return false;
+    }
+
+    stream->thread = SDL_CreateThread(StreamThread, "te stream", stream);
+    if ( stream->thread == NULL ) {
+        fprintf(stderr, "%s: could not start stream thread (%s), "
+                "chunks will be paged in on demand\n", __func__, SDL_GetError());
+    }
+
+    return true;
+}
+
+/// Free a request that's been taken out of the stream's queues.
+static void FreeRequest(PageRequest * request)
+{
+    SDL_free(request->tiles);
+    if ( request->owns_blob ) {
+        SDL_free((Uint8 *)request->blob);
+    }
+}
+
+/// Drop requests the stream thread hasn't started on, and wait for the one
+/// it's on to finish, so that it no longer reads the map's file.
+static void CancelRequests(Map * map)
+{
+    MapStream * stream = map->stream;
+
+    SDL_LockMutex(stream->lock);
+    for ( int i = 0; i < stream->num_pending; i++ ) {
+        PageRequest * request = &stream->pending[i];
+        if ( request->generation == stream->generation ) {
+            TableChunk(map, request->index)->flags &= (Uint8)~CHUNK_REQUESTED;
+        }
+        FreeRequest(request);
+    }
+    stream->num_pending = 0;
+
+    while ( stream->busy ) {
+        SDL_WaitCondition(stream->idle, stream->lock);
+    }
+    SDL_UnlockMutex(stream->lock);
+}
+
+static void StopStream(Map * map)
+{
+    MapStream * stream = map->stream;
+
+    if ( stream->thread != NULL ) {
+        SDL_LockMutex(stream->lock);
+        stream->quit = true;
+        SDL_BroadcastCondition(stream->wake);
+        SDL_UnlockMutex(stream->lock);
+        SDL_WaitThread(stream->thread, NULL);
+    }
+
+    for ( int i = 0; i < stream->num_pending; i++ ) {
+        FreeRequest(&stream->pending[i]);
+    }
+
+    for ( int i = 0; i < stream->num_done; i++ ) {
+        FreeRequest(&stream->done[i]);
+    }
+
+    SDL_DestroyCondition(stream->idle);
+    SDL_DestroyCondition(stream->wake);
+    SDL_DestroyMutex(stream->lock);
+    SDL_free(stream->pending);
+    SDL_free(stream->done);
+    SDL_free(stream->resident);
+    SDL_free(stream);
+    map->stream = NULL;
+}
+
+/// Note that a chunk of a streamed map has decoded tiles, which makes it a
+/// candidate for eviction.
+static void AddResident(Map * map, size_t table_index)
+{
+    MapStream * stream = map->stream;
+    Chunk * chunk = TableChunk(map, table_index);
+    if ( stream == NULL || (chunk->flags & CHUNK_RESIDENT) ) {
+        return;
+    }
+
+    if ( stream->num_resident == stream->resident_capacity ) {
+        size_t new_capacity = stream->resident_capacity
+            ? stream->resident_capacity * 2
+            : 1024;
+        Uint32 * new_list = SDL_realloc(stream->resident,
+                                        new_capacity * sizeof(*new_list));
+        if ( new_list == NULL ) {
+            return; // It just won't be evicted.
+        }
+
+        stream->resident = new_list;
+        stream->resident_capacity = new_capacity;
+    }
+
+    stream->resident[stream->num_resident++] = (Uint32)table_index;
+    chunk->flags |= CHUNK_RESIDENT;
+}
+
+/// Give a paged out chunk its decoded `tiles`.
+static void InstallChunk(Map * map, size_t table_index, GID * tiles)
+{
+    Chunk * chunk = TableChunk(map, table_index);
+    chunk->tiles = tiles;
+    chunk->flags &= (Uint8)~CHUNK_PAGED_OUT;
+    chunk->flags |= CHUNK_REDRAW;
+    chunk->last_used = map->stream->tick;
+
+    TrimChunk(map, chunk);
+    if ( chunk->tiles != NULL ) {
+        AddResident(map, table_index);
+    }
+}
+
+/// Decode a paged out chunk now, rather than wait for the stream thread.
+static bool PageInChunk(Map * map, size_t table_index)
+{
+    Chunk * chunk = TableChunk(map, table_index);
+    if ( !(chunk->flags & CHUNK_PAGED_OUT) ) {
+        return true;
+    }
+
+    const size_t tiles_size = CHUNK_TILES * sizeof(GID);
+    GID * tiles = SDL_malloc(tiles_size);
+    if ( tiles == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    if ( !DecodeBlob(tiles, tiles_size,
+                     chunk->blob, chunk->blob_size, chunk->checksum) ) {
+        fprintf(stderr, "%s: chunk %zu is corrupt\n", __func__, table_index);
+        SDL_free(tiles);
+        return false;
+    }
+
+    InstallChunk(map, table_index, tiles);
+    return true;
+}
+
+/// Queue the paged out chunks in a region of the chunk grid to be paged in,
+/// and mark them all as in use. Call with the stream locked.
+static void
+RequestChunks(Map * map, int min_cx, int min_cy, int max_cx, int max_cy)
+{
+    MapStream * stream = map->stream;
+    size_t num_chunks = NumChunks(map);
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        for ( int cy = min_cy; cy <= max_cy; cy++ ) {
+            for ( int cx = min_cx; cx <= max_cx; cx++ ) {
+                size_t index = (size_t)l * num_chunks
+                    + (size_t)cy * (size_t)map->chunks_w
+                    + (size_t)cx;
+                Chunk * chunk = TableChunk(map, index);
+                chunk->last_used = stream->tick;
+
+                if ( !(chunk->flags & CHUNK_PAGED_OUT)
+                    || (chunk->flags & CHUNK_REQUESTED) ) {
+                    continue;
+                }
+
+                if ( stream->thread == NULL ) {
+                    PageInChunk(map, index);
+                    continue;
+                }
+
+                // Make room for it in both queues.
+                int needed = stream->num_pending + stream->num_done + 2;
+                if ( needed > stream->capacity ) {
+                    int new_capacity = SDL_max(needed, stream->capacity * 2);
+                    size_t size = (size_t)new_capacity * sizeof(PageRequest);
+                    PageRequest * pending = SDL_realloc(stream->pending, size);
+                    if ( pending != NULL ) stream->pending = pending;
+                    PageRequest * done = SDL_realloc(stream->done, size);
+                    if ( done != NULL ) stream->done = done;
+                    if ( pending == NULL || done == NULL ) {
+                        return;
+                    }
+                    stream->capacity = new_capacity;
+                }
+
+                // The file stays mapped while the stream runs, but other
+                // blobs might be replaced by a save.
+                PageRequest request = {
+                    .index = (Uint32)index,
+                    .generation = stream->generation,
+                    .blob = chunk->blob,
+                    .blob_size = chunk->blob_size,
+                    .checksum = chunk->checksum,
+                };
+
+                if ( !IsFileData(map, chunk->blob) ) {
+                    Uint8 * copy = SDL_malloc(chunk->blob_size);
+                    if ( copy == NULL ) {
+                        return;
+                    }
+                    memcpy(copy, chunk->blob, chunk->blob_size);
+                    request.blob = copy;
+                    request.owns_blob = true;
+                }
+
+                stream->pending[stream->num_pending++] = request;
+                chunk->flags |= CHUNK_REQUESTED;
+            }
+        }
+    }
+}
+
+typedef struct {
+    Uint32 last_used;
+    Uint32 index;
+} ResidentChunk;
+
+static int CompareLastUsed(const void * a, const void * b)
+{
+    const ResidentChunk * ca = a;
+    const ResidentChunk * cb = b;
+    return (ca->last_used > cb->last_used) - (ca->last_used < cb->last_used);
+}
+
+/// Page out the least recently viewed chunks while over budget. Chunks with
+/// changes that aren't in their blob yet have to stay until they're saved.
+static void EvictChunks(Map * map)
+{
+    MapStream * stream = map->stream;
+    size_t limit = map->memory_budget / (CHUNK_TILES * sizeof(GID));
+    if ( stream->num_resident <= limit ) {
+        return;
+    }
+
+    ResidentChunk * list = SDL_malloc(stream->num_resident * sizeof(*list));
+    if ( list == NULL ) {
+        return;
+    }
+
+    // Forget chunks that have since been emptied.
+    size_t count = 0;
+    for ( size_t i = 0; i < stream->num_resident; i++ ) {
+        Chunk * chunk = TableChunk(map, stream->resident[i]);
+        if ( chunk->tiles == NULL || IsFileData(map, chunk->tiles) ) {
+            chunk->flags &= (Uint8)~CHUNK_RESIDENT;
+        } else {
+            list[count++] = (ResidentChunk){
+                .last_used = chunk->last_used,
+                .index = stream->resident[i],
+            };
+        }
+    }
 
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
+    // Go a little under so that this doesn't run every frame.
+    size_t target = limit - limit / 8;
+    if ( count > target ) {
+        qsort(list, count, sizeof(*list), CompareLastUsed);
+
+        size_t evicted = 0;
+        for ( size_t i = 0; i < count && count - evicted > target; i++ ) {
+            Chunk * chunk = TableChunk(map, list[i].index);
+            if ( chunk->last_used == stream->tick ) {
+                break; // In view, as is everything after it.
+            }
+
+            if ( chunk->flags & (CHUNK_DIRTY | CHUNK_SHARED) ) {
+                continue;
+            }
+
+            SDL_free(chunk->tiles);
+            chunk->tiles = NULL;
+            chunk->flags |= CHUNK_PAGED_OUT;
+            chunk->flags &= (Uint8)~CHUNK_RESIDENT;
+            list[i].index = UINT32_MAX;
+            evicted++;
+        }
+    }
+
+    stream->num_resident = 0;
+    for ( size_t i = 0; i < count; i++ ) {
+        if ( list[i].index != UINT32_MAX ) {
+            stream->resident[stream->num_resident++] = list[i].index;
+        }
+    }
 
-#define RLE_TAG 0xABCD
+    SDL_free(list);
+}
 
-static Uint16 *
-Compress(Uint16 * data, size_t data_size, size_t * compressed_size)
+bool UpdateMapStream(Map * map, const SDL_Rect * visible)
 {
-    if ( data == NULL || data_size == 0 ) {
-        *compressed_size = 0;
-        return NULL;
+    MapStream * stream = map->stream;
+    if ( stream == NULL ) {
+        return false;
     }
 
-    const size_t header_size = sizeof(Uint64);
-    Uint16 * buffer = malloc(header_size + data_size);
-    if ( buffer == NULL ) {
-        return NULL;
+    stream->tick++;
+
+    SDL_LockMutex(stream->lock);
+
+    // Hand over the chunks the stream thread has decoded.
+    bool paging = stream->num_done > 0;
+    for ( int i = 0; i < stream->num_done; i++ ) {
+        PageRequest * request = &stream->done[i];
+        if ( request->generation == stream->generation ) {
+            Chunk * chunk = TableChunk(map, request->index);
+            chunk->flags &= (Uint8)~CHUNK_REQUESTED;
+
+            if ( request->tiles == NULL ) {
+                fprintf(stderr, "%s: chunk %u is corrupt\n",
+                        __func__, request->index);
+            } else if ( chunk->flags & CHUNK_PAGED_OUT ) {
+                InstallChunk(map, request->index, request->tiles);
+                request->tiles = NULL;
+            }
+        }
+
+        FreeRequest(request);
     }
+    stream->num_done = 0;
+
+    // Request the chunks around the view, then the ones in it, which are
+    // paged in first.
+    int min_cx = SDL_max(visible->x >> CHUNK_SHIFT, 0);
+    int min_cy = SDL_max(visible->y >> CHUNK_SHIFT, 0);
+    int max_cx = SDL_min((visible->x + visible->w) >> CHUNK_SHIFT, map->chunks_w - 1);
+    int max_cy = SDL_min((visible->y + visible->h) >> CHUNK_SHIFT, map->chunks_h - 1);
+
+    RequestChunks(map,
+                  SDL_max(min_cx - 1, 0),
+                  SDL_max(min_cy - 1, 0),
+                  SDL_min(max_cx + 1, map->chunks_w - 1),
+                  SDL_min(max_cy + 1, map->chunks_h - 1));
+    RequestChunks(map, min_cx, min_cy, max_cx, max_cy);
+
+    if ( stream->num_pending > 0 ) {
+        SDL_SignalCondition(stream->wake);
+        paging = true;
+    }
+
+    paging |= stream->busy;
+    SDL_UnlockMutex(stream->lock);
 
-    // Write the uncompressed data size at the start.
-    *(Uint64 *)buffer = (Uint64)data_size;
+    EvictChunks(map);
+    return paging;
+}
 
-    Uint16 * dest_start = buffer + header_size / sizeof(Uint16);
-    Uint16 * dest = dest_start;
-    Uint16 * source = data;
-    Uint16 * source_end = data + (data_size + 1) / sizeof(Uint16);
+/// Start over after the map's chunk grid was replaced.
+static void ResetStream(Map * map)
+{
+    MapStream * stream = map->stream;
+
+    // Requests in flight are for the old grid; they'll be thrown out.
+    stream->generation++;
+    CancelRequests(map);
+
+    stream->num_resident = 0;
+    for ( size_t i = 0; i < NumChunks(map) * map->num_layers; i++ ) {
+        Chunk * chunk = TableChunk(map, i);
+        chunk->flags &= (Uint8)~(CHUNK_REQUESTED | CHUNK_RESIDENT);
+        if ( chunk->tiles != NULL && !IsFileData(map, chunk->tiles) ) {
+            AddResident(map, i);
+        }
+    }
+}
 
-    do {
-        Uint16 count = 1;
-        Uint16 value = *source++;
+/// Clear the tiles of the map's edge chunks that lie outside of the map, so
+/// that they are empty if the map grows again.
+static void ClearChunkOverhang(Map * map)
+{
+    int used_w = map->width & CHUNK_MASK; // Tiles in use in the last column.
+    int used_h = map->height & CHUNK_MASK;
 
-        // Count repeated values.
-        while ( source < source_end && *source == value && count < 0xFFFF ) {
-            count++;
-            source++;
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        if ( used_w != 0 ) {
+            for ( int cy = 0; cy < map->chunks_h; cy++ ) {
+                size_t index = ChunkIndex(map, map->width - 1, cy * CHUNK_SIZE, l);
+                Chunk * chunk = TableChunk(map, index);
+                if ( !PageInChunk(map, index) ) continue;
+                if ( chunk->tiles == NULL || !DetachChunk(map, chunk) ) continue;
+                chunk->flags |= CHUNK_DIRTY | CHUNK_REDRAW;
+
+                for ( int y = 0; y < CHUNK_SIZE; y++ ) {
+                    GID * row = &chunk->tiles[y * CHUNK_SIZE];
+                    size_t count = (size_t)(CHUNK_SIZE - used_w);
+                    memset(&row[used_w], 0, count * sizeof(GID));
+                }
+                TrimChunk(map, chunk);
+            }
         }
 
-        if ( count > 3 || value == RLE_TAG ) { // Compress
-            *dest++ = RLE_TAG;
-            *dest++ = count;
-            *dest++ = value;
-        } else { // Write uncompressed value.
-            for ( Uint32 i = 0; i < count; i++ ) {
-                *dest++ = value;
+        if ( used_h != 0 ) {
+            for ( int cx = 0; cx < map->chunks_w; cx++ ) {
+                size_t index = ChunkIndex(map, cx * CHUNK_SIZE, map->height - 1, l);
+                Chunk * chunk = TableChunk(map, index);
+                if ( !PageInChunk(map, index) ) continue;
+                if ( chunk->tiles == NULL || !DetachChunk(map, chunk) ) continue;
+                chunk->flags |= CHUNK_DIRTY | CHUNK_REDRAW;
+
+                size_t count = (size_t)(CHUNK_SIZE - used_h) * CHUNK_SIZE;
+                memset(&chunk->tiles[used_h * CHUNK_SIZE], 0, count * sizeof(GID));
+                TrimChunk(map, chunk);
             }
         }
-    } while ( source < source_end );
+    }
+}
 
-    unsigned long n = (unsigned long)(dest - dest_start);
-    *compressed_size = sizeof(Uint64) + sizeof(Uint16) * n;
+void ResizeMap(Map * map, Uint16 new_w, Uint16 new_h)
+{
+    bool shrinking = new_w < map->width || new_h < map->height;
 
-    // Compression didn't save space, just return the original data.
-    if ( *compressed_size >= data_size ) {
-        *compressed_size = sizeof(Uint64) + data_size;
-        memcpy(dest_start, data, data_size);
+    Map resized = *map;
+    resized.width = new_w;
+    resized.height = new_h;
+    if ( !InitChunks(&resized, false) ) {
+        return;
     }
 
-    return buffer;
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        // Move over the chunks that are still in the map.
+        for ( int cy = 0; cy < resized.chunks_h; cy++ ) {
+            for ( int cx = 0; cx < resized.chunks_w; cx++ ) {
+                Chunk * dst = &resized.chunks[l][cy * resized.chunks_w + cx];
+
+                if ( cx < map->chunks_w && cy < map->chunks_h ) {
+                    Chunk * src = &map->chunks[l][cy * map->chunks_w + cx];
+                    *dst = *src;
+                    src->tiles = NULL;
+                    src->blob = NULL;
+                } else {
+                    dst->flags = CHUNK_DIRTY | CHUNK_REDRAW; // Empty
+                }
+            }
+        }
+
+        // Free the chunks that were cut off.
+        FreeChunks(map, map->chunks[l], NumChunks(map));
+    }
+
+    *map = resized;
+
+    if ( map->stream != NULL ) {
+        ResetStream(map);
+    }
+
+    if ( shrinking ) {
+        ClearChunkOverhang(map);
+    }
 }
 
-static Uint16 *
-Decompress(Uint16 * data, size_t size, size_t * uncompressed_size)
+static const char * codec_names[MAP_NUM_CODECS] = {
+    [MAP_CODEC_RLE] = "rle",
+    [MAP_CODEC_LZ] = "lz",
+};
+
+const char * MapCodecName(MapCodec codec)
 {
-    size_t header_size = sizeof(Uint64);
-    *uncompressed_size = *(Uint64 *)data;
-    data += header_size / sizeof(Uint16); // Move past the header.
+    return codec < MAP_NUM_CODECS ? codec_names[codec] : "unknown";
+}
 
-    Uint16 * buffer = malloc(*uncompressed_size);
-    if ( buffer == NULL ) {
-        return NULL;
+bool GetMapCodec(const char * name, MapCodec * out)
+{
+    for ( int i = 0; i < MAP_NUM_CODECS; i++ ) {
+        if ( strcmp(name, codec_names[i]) == 0 ) {
+            *out = (MapCodec)i;
+            return true;
+        }
     }
 
-    Uint16 * source = data;
-    Uint16 * source_end = data + (size - header_size) / sizeof(Uint16);
-    Uint16 * dest = buffer;
-
-    while ( source < source_end ) {
-        Uint16 count = 1;
-        Uint16 value = *source++;
+    return false;
+}
 
-        if ( value == (Uint16)RLE_TAG ) {
-            count = *source++;
-            value = *source++;
+/// Mark a chunk to be recompressed on the next save. A save in progress is
+/// writing it the old way, so take it out of that save: otherwise the save
+/// would hand the chunk its old blob and mark it clean when it's done.
+static void RecompressChunk(Map * map, Chunk * chunk)
+{
+    if ( chunk->flags & CHUNK_SHARED ) {
+        if ( DetachChunk(map, chunk) ) {
+            chunk->flags &= (Uint8)~CHUNK_SHARED; // Empty or paged out.
+        } else {
+            fprintf(stderr, "%s: waiting for save\n", __func__);
+            FinishSave(map);
         }
+    }
+
+    chunk->flags |= CHUNK_DIRTY;
+}
+
+void SetMapCodec(Map * map, MapCodec codec)
+{
+    if ( codec == map->codec ) {
+        return;
+    }
 
-        for ( Uint16 i = 0; i < count; i++ ) {
-            *dest++ = value;
+    map->codec = codec;
+
+    // Recompress everything on the next save.
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        for ( size_t i = 0; i < NumChunks(map); i++ ) {
+            RecompressChunk(map, &map->chunks[l][i]);
         }
     }
+}
 
-    return buffer;
+static const char * filter_names[MAP_NUM_FILTERS] = {
+    [MAP_FILTER_NONE] = "none",
+    [MAP_FILTER_XOR] = "xor",
+    [MAP_FILTER_DELTA] = "delta",
+    [MAP_FILTER_PLANES] = "planes",
+};
+
+const char * MapFilterName(MapFilter filter)
+{
+    return filter < MAP_NUM_FILTERS ? filter_names[filter] : "unknown";
 }
 
-void FreeMap(Map * map)
+bool GetMapFilter(const char * name, MapFilter * out)
 {
-    for ( int i = 0; i < map->num_layers; i++ ) {
-        free(map->tiles[i]);
+    for ( int i = 0; i < MAP_NUM_FILTERS; i++ ) {
+        if ( strcmp(name, filter_names[i]) == 0 ) {
+            *out = (MapFilter)i;
+            return true;
+        }
     }
 
-    memset(map, 0, sizeof(Map));
+    return false;
 }
 
-bool SaveMap(Map * map, const char * path)
+void SetMapLayerFilter(Map * map, int layer, MapFilter filter)
 {
-    FILE * file = fopen(path, "wb");
-    if ( file == NULL ) {
-        fprintf(stderr,
-                "%s: failed to create file at path '%s'\n", __func__, path);
-        return false;
+    if ( layer < 0 || layer >= map->num_layers || filter == map->filters[layer] ) {
+        return;
     }
 
-    // Leave room for the header and info table.
-    long skip = 0;
-    skip += sizeof(MapHeader);
-    skip += sizeof(LayerInfo) * map->num_layers;
-    fseek(file, skip, SEEK_SET);
+    map->filters[layer] = filter;
 
-    // Write layer data.
-    LayerInfo layer_info[MAX_LAYERS] = { 0 };
-    size_t original_size = map->width * map->height * sizeof(GID);
+    // Recompress the layer on the next save.
+    for ( size_t i = 0; i < NumChunks(map); i++ ) {
+        RecompressChunk(map, &map->chunks[layer][i]);
+    }
+}
 
-    for ( int i = 0; i < map->num_layers; i++ ) {
-        size_t compressed_size = 0;
-        Uint16 * compressed = Compress(map->tiles[i], original_size, &compressed_size);
-        // TODO: error
+bool IsValidPosition(const Map * map, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < map->width && y < map->height;
+}
 
-        layer_info[i].size = (Uint32)compressed_size;
-        layer_info[i].offset = (Uint32)ftell(file);
-        fwrite(compressed, compressed_size, 1, file);
-        // TODO: error
+GID GetMapTile(const Map * map, int x, int y, int layer)
+{
+    if ( !IsValidPosition(map, x, y) ) {
+        fprintf(stderr, "invalid map position\n");
+        return 0;
+    }
 
-        free(compressed);
+    size_t index = ChunkIndex(map, x, y, layer);
+    if ( TableChunk(map, index)->flags & CHUNK_PAGED_OUT ) {
+        // Paging in doesn't change what the map holds.
+        PageInChunk((Map *)map, index);
     }
 
-    // Write header and table at the beginning.
-    rewind(file);
-    MapHeader header = {
-        .width = map->width,
-        .height = map->height,
-        .bg_color[0] = map->bg_color.r,
-        .bg_color[1] = map->bg_color.g,
-        .bg_color[2] = map->bg_color.b,
-        .num_layers = map->num_layers,
-    };
+    return PeekMapTile(map, x, y, layer);
+}
 
-    fwrite(&header, sizeof(header), 1, file);
-    fwrite(layer_info, sizeof(layer_info[0]), map->num_layers, file);
-    // TODO: write error
+GID PeekMapTile(const Map * map, int x, int y, int layer)
+{
+    if ( !IsValidPosition(map, x, y) ) {
+        return 0;
+    }
 
-    fclose(file);
-    return true;
+    const Chunk * chunk = ChunkAt(map, x, y, layer);
+    return chunk->tiles ? chunk->tiles[TileIndex(x, y)] : 0;
 }
 
-bool LoadMap(Map * map, const char * path)
+void SetMapTile(Map * map, int x, int y, int layer, GID gid)
 {
-    if ( map == NULL ) {
-        // TODO: assert
-        fprintf(stderr, "%s: map parameter is NULL\n", __func__);
-        return false;
+    if ( !IsValidPosition(map, x, y) ) {
+        fprintf(stderr, "invalid map position\n");
+        return;
     }
 
-    // Free previously loaded map.
-    FreeMap(map);
+    size_t chunk_index = ChunkIndex(map, x, y, layer);
+    if ( !PageInChunk(map, chunk_index) ) {
+        return;
+    }
 
-    FILE * file = fopen(path, "rb");
-    if ( file == NULL ) {
-        // TODO: error
-        return false;
+    Chunk * chunk = TableChunk(map, chunk_index);
+    int index = TileIndex(x, y);
+    GID old = chunk->tiles ? chunk->tiles[index] : 0;
+    if ( old == gid ) {
+        return;
     }
 
-    MapHeader header;
-    fread(&header, sizeof(header), 1, file);
-    // TODO: error
+    if ( chunk->tiles == NULL ) {
+        // The first tile in an empty chunk.
+        chunk->tiles = SDL_calloc(CHUNK_TILES, sizeof(GID));
+        if ( chunk->tiles == NULL ) {
+            fprintf(stderr, "%s: calloc failed\n", __func__);
+            return;
+        }
+        chunk->num_used = 0;
+        chunk->flags &= (Uint8)~CHUNK_SHARED;
+    } else if ( !DetachChunk(map, chunk) ) {
+        return;
+    }
 
-    map->num_layers = header.num_layers;
-    map->width = header.width;
-    map->height = header.height;
-    map->bg_color.r = header.bg_color[0];
-    map->bg_color.g = header.bg_color[1];
-    map->bg_color.b = header.bg_color[2];
-    map->bg_color.a = 255;
+    AddResident(map, chunk_index);
+    chunk->tiles[index] = gid;
+    chunk->flags |= CHUNK_DIRTY | CHUNK_REDRAW;
 
-    printf("Loading %d x %d map with %d layers\n",
-           map->width, map->height, map->num_layers);
+    if ( old == 0 ) {
+        chunk->num_used++;
+    } else if ( gid == 0 && --chunk->num_used == 0 ) {
+        SDL_free(chunk->tiles); // The last tile was erased.
+        chunk->tiles = NULL;
+    }
+}
 
-    // Read layer info table.
-    LayerInfo layer_info[MAX_LAYERS];
-    fread(layer_info, sizeof(layer_info[0]), map->num_layers, file);
+/// Count the tiles from (x, y) in direction `dx`, 1 or -1, up to `limit` of
+/// them, for which whether they are `gid` is `same`. Reads a chunk row at a
+/// time rather than a tile at a time.
+static int
+RunLength(Map * map, int x, int y, int layer, GID gid, bool same, int dx, int limit)
+{
+    int count = 0;
 
-    // Using the layer info table, Read layer data and decompress.
-    for ( int i = 0; i < map->num_layers; i++ ) {
-        size_t data_size = layer_info[i].size;
-        fseek(file, layer_info[i].offset, SEEK_SET);
-        Uint16 * data = malloc(data_size);
-        // TODO: error
+    while ( count < limit ) {
+        size_t index = ChunkIndex(map, x, y, layer);
+        PageInChunk(map, index); // Tiles it fails to decode read as empty.
 
-        fread(data, data_size, 1, file);
-        // TODO: error
+        const Chunk * chunk = TableChunk(map, index);
+        int in_chunk = dx > 0 ? CHUNK_SIZE - (x & CHUNK_MASK) : (x & CHUNK_MASK) + 1;
+        int n = SDL_min(in_chunk, limit - count);
 
-        size_t decompressed_size = 0;
-        map->tiles[i] = Decompress(data, data_size, &decompressed_size);
-        if ( map->tiles[i] == NULL ) {
-            // TODO: error
+        if ( chunk->tiles == NULL ) {
+            if ( (gid == 0) != same ) {
+                return count;
+            }
+        } else {
+            const GID * tile = &chunk->tiles[TileIndex(x, y)];
+            for ( int i = 0; i < n; i++, tile += dx ) {
+                if ( (*tile == gid) != same ) {
+                    return count + i;
+                }
+            }
         }
 
-        size_t expected_size = map->width * map->height * sizeof(GID);
-        if ( decompressed_size != expected_size ) {
-            fprintf(stderr, "map size mismatch\n");
+        count += n;
+        x += n * dx;
+    }
+
+    return count;
+}
+
+static bool AllEmpty(const GID * tiles, int count)
+{
+    for ( int i = 0; i < count; i++ ) {
+        if ( tiles[i] != 0 ) {
             return false;
         }
-
-        free(data);
     }
 
     return true;
 }
 
-bool CreateMap(const char * path, Uint16 w, Uint16 h, Uint8 num_layers)
+/// Set `n` tiles from (x, y) rightward, all in one chunk, to those in `src`,
+/// or if it's NULL, to `gid`.
+static bool
+WriteChunkRow(Map * map, int x, int y, int layer, int n, const GID * src, GID gid)
 {
-    FILE * file = fopen(path, "rb");
-    if ( file != NULL ) {
-        fclose(file); // File already exists, do nothing.
+    size_t index = ChunkIndex(map, x, y, layer);
+    if ( !PageInChunk(map, index) ) {
         return false;
     }
 
-    if ( num_layers == 0 || num_layers > MAX_LAYERS ) {
-        fprintf(stderr, "%s: invalid number of layers (%d)\n",
-                __func__, num_layers);
+    Chunk * chunk = TableChunk(map, index);
+
+    if ( chunk->tiles == NULL ) {
+        if ( src != NULL ? AllEmpty(src, n) : gid == 0 ) {
+            return true; // Empty already.
+        }
+
+        chunk->tiles = SDL_calloc(CHUNK_TILES, sizeof(GID));
+        if ( chunk->tiles == NULL ) {
+            fprintf(stderr, "%s: calloc failed\n", __func__);
+            return false;
+        }
+        chunk->num_used = 0;
+        chunk->flags &= (Uint8)~CHUNK_SHARED;
+    } else if ( !DetachChunk(map, chunk) ) {
         return false;
     }
 
-    Map map = {
-        .width = w,
-        .height = h,
-        .num_layers = num_layers,
-    };
+    AddResident(map, index);
 
-    // TODO: bg_color
+    GID * tiles = &chunk->tiles[TileIndex(x, y)];
+    int num_used = chunk->num_used;
+    if ( src != NULL ) {
+        for ( int i = 0; i < n; i++ ) {
+            num_used += (src[i] != 0) - (tiles[i] != 0);
+        }
+        memcpy(tiles, src, (size_t)n * sizeof(GID));
+    } else {
+        for ( int i = 0; i < n; i++ ) {
+            num_used += (gid != 0) - (tiles[i] != 0);
+            tiles[i] = gid;
+        }
+    }
+
+    chunk->num_used = (Uint16)num_used;
+    chunk->flags |= CHUNK_DIRTY | CHUNK_REDRAW;
+
+    if ( num_used == 0 ) {
+        SDL_free(chunk->tiles);
+        chunk->tiles = NULL;
+    }
 
-    // Init tiles
-    for ( int i = 0; i < num_layers; i++ ) {
-        map.tiles[i] = SDL_calloc(w * h, sizeof(*map.tiles[0]));
-        if ( map.tiles[i] == NULL ) {
-            fprintf(stderr, "%s: SDL_calloc failed\n", __func__);
+    return true;
+}
+
+/// Set `count` tiles from (x, y) rightward, a chunk row at a time, to those
+/// in `src`, or if it's NULL, to `gid`.
+static bool
+WriteRow(Map * map, int x, int y, int layer, int count, const GID * src, GID gid)
+{
+    while ( count > 0 ) {
+        int n = SDL_min(CHUNK_SIZE - (x & CHUNK_MASK), count);
+        if ( !WriteChunkRow(map, x, y, layer, n, src, gid) ) {
             return false;
         }
-    }
 
-    SaveMap(&map, path); // Create the file
-    FreeMap(&map);
+        if ( src != NULL ) {
+            src += n;
+        }
+        x += n;
+        count -= n;
+    }
 
     return true;
 }
 
-void ResizeMap(Map * map, Uint16 new_w, Uint16 new_h)
+static bool IsValidRow(const Map * map, int x, int y, int count)
+{
+    return count >= 0
+        && IsValidPosition(map, x, y)
+        && x + count <= map->width;
+}
+
+void GetMapRow(const Map * map, int x, int y, int layer, GID * dest, int count)
 {
-    size_t new_tile_count = (size_t)(new_w * new_h);
+    if ( !IsValidRow(map, x, y, count) ) {
+        fprintf(stderr, "%s: invalid map row\n", __func__);
+        return;
+    }
 
-    int w = SDL_min(map->width, new_w);
-    int h = SDL_min(map->height, new_h);
+    while ( count > 0 ) {
+        size_t index = ChunkIndex(map, x, y, layer);
+        // Paging in doesn't change what the map holds.
+        PageInChunk((Map *)map, index);
 
-    for ( int l = 0; l < map->num_layers; l++ ) {
-        GID * new_tiles = SDL_calloc(new_tile_count, sizeof(*new_tiles));
+        const Chunk * chunk = TableChunk(map, index);
+        int n = SDL_min(CHUNK_SIZE - (x & CHUNK_MASK), count);
 
-        // Copy old map tiles to new_tiles
-        for ( int y = 0; y < h; y++ ) {
-            for ( int x = 0; x < w; x++ ) {
-                GID gid = GetMapTile(map, x, y, l); // Accesses using current size.
-                new_tiles[y * new_w + x] = gid; // Set using new size.
-            }
+        if ( chunk->tiles == NULL ) {
+            memset(dest, 0, (size_t)n * sizeof(GID));
+        } else {
+            memcpy(dest, &chunk->tiles[TileIndex(x, y)], (size_t)n * sizeof(GID));
         }
 
-        // Replace pointer
-        SDL_free(map->tiles[l]);
-        map->tiles[l] = new_tiles;
+        dest += n;
+        x += n;
+        count -= n;
     }
-
-    map->width = new_w;
-    map->height = new_h;
 }
 
-bool IsValidPosition(const Map * map, int x, int y)
+void SetMapRow(Map * map, int x, int y, int layer, const GID * src, int count)
 {
-    return x >= 0 && y >= 0 && x < map->width && y < map->height;
+    if ( !IsValidRow(map, x, y, count) ) {
+        fprintf(stderr, "%s: invalid map row\n", __func__);
+        return;
+    }
+
+    WriteRow(map, x, y, layer, count, src, 0);
 }
 
-GID GetMapTile(const Map * map, int x, int y, int layer)
+// Tiles in [x1, x2] of row y that are to be filled, if they match, along with
+// those they connect to.
+typedef struct {
+    int x1;
+    int x2;
+    int y;
+} FillSpan;
+
+typedef struct {
+    FillSpan * list;
+    int count;
+    int allocated;
+} FillStack;
+
+static bool PushSpan(FillStack * stack, int x1, int x2, int y)
 {
-    if ( !IsValidPosition(map, x, y) ) {
-        fprintf(stderr, "invalid map position\n");
-        return 0;
+    if ( stack->count == stack->allocated ) {
+        int new_allocated = stack->allocated ? stack->allocated * 2 : 256;
+        size_t size = (size_t)new_allocated * sizeof(FillSpan);
+        FillSpan * new_list = SDL_realloc(stack->list, size);
+        if ( new_list == NULL ) {
+            fprintf(stderr, "%s: realloc failed\n", __func__);
+            return false;
+        }
+
+        stack->list = new_list;
+        stack->allocated = new_allocated;
     }
 
-    return map->tiles[layer][y * map->width + x];
+    stack->list[stack->count++] = (FillSpan){ x1, x2, y };
+    return true;
 }
 
-void SetMapTile(Map * map, int x, int y, int layer, GID gid)
+void FloodFillMap(Map * map, int x, int y, int layer, GID gid,
+                  TileRunFunc changed)
 {
     if ( !IsValidPosition(map, x, y) ) {
-        fprintf(stderr, "invalid map position\n");
         return;
     }
 
-    map->tiles[layer][y * map->width + x] = gid;
+    GID old = GetMapTile(map, x, y, layer);
+    if ( old == gid ) {
+        return; // Already filled, and every tile would match again.
+    }
+
+    TraceBegin("flood fill");
+
+    // Fill the whole run of matching tiles through each seed, then seed the
+    // rows above and below it. Filled tiles no longer match, so they're
+    // skipped when a span is looked at again.
+    FillStack stack = { 0 };
+    bool ok = PushSpan(&stack, x, x, y);
+
+    while ( ok && stack.count > 0 ) {
+        FillSpan span = stack.list[--stack.count];
+
+        for ( int sx = span.x1; ok && sx <= span.x2; ) {
+            sx += RunLength(map, sx, span.y, layer, old, false, 1, span.x2 - sx + 1);
+            if ( sx > span.x2 ) {
+                break;
+            }
+
+            int left = sx - RunLength(map, sx - 1, span.y, layer, old, true, -1, sx);
+            int right = sx + RunLength(map, sx, span.y, layer, old, true, 1,
+                                       map->width - sx);
+            int count = right - left;
+
+            if ( !WriteRow(map, left, span.y, layer, count, NULL, gid) ) {
+                ok = false;
+                break;
+            }
+
+            if ( changed != NULL ) {
+                changed(left, span.y, layer, count, old, gid);
+            }
+
+            if ( span.y > 0 ) {
+                ok = ok && PushSpan(&stack, left, right - 1, span.y - 1);
+            }
+
+            if ( span.y < map->height - 1 ) {
+                ok = ok && PushSpan(&stack, left, right - 1, span.y + 1);
+            }
+
+            sx = right + 1; // The tile at `right` doesn't match.
+        }
+    }
+
+    SDL_free(stack.list);
+    TraceEnd("flood fill");
 }
 
 //static SDL_Texture *
@@ -385,7 +2635,7 @@ Tileset * LoadTilesets(SDL_Renderer * renderer,
         char id[64] = { 0 };
 
         if ( sscanf(line, "tile_set: \"%63[^\"]\"", id) == 1 ) {
-            Tileset * ts = calloc(1, sizeof(Tileset));
+            Tileset * ts = SDL_calloc(1, sizeof(Tileset));
             if ( ts == NULL ) {
                 fprintf(stderr, "%s: calloc failed: %s\n",
                         __func__, strerror(errno));
@@ -408,46 +2658,62 @@ Tileset * LoadTilesets(SDL_Renderer * renderer,
         }
     }
 
+    IndexTilesets(list);
     return list;
 }
 
-Tileset * GetGIDLocation(Tileset * tilesets, GID gid, int * x, int * y)
+// Every GID's tileset and source rect, so drawing a tile doesn't have to
+// search the tileset list for it.
+static GIDLocation gid_table[0x10000];
+
+void IndexTilesets(Tileset * tilesets)
 {
-    Tileset * tail = tilesets;
-    while ( tail->next != NULL ) {
-        tail = tail->next;
-    }
+    memset(gid_table, 0, sizeof(gid_table));
 
-    // Find which tile set this gid belongs to.
-    Tileset * ts = tail;
-    for ( ; ts->prev != NULL; ts = ts->prev ) {
-        if ( gid >= ts->first_gid ) {
-            break;
+    for ( Tileset * ts = tilesets; ts != NULL; ts = ts->next ) {
+        for ( int i = 0; i < ts->num_tiles; i++ ) {
+            int gid = ts->first_gid + i;
+            if ( gid >= (int)SDL_arraysize(gid_table) ) {
+                break;
+            }
+
+            int x = i % ts->columns * ts->tile_size;
+            int y = i / ts->columns * ts->tile_size;
+
+            GIDLocation * location = &gid_table[gid];
+            location->tileset = ts;
+            if ( ts->atlas != NULL ) {
+                location->texture = ts->atlas;
+                x += ts->atlas_x;
+                y += ts->atlas_y;
+            } else {
+                location->texture = ts->texture;
+            }
+
+            location->src = (SDL_FRect){
+                (float)x,
+                (float)y,
+                (float)ts->tile_size,
+                (float)ts->tile_size
+            };
         }
     }
-
-    int index = gid - ts->first_gid;
-    *x = index % ts->columns;
-    *y = index / ts->columns;
-    return ts;
 }
 
-void RenderTile(SDL_Renderer * renderer,
-                GID gid,
-                Tileset * tilesets,
-                const SDL_FRect * dest)
+const GIDLocation * GetGIDLocation(GID gid)
 {
-    int x, y;
-    Tileset * ts = GetGIDLocation(tilesets, gid, &x, &y);
-
-    SDL_FRect source = {
-        (float)(x * ts->tile_size),
-        (float)(y * ts->tile_size),
-        (float)(ts->tile_size),
-        (float)(ts->tile_size)
-    };
+    return &gid_table[gid];
+}
 
-    SDL_RenderTexture(renderer, ts->texture, &source, dest);
+void RenderTile(SDL_Renderer * renderer, GID gid, const SDL_FRect * dest)
+{
+    const GIDLocation * location = &gid_table[gid];
+    if ( location->tileset != NULL ) {
+        SDL_RenderTexture(renderer,
+                          location->texture,
+                          &location->src,
+                          dest);
+    }
 }
 
 void RenderTile2(SDL_Renderer * renderer,
@@ -16,23 +16,95 @@
 #define MAX_LAYERS 8
 #define MAX_TILESETS 64
 
+#define MAP_MAGIC 0x50414D54 // "TMAP"
+#define MAP_VERSION 6
+
+// Layers are stored in square chunks of tiles.
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT) // Width and height in tiles.
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+#define CHUNK_TILES (CHUNK_SIZE * CHUNK_SIZE)
+
+// Chunk flags
+#define CHUNK_DIRTY 0x01 // Changed since its blob was encoded.
+#define CHUNK_SHARED 0x02 // In use by a save in progress.
+#define CHUNK_PAGED_OUT 0x04 // Tiles not decoded from the blob. (Streaming)
+#define CHUNK_REDRAW 0x08 // Tiles changed since the map view last drew them.
+
 typedef Uint16 GID; // Global Tile ID
 
-// Map file layer info table entry: ocation and size of compressed data within
-// map file.
+// How chunks are compressed.
+typedef enum {
+    MAP_CODEC_RLE, // Long runs of the same tile (rle.c)
+    MAP_CODEC_LZ, // Repeated patterns (lz.c)
+    MAP_NUM_CODECS
+} MapCodec;
+
+// Reversible transforms applied to a chunk's tiles before compressing them.
+typedef enum {
+    MAP_FILTER_NONE,
+    MAP_FILTER_XOR, // Each row XORed with the row above.
+    MAP_FILTER_DELTA, // Each row minus the row above.
+    MAP_FILTER_PLANES, // Low bytes of every tile, then high bytes.
+    MAP_NUM_FILTERS
+} MapFilter;
+
+// Version 1 map file layer info table entry: location and size of compressed
+// data within map file.
 typedef struct {
     Uint32 offset;
     Uint32 size;
 } LayerInfo;
 
+// At start of version 1 map file.
+typedef struct {
+    Uint16 width;
+    Uint16 height;
+    Uint8 bg_color[3]; // { R, G, B }
+    Uint8 num_layers;
+} LegacyMapHeader;
+
 // At start of map file.
 typedef struct {
+    Uint32 magic; // MAP_MAGIC
+    Uint16 version;
     Uint16 width;
     Uint16 height;
-    Uint8 bg_color[3]; // { R, G, B, unused }
+    Uint8 bg_color[3]; // { R, G, B }
     Uint8 num_layers;
+    Uint16 chunk_size; // CHUNK_SIZE
+
+    // Version 3
+    Uint8 codec; // MapCodec used for new chunk data.
+    Uint8 reserved[3];
+
+    // Version 4
+    Uint8 filters[MAX_LAYERS]; // MapFilter used for each layer's new chunks.
+
+    // Version 5
+    Uint32 checksum; // CRC-32C of the header, with this 0, and chunk table.
+
+    // Version 6
+    Uint64 table_offset; // Where the chunk table is. It used to follow this.
 } MapHeader;
 
+// Map file chunk table entry: location and size of a chunk's compressed data.
+typedef struct {
+    Uint64 offset;
+    Uint32 size;
+    Uint32 checksum; // CRC-32C of the data. Before version 5, a copy of size.
+} ChunkInfo;
+
+// At start of each chunk's data. Versions 1 and 2 had a Uint64 size here,
+// which reads the same as size with codec MAP_CODEC_RLE version 0.
+typedef struct {
+    Uint32 size; // Uncompressed size. Data is stored as is if it's this big.
+    Uint8 codec; // MapCodec
+    Uint8 codec_version;
+    Uint8 filter; // MapFilter to undo after decoding, never on data as is.
+    Uint8 reserved;
+} ChunkHeader;
+
 typedef struct tileset {
     char id[64];
     GID first_gid;
@@ -42,34 +114,170 @@ typedef struct tileset {
     int tile_size;
     SDL_Texture * texture;
 
+    // Where the tileset is packed, if it is. See tile_atlas.h.
+    SDL_Texture * atlas;
+    int atlas_x;
+    int atlas_y;
+
     struct tileset * prev;
     struct tileset * next;
 } Tileset;
 
 typedef struct {
-    GID * tiles[MAX_LAYERS];
+    GID * tiles; // CHUNK_TILES tiles, row-major, or NULL if all are empty.
+    Uint8 * blob; // Compressed tiles, as last loaded or saved.
+    Uint32 blob_size;
+    Uint32 checksum; // CRC-32C of the blob, checked before it's decoded.
+    Uint16 num_used; // Non-empty tiles. Not counted until tiles are writable.
+    Uint8 flags;
+    Uint32 last_used; // When last in view. (Streaming)
+    Uint64 offset; // Of the blob in the map's file, unless the chunk is dirty.
+} Chunk;
+
+typedef struct map_save MapSave;
+typedef struct map_stream MapStream;
+
+typedef enum {
+    SAVE_IDLE,
+    SAVE_IN_PROGRESS,
+    SAVE_SUCCEEDED,
+    SAVE_FAILED,
+} SaveStatus;
+
+typedef struct {
+    Chunk * chunks[MAX_LAYERS]; // Row-major grid of chunks for each layer.
     Uint16 width;
     Uint16 height;
     Uint8 num_layers;
     SDL_Color bg_color;
+    MapCodec codec; // Used to compress chunks when saving.
+    MapFilter filters[MAX_LAYERS]; // Applied to each layer's chunks before.
+    int chunks_w; // Size of chunk grid.
+    int chunks_h;
+
+    // Read-only mapping of the file the map was loaded from. Chunks that were
+    // saved uncompressed point straight into it until they are first written.
+    Uint8 * file_data;
+    size_t file_size;
+
+    // The file that chunks' offsets are in, and where its data ends. Saves to
+    // it add what changed to the end. NULL if the map hasn't been loaded from
+    // or saved to a file of the current version.
+    char * path;
+    Uint64 file_end;
+
+    MapSave * save; // Save in progress, or NULL.
+
+    // Maps too big for their memory budget only keep the chunks near the
+    // view decoded. NULL if all chunks are.
+    MapStream * stream;
+    size_t memory_budget;
 } Map;
 
+/// Save the map and wait for it to finish.
 bool SaveMap(Map * map, const char * path);
+
+///
+/// Start saving the map on a background thread. The map can be edited while
+/// it's saving. Call `UpdateSaveMap` to find out when it's done.
+///
+/// Saving to the file the map was loaded from or last saved to appends the
+/// chunks that changed and a new chunk table to it, then points its header at
+/// them. Otherwise, or once more than half the file is out of date, the file
+/// is written under a temporary name and moved over `path` once complete.
+/// Either way, a failed save leaves the previous file intact.
+///
+bool StartSaveMap(Map * map, const char * path);
+
+/// Check on the map's save in progress, finishing it up if it's done.
+///
+/// - returns: `SAVE_SUCCEEDED` or `SAVE_FAILED` once, when the save has
+///   completed, otherwise `SAVE_IN_PROGRESS` or `SAVE_IDLE`.
+SaveStatus UpdateSaveMap(Map * map);
+
 bool LoadMap(Map * map, const char * path);
+
+/// Set how many bytes of decoded tiles maps loaded from now on may keep, or 0
+/// for no limit. Maps that don't fit are streamed: chunks are decoded as they
+/// come into view and the least recently viewed ones are dropped.
+void SetMapMemoryBudget(size_t bytes);
+
+///
+/// Page in the chunks in and around `visible`, a rectangle of tiles, on a
+/// background thread, and drop the least recently visible ones while over
+/// budget. Call it every frame for streamed maps; it does nothing for others.
+///
+/// Tiles that aren't paged in yet are decoded on the spot when accessed.
+///
+/// - returns: Whether chunks were paged in or are still on their way, so
+///   the caller knows to draw again.
+///
+bool UpdateMapStream(Map * map, const SDL_Rect * visible);
+
 bool CreateMap(const char * path, Uint16 w, Uint16 h, Uint8 num_layers);
 void FreeMap(Map * map);
 void ResizeMap(Map * map, Uint16 new_w, Uint16 new_h);
 
+/// Set the codec used for chunks the map saves from now on. If it differs,
+/// the whole map is recompressed on the next save.
+void SetMapCodec(Map * map, MapCodec codec);
+const char * MapCodecName(MapCodec codec);
+bool GetMapCodec(const char * name, MapCodec * out);
+
+/// Set the filter applied to a layer's chunks before they're compressed.
+/// If it differs, the layer is recompressed on the next save.
+void SetMapLayerFilter(Map * map, int layer, MapFilter filter);
+const char * MapFilterName(MapFilter filter);
+
+/// Transform `count` tiles from `src`, in rows of CHUNK_SIZE, into `dest`.
+void FilterTiles(MapFilter filter, const GID * src, GID * dest, size_t count);
+/// Undo `FilterTiles`.
+void UnfilterTiles(MapFilter filter, const GID * src, GID * dest, size_t count);
+bool GetMapFilter(const char * name, MapFilter * out);
+
 bool IsValidPosition(const Map * map, int x, int y);
 GID GetMapTile(const Map * map, int x, int y, int layer);
+
+/// Get a tile without paging in its chunk. Tiles of paged out chunks are 0.
+GID PeekMapTile(const Map * map, int x, int y, int layer);
 void SetMapTile(Map * map, int x, int y, int layer, GID gid);
 
+/// Copy `count` tiles rightward from (x, y) in `layer` into `dest`.
+void GetMapRow(const Map * map, int x, int y, int layer, GID * dest, int count);
+/// Set `count` tiles rightward from (x, y) in `layer` to those in `src`.
+void SetMapRow(Map * map, int x, int y, int layer, const GID * src, int count);
+
+/// Called for each run of tiles in a row that an edit changes, after they're
+/// changed: `count` tiles rightward from (x, y) that were `old`.
+typedef void (* TileRunFunc)(int x, int y, int layer, int count,
+                             GID old, GID new);
+
+/// Replace the tile at (x, y) in `layer`, and every tile connected to it
+/// across edges that's the same, with `gid`. Fills a row's run of tiles at a
+/// time, keeping the spans still to look at on the heap rather than the
+/// stack, so any size of region can be filled.
+void FloodFillMap(Map * map, int x, int y, int layer, GID gid,
+                  TileRunFunc changed);
+
 // Tilesets
 
 typedef SDL_Texture * (* TilesetTextureLoader)(SDL_Renderer *, const char * id);
 
+// Where a GID's tile is drawn from.
+typedef struct {
+    Tileset * tileset; // NULL if no tileset has this GID.
+    SDL_Texture * texture; // The tileset's atlas, or its own texture.
+    SDL_FRect src; // In `texture`.
+} GIDLocation;
+
 void AddTileset(Tileset ** list, Tileset * tileset);
-Tileset * GetGIDLocation(Tileset * tilesets, GID gid, int * x, int * y);
+
+/// Fill the GID lookup table from a list of tilesets, replacing whatever it
+/// held. Call whenever tilesets are loaded or packed into atlases.
+void IndexTilesets(Tileset * tilesets);
+
+/// Look up where a tile is in the tilesets last indexed.
+const GIDLocation * GetGIDLocation(GID gid);
 
 ///
 /// Load tilesets from project file.
@@ -84,10 +292,7 @@ Tileset * LoadTilesets(SDL_Renderer * renderer,
                        int tile_size,
                        TilesetTextureLoader texture_loader);
 
-void RenderTile(SDL_Renderer * renderer,
-                GID gid,
-                Tileset * tilesets,
-                const SDL_FRect * dest);
+void RenderTile(SDL_Renderer * renderer, GID gid, const SDL_FRect * dest);
 
 /// Render tile directly from tileset, assuming this is the only tileset in use.
 void RenderTile2(SDL_Renderer * renderer,
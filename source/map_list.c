@@ -33,6 +33,12 @@ void OpenEditorMap(const char * name, Uint16 width, Uint16 height, Uint8 num_lay
     A_GetMapPath(name, path, sizeof(path));
 
     if ( !LoadMap(&new_map->map, path) ) {
+        // Never save over a map that's there but wouldn't load.
+        if ( FileExists(path) ) {
+            LogError("could not load map '%s'", path);
+            exit(EXIT_FAILURE);
+        }
+
         CreateMap(path, width, height, num_layers); // Create the file.
         LoadMap(&new_map->map, path);
     }
@@ -54,8 +60,47 @@ void SaveCurrentMap(void)
     char path[1024];
     A_GetMapPath(__map->name, path, sizeof(path));
 
-    SaveMap(&__map->map, path);
-    __map->is_dirty = false;
+    // Edits made while the save is in progress will mark the map dirty again.
+    if ( StartSaveMap(&__map->map, path) ) {
+        __map->is_dirty = false;
+    }
+}
+
+bool UpdateMapSaves(void (* completed)(const EditorMap * map, bool succeeded))
+{
+    bool saving = false;
+
+    for ( EditorMap * m = map_head; m != NULL; m = m->next ) {
+        SaveStatus status = UpdateSaveMap(&m->map);
+        if ( status != SAVE_SUCCEEDED && status != SAVE_FAILED ) {
+            saving |= status == SAVE_IN_PROGRESS;
+            continue;
+        }
+
+        if ( status == SAVE_FAILED ) {
+            m->is_dirty = true;
+        }
+
+        if ( completed ) {
+            completed(m, status == SAVE_SUCCEEDED);
+        }
+    }
+
+    return saving;
+}
+
+void SetMapsCodec(MapCodec codec)
+{
+    for ( EditorMap * m = map_head; m != NULL; m = m->next ) {
+        SetMapCodec(&m->map, codec);
+    }
+}
+
+void SetMapsLayerFilter(int layer, MapFilter filter)
+{
+    for ( EditorMap * m = map_head; m != NULL; m = m->next ) {
+        SetMapLayerFilter(&m->map, layer, filter);
+    }
 }
 
 void MapNextItem(int direction)
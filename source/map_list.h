@@ -25,6 +25,16 @@ void SetCurrentMap(const char * path);
 const char * CurrentMapPath(void);
 
 void SaveCurrentMap(void);
+
+/// Set the codec maps are compressed with. Maps saved with a different one
+/// are recompressed on their next save.
+void SetMapsCodec(MapCodec codec);
+void SetMapsLayerFilter(int layer, MapFilter filter);
+
+/// Finish up any map saves that have completed in the background, calling
+/// `completed` for each.
+/// - returns: Whether any map is still saving.
+bool UpdateMapSaves(void (* completed)(const EditorMap * map, bool succeeded));
 void MapNextItem(int direction);
 void OpenEditorMap(const char * path, Uint16 width, Uint16 height, Uint8 num_layers);
 void UpdateMapViews(const SDL_Rect * palette_viewport, int font_height, int tile_size);
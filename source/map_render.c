@@ -0,0 +1,264 @@
+//
+//  map_render.c
+//  te
+//
+//  Caches one texture per map chunk with its visible layers drawn in, at one
+//  texel per tile pixel, so an idle frame draws a few dozen textured quads
+//  however many tiles are in view. Zooming scales the textures; only edits
+//  redraw them.
+//
+
+#include "map_render.h"
+#include "av.h"
+#include "profiler.h"
+#include "tile_batch.h"
+
+#include <stdio.h>
+
+// Textures of chunks out of view are kept while the cache fits in this many
+// bytes. Chunks in view are always kept.
+#define CACHE_BUDGET (128 << 20)
+
+typedef struct {
+    SDL_Texture * texture; // NULL if not rendered yet.
+    Uint32 last_used; // Frame last drawn.
+} CachedChunk;
+
+static const Map * _cache_map;
+static const Tileset * _cache_tilesets;
+static int _cache_w; // Size of chunk grid.
+static int _cache_h;
+static int _cache_tile_size;
+static Uint8 _cache_layers;
+static CachedChunk * _cache;
+static size_t _cache_bytes;
+static Uint32 _frame;
+static bool _targets_unsupported;
+
+void FlushMapRenderCache(void)
+{
+    if ( _cache != NULL ) {
+        for ( int i = 0; i < _cache_w * _cache_h; i++ ) {
+            if ( _cache[i].texture != NULL ) {
+                SDL_DestroyTexture(_cache[i].texture);
+            }
+        }
+        SDL_free(_cache);
+    }
+
+    _cache = NULL;
+    _cache_map = NULL;
+    _cache_bytes = 0;
+}
+
+/// Start the cache over if anything it was drawn with has changed.
+static bool
+ValidateCache(const Map * map,
+              const Tileset * tilesets,
+              int tile_size,
+              Uint8 layer_mask)
+{
+    if ( _cache != NULL
+        && _cache_map == map
+        && _cache_tilesets == tilesets
+        && _cache_w == map->chunks_w
+        && _cache_h == map->chunks_h
+        && _cache_tile_size == tile_size
+        && _cache_layers == layer_mask ) {
+        return true;
+    }
+
+    FlushMapRenderCache();
+
+    // SDL_calloc returns a pointer even for a map with no chunks, so NULL
+    // only means it failed.
+    _cache = SDL_calloc((size_t)map->chunks_w * (size_t)map->chunks_h,
+                        sizeof(*_cache));
+    if ( _cache == NULL ) {
+        fprintf(stderr, "%s: calloc failed\n", __func__);
+        return false;
+    }
+
+    _cache_map = map;
+    _cache_tilesets = tilesets;
+    _cache_w = map->chunks_w;
+    _cache_h = map->chunks_h;
+    _cache_tile_size = tile_size;
+    _cache_layers = layer_mask;
+
+    return true;
+}
+
+/// Draw the tiles of a chunk, with its top left corner at `origin` and each
+/// tile `size` wide, one batch per layer.
+static void
+DrawChunkTiles(const Map * map,
+               int cx,
+               int cy,
+               Uint8 layer_mask,
+               SDL_FPoint origin,
+               float size)
+{
+    int w = SDL_min(CHUNK_SIZE, map->width - cx * CHUNK_SIZE);
+    int h = SDL_min(CHUNK_SIZE, map->height - cy * CHUNK_SIZE);
+
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        const Chunk * chunk = &map->chunks[l][cy * map->chunks_w + cx];
+        if ( !(layer_mask & (1 << l)) || chunk->tiles == NULL ) {
+            continue; // Hidden, empty, or still paging in.
+        }
+
+        for ( int y = 0; y < h; y++ ) {
+            for ( int x = 0; x < w; x++ ) {
+                SDL_FRect dest = {
+                    origin.x + (float)x * size,
+                    origin.y + (float)y * size,
+                    size,
+                    size
+                };
+                BatchTile(__renderer, chunk->tiles[y * CHUNK_SIZE + x], &dest);
+            }
+        }
+
+        FlushTileBatch(__renderer);
+    }
+}
+
+static bool NeedsRedraw(const Map * map, int cx, int cy)
+{
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        if ( map->chunks[l][cy * map->chunks_w + cx].flags & CHUNK_REDRAW ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Get the chunk's texture, rendering it first if it's new or out of date.
+///
+/// - returns: NULL if the renderer can't render to textures.
+static SDL_Texture *
+UpdateChunkTexture(Map * map, int cx, int cy)
+{
+    CachedChunk * cached = &_cache[cy * map->chunks_w + cx];
+    cached->last_used = _frame;
+
+    if ( cached->texture != NULL && !NeedsRedraw(map, cx, cy) ) {
+        return cached->texture;
+    }
+
+    int size = CHUNK_SIZE * _cache_tile_size;
+    if ( cached->texture == NULL ) {
+        cached->texture = SDL_CreateTexture(__renderer,
+                                            SDL_PIXELFORMAT_ARGB8888,
+                                            SDL_TEXTUREACCESS_TARGET,
+                                            size, size);
+        if ( cached->texture == NULL ) {
+            fprintf(stderr, "%s: could not create chunk texture (%s), "
+                    "drawing tiles directly\n", __func__, SDL_GetError());
+            _targets_unsupported = true;
+            return NULL;
+        }
+
+        // Tiles blended onto the cleared texture leave its colors already
+        // multiplied by their alpha, so it mustn't be multiplied again.
+        SDL_SetTextureBlendMode(cached->texture,
+                                SDL_BLENDMODE_BLEND_PREMULTIPLIED);
+        SDL_SetTextureScaleMode(cached->texture, SDL_SCALEMODE_NEAREST);
+        _cache_bytes += (size_t)size * (size_t)size * 4;
+    }
+
+    SDL_Rect viewport;
+    SDL_GetRenderViewport(__renderer, &viewport);
+    SDL_SetRenderTarget(__renderer, cached->texture);
+
+    SDL_SetRenderDrawColor(__renderer, 0, 0, 0, 0);
+    SDL_RenderClear(__renderer);
+    DrawChunkTiles(map, cx, cy, _cache_layers,
+                   (SDL_FPoint){ 0.0f, 0.0f }, (float)_cache_tile_size);
+
+    SDL_SetRenderTarget(__renderer, NULL);
+    SDL_SetRenderViewport(__renderer, &viewport);
+
+    // Hidden layers are included: showing one starts the cache over anyway.
+    for ( int l = 0; l < map->num_layers; l++ ) {
+        map->chunks[l][cy * map->chunks_w + cx].flags &= (Uint8)~CHUNK_REDRAW;
+    }
+
+    return cached->texture;
+}
+
+/// Drop the least recently drawn textures not in view while over budget.
+static void EvictTextures(void)
+{
+    while ( _cache_bytes > CACHE_BUDGET ) {
+        CachedChunk * oldest = NULL;
+        for ( int i = 0; i < _cache_w * _cache_h; i++ ) {
+            CachedChunk * cached = &_cache[i];
+            if ( cached->texture != NULL
+                && cached->last_used != _frame
+                && (oldest == NULL || cached->last_used < oldest->last_used) ) {
+                oldest = cached;
+            }
+        }
+
+        if ( oldest == NULL ) {
+            return; // Everything left is in view.
+        }
+
+        float w, h;
+        SDL_GetTextureSize(oldest->texture, &w, &h);
+        _cache_bytes -= (size_t)w * (size_t)h * 4;
+        SDL_DestroyTexture(oldest->texture);
+        oldest->texture = NULL;
+    }
+}
+
+void RenderMapChunks(Map * map,
+                     const View * view,
+                     Tileset * tilesets,
+                     int tile_size,
+                     Uint8 layer_mask)
+{
+    bool cached = !_targets_unsupported
+        && ValidateCache(map, tilesets, tile_size, layer_mask);
+    _frame++;
+
+    // Chunks in view.
+    SDL_FRect visible = GetVisibleRect(view);
+    float chunk_size = (float)(CHUNK_SIZE * tile_size);
+    int min_cx = SDL_max((int)SDL_floorf(visible.x / chunk_size), 0);
+    int min_cy = SDL_max((int)SDL_floorf(visible.y / chunk_size), 0);
+    int max_cx = SDL_min((int)SDL_ceilf((visible.x + visible.w) / chunk_size),
+                         map->chunks_w);
+    int max_cy = SDL_min((int)SDL_ceilf((visible.y + visible.h) / chunk_size),
+                         map->chunks_h);
+
+    for ( int cy = min_cy; cy < max_cy; cy++ ) {
+        for ( int cx = min_cx; cx < max_cx; cx++ ) {
+            int x = cx * CHUNK_SIZE * tile_size;
+            int y = cy * CHUNK_SIZE * tile_size;
+            int size = CHUNK_SIZE * tile_size;
+            SDL_FRect dest = GetViewRect(view, x, y, size, size);
+
+            SDL_Texture * texture = NULL;
+            if ( cached && !_targets_unsupported ) {
+                texture = UpdateChunkTexture(map, cx, cy);
+            }
+
+            if ( texture != NULL ) {
+                SDL_RenderTexture(__renderer, texture, NULL, &dest);
+                __profile_counts.draw_calls++;
+            } else {
+                float tile_w = dest.w / (float)CHUNK_SIZE;
+                DrawChunkTiles(map, cx, cy, layer_mask,
+                               (SDL_FPoint){ dest.x, dest.y }, tile_w);
+            }
+        }
+    }
+
+    if ( cached ) {
+        EvictTextures();
+    }
+}
@@ -0,0 +1,34 @@
+//
+//  map_render.h
+//  te
+//
+//  Draws the map view from textures of pre-rendered chunks.
+//
+
+#ifndef map_render_h
+#define map_render_h
+
+#include "map.h"
+#include "view.h"
+
+#include <SDL3/SDL.h>
+
+///
+/// Draw the layers in `layer_mask` (bit n for layer n) of the chunks in
+/// `view`. Each chunk is rendered once into a texture holding all of those
+/// layers, and only rendered again after `SetMapTile` or a resize flags it
+/// with `CHUNK_REDRAW`, which this clears.
+///
+/// Changing the map, tile size, tilesets or layers drawn starts the cache
+/// over. If the renderer can't render to textures, tiles are drawn directly.
+///
+void RenderMapChunks(Map * map,
+                     const View * view,
+                     Tileset * tilesets,
+                     int tile_size,
+                     Uint8 layer_mask);
+
+/// Destroy all cached chunk textures. Call when the render device is reset.
+void FlushMapRenderCache(void);
+
+#endif /* map_render_h */
@@ -300,10 +300,19 @@ bool BeginParsing(const char * path)
         exit(1);
     }
 
-    fread(input, 1, size, file);
-    input[size] = '\0';
+    // Text mode reads can come up short of the file size (CRLF on Windows).
+    size_t size_read = fread(input, 1, size, file);
+    bool failed = ferror(file) != 0;
+    input[size_read] = '\0';
     fclose(file);
 
+    if ( failed ) {
+        fprintf(stderr, "parse error: could not read '%s'\n", path);
+        free(input);
+        input = NULL;
+        return false;
+    }
+
     StripComments(input, '#');
     _c = input;
     GetToken();
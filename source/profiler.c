@@ -0,0 +1,273 @@
+//
+//  profiler.c
+//  te
+//
+//  Phase times are laps of one clock: starting a phase ends the last, so a
+//  frame costs a clock read per phase. Bytes allocated are those through
+//  SDL's allocator, which includes the renderer's command and vertex buffers.
+//  Frames and phases are also traced, when tracing.
+//
+
+#include "profiler.h"
+#include "trace.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+#define PROFILE_HISTORY 128 // Frames in the graph.
+#define BAR_W 2
+#define GRAPH_H 100
+#define GRAPH_MS 33.3f // Frame time at the top of the graph.
+#define TARGET_MS 16.7f // A line is drawn here.
+#define MARGIN 8
+#define LINE_CHARS 30 // Width of the text, in characters.
+
+typedef struct {
+    Uint64 phase_ns[NUM_PHASES];
+    ProfileCounts counts;
+    int bytes;
+} ProfileFrame;
+
+static const char * _phase_names[NUM_PHASES] = {
+    [PHASE_EVENTS]      = "events",
+    [PHASE_BACKGROUND]  = "saves/stream",
+    [PHASE_VIEW_SIZES]  = "view sizes",
+    [PHASE_STATE]       = "state update",
+    [PHASE_MAP]         = "map",
+    [PHASE_PALETTE]     = "palette",
+    [PHASE_HUD]         = "hud",
+    [PHASE_OVERLAYS]    = "overlays",
+    [PHASE_PRESENT]     = "present",
+};
+
+static const SDL_Color _phase_colors[NUM_PHASES] = {
+    [PHASE_EVENTS]      = { 0xE0, 0x60, 0x60, 0xFF },
+    [PHASE_BACKGROUND]  = { 0xE0, 0xA0, 0x40, 0xFF },
+    [PHASE_VIEW_SIZES]  = { 0xE0, 0xE0, 0x40, 0xFF },
+    [PHASE_STATE]       = { 0x80, 0xE0, 0x40, 0xFF },
+    [PHASE_MAP]         = { 0x40, 0xC0, 0x80, 0xFF },
+    [PHASE_PALETTE]     = { 0x40, 0xC0, 0xE0, 0xFF },
+    [PHASE_HUD]         = { 0x60, 0x80, 0xFF, 0xFF },
+    [PHASE_OVERLAYS]    = { 0xA0, 0x60, 0xFF, 0xFF },
+    [PHASE_PRESENT]     = { 0xA0, 0xA0, 0xA0, 0xFF },
+};
+
+ProfileCounts __profile_counts;
+
+static ProfileFrame _history[PROFILE_HISTORY];
+static int _num_frames;
+static int _next_frame;
+
+static ProfileFrame _current;
+static ProfilePhase _phase;
+static Uint64 _phase_start;
+static bool _frame_open; // Begun but not ended.
+
+static SDL_AtomicInt _bytes; // Allocated through SDL this frame.
+static SDL_malloc_func _malloc;
+static SDL_calloc_func _calloc;
+static SDL_realloc_func _realloc;
+static SDL_free_func _free;
+
+static void CountBytes(size_t size)
+{
+    SDL_AddAtomicInt(&_bytes, (int)SDL_min(size, (size_t)INT_MAX));
+}
+
+static void * SDLCALL CountingMalloc(size_t size)
+{
+    CountBytes(size);
+    return _malloc(size);
+}
+
+static void * SDLCALL CountingCalloc(size_t count, size_t size)
+{
+    CountBytes(count * size);
+    return _calloc(count, size);
+}
+
+static void * SDLCALL CountingRealloc(void * memory, size_t size)
+{
+    CountBytes(size);
+    return _realloc(memory, size);
+}
+
+static void SDLCALL CountingFree(void * memory)
+{
+    _free(memory);
+}
+
+void InitProfiler(void)
+{
+    SDL_GetOriginalMemoryFunctions(&_malloc, &_calloc, &_realloc, &_free);
+    if ( !SDL_SetMemoryFunctions(CountingMalloc,
+                                 CountingCalloc,
+                                 CountingRealloc,
+                                 CountingFree) ) {
+        fprintf(stderr, "%s: could not count allocations: %s\n",
+                __func__, SDL_GetError());
+    }
+}
+
+void BeginProfileFrame(ProfilePhase phase)
+{
+    if ( _frame_open ) { // It drew nothing.
+        TraceEnd(_phase_names[_phase]);
+        TraceEnd("frame");
+    }
+
+    _current = (ProfileFrame){ 0 };
+    __profile_counts = (ProfileCounts){ 0 };
+    SDL_SetAtomicInt(&_bytes, 0);
+
+    TraceBegin("frame");
+    TraceBegin(_phase_names[phase]);
+    _frame_open = true;
+
+    _phase = phase;
+    _phase_start = SDL_GetTicksNS();
+}
+
+/// Add the time since the last lap to the current phase.
+static void Lap(void)
+{
+    Uint64 now = SDL_GetTicksNS();
+    _current.phase_ns[_phase] += now - _phase_start;
+    _phase_start = now;
+}
+
+void SetProfilePhase(ProfilePhase phase)
+{
+    Lap();
+    TraceEnd(_phase_names[_phase]);
+    TraceBegin(_phase_names[phase]);
+    _phase = phase;
+}
+
+void EndProfileFrame(void)
+{
+    Lap();
+    TraceEnd(_phase_names[_phase]);
+    TraceEnd("frame");
+    _frame_open = false;
+
+    _current.counts = __profile_counts;
+    _current.bytes = SDL_GetAtomicInt(&_bytes);
+
+    _history[_next_frame] = _current;
+    _next_frame = (_next_frame + 1) % PROFILE_HISTORY;
+    _num_frames = SDL_min(_num_frames + 1, PROFILE_HISTORY);
+}
+
+static const ProfileFrame * GetFrame(int age)
+{
+    return &_history[(_next_frame - 1 - age + PROFILE_HISTORY) % PROFILE_HISTORY];
+}
+
+/// A bar per frame, newest on the right, split into its phases.
+static void RenderGraph(float x, float y)
+{
+    float pixels_per_ns = GRAPH_H / (GRAPH_MS * SDL_NS_PER_MS);
+    float bottoms[PROFILE_HISTORY];
+    for ( int i = 0; i < _num_frames; i++ ) {
+        bottoms[i] = y + GRAPH_H;
+    }
+
+    for ( int p = 0; p < NUM_PHASES; p++ ) {
+        SDL_FRect rects[PROFILE_HISTORY];
+        int num_rects = 0;
+
+        for ( int i = 0; i < _num_frames; i++ ) {
+            float h = (float)GetFrame(i)->phase_ns[p] * pixels_per_ns;
+            float top = SDL_max(bottoms[i] - h, y);
+            if ( top < bottoms[i] ) {
+                rects[num_rects++] = (SDL_FRect){
+                    x + (float)((PROFILE_HISTORY - 1 - i) * BAR_W),
+                    top,
+                    BAR_W,
+                    bottoms[i] - top
+                };
+                bottoms[i] = top;
+            }
+        }
+
+        SetColor(_phase_colors[p]);
+        SDL_RenderFillRects(__renderer, rects, num_rects);
+        __profile_counts.draw_calls++;
+    }
+
+    float target_y = y + GRAPH_H - TARGET_MS / GRAPH_MS * GRAPH_H;
+    SDL_SetRenderDrawColor(__renderer, 255, 255, 255, 96);
+    SDL_RenderLine(__renderer, x, target_y, x + PROFILE_HISTORY * BAR_W, target_y);
+    __profile_counts.draw_calls++;
+}
+
+void RenderProfiler(Font * font)
+{
+    int window_w, window_h;
+    SDL_GetCurrentRenderOutputSize(__renderer, &window_w, &window_h);
+
+    int line_h = FontHeight(font);
+    int w = SDL_max(PROFILE_HISTORY * BAR_W, FontWidth(font) * LINE_CHARS);
+    int h = GRAPH_H + MARGIN + line_h * (NUM_PHASES + 4);
+    int x = window_w - w - MARGIN * 2;
+    int y = MARGIN * 2;
+
+    SDL_FRect panel = {
+        (float)(x - MARGIN),
+        (float)(y - MARGIN),
+        (float)(w + MARGIN * 2),
+        (float)(h + MARGIN * 2)
+    };
+
+    // The panel and the graph's target line are see-through, whatever mode
+    // the rest of the frame draws with.
+    SDL_BlendMode blend_mode;
+    SDL_GetRenderDrawBlendMode(__renderer, &blend_mode);
+    SDL_SetRenderDrawBlendMode(__renderer, SDL_BLENDMODE_BLEND);
+
+    SDL_SetRenderDrawColor(__renderer, 0, 0, 0, 192);
+    SDL_RenderFillRect(__renderer, &panel);
+    RenderGraph((float)x, (float)y);
+    y += GRAPH_H + MARGIN;
+
+    SDL_SetRenderDrawBlendMode(__renderer, blend_mode);
+
+    // Frame times, including any wait for vsync.
+    FrameStats stats;
+    GetFrameStats(&stats);
+    SDL_SetRenderDrawColor(__renderer, 255, 255, 255, 255);
+    RenderString(font, x, y, "frame min %.1f avg %.1f ms",
+                 (double)stats.min, (double)stats.avg);
+    y += line_h;
+    RenderString(font, x, y, "      p99 %.1f worst %.1f ms",
+                 (double)stats.p99, (double)stats.worst);
+    y += line_h;
+
+    if ( _num_frames == 0 ) {
+        return;
+    }
+
+    // Last frame's phases, and their average.
+    for ( int p = 0; p < NUM_PHASES; p++ ) {
+        Uint64 total = 0;
+        for ( int i = 0; i < _num_frames; i++ ) {
+            total += GetFrame(i)->phase_ns[p];
+        }
+
+        double last_ms = (double)GetFrame(0)->phase_ns[p] / SDL_NS_PER_MS;
+        double avg_ms = (double)total / (double)_num_frames / SDL_NS_PER_MS;
+
+        SetColor(_phase_colors[p]);
+        RenderString(font, x, y, "%-12s %6.2f avg %6.2f",
+                     _phase_names[p], last_ms, avg_ms);
+        y += line_h;
+    }
+
+    const ProfileFrame * last = GetFrame(0);
+    SDL_SetRenderDrawColor(__renderer, 255, 255, 255, 255);
+    RenderString(font, x, y, "draws %d tiles %d",
+                 last->counts.draw_calls, last->counts.tiles);
+    y += line_h;
+    RenderString(font, x, y, "alloc %.1f KB", (double)last->bytes / 1024.0);
+}
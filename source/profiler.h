@@ -0,0 +1,55 @@
+//
+//  profiler.h
+//  te
+//
+//  Times the phases of each frame and counts what they draw, and shows the
+//  last few seconds of it in an overlay.
+//
+
+#ifndef profiler_h
+#define profiler_h
+
+#include "av.h"
+
+#include <SDL3/SDL.h>
+
+typedef enum {
+    PHASE_EVENTS,
+    PHASE_BACKGROUND, // Saves and streaming.
+    PHASE_VIEW_SIZES,
+    PHASE_STATE,
+    PHASE_MAP,
+    PHASE_PALETTE,
+    PHASE_HUD,
+    PHASE_OVERLAYS,
+    PHASE_PRESENT,
+    NUM_PHASES
+} ProfilePhase;
+
+typedef struct {
+    int draw_calls;
+    int tiles;
+} ProfileCounts;
+
+/// This frame's counts so far. Bump them where draw calls are made and
+/// tiles are queued.
+extern ProfileCounts __profile_counts;
+
+/// Count SDL's allocations. Call before SDL is initialized.
+void InitProfiler(void);
+
+/// Start timing a frame, in its first phase.
+void BeginProfileFrame(ProfilePhase phase);
+
+/// End the current phase and start `phase`.
+void SetProfilePhase(ProfilePhase phase);
+
+/// End the frame and add it to the history. A frame that isn't ended, say
+/// because nothing was drawn, isn't recorded.
+void EndProfileFrame(void);
+
+/// Draw the frame time graph and a breakdown of the last frame in the top
+/// right of the window.
+void RenderProfiler(Font * font);
+
+#endif /* profiler_h */
@@ -0,0 +1,490 @@
+//
+//  rle.c
+//  te
+//
+//  Run-length coding of 16-bit tile data. The format is produced one step at
+//  a time: each step takes the run of equal values at the current position
+//  (up to 0xFFFF long) and writes either RLE_TAG, count, value, or for short
+//  runs of anything but RLE_TAG, the values themselves.
+//
+//  The SIMD kernels find run boundaries and literal spans 8 or 16 values at a
+//  time and fill runs with wide stores, but make the same decisions as the
+//  scalar kernel, so all kernels produce byte-identical output.
+//
+
+#include "rle.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RLE_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(RLE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define SSE2_TARGET
+#define AVX2_TARGET
+#endif
+
+#define MAX_RUN 0xFFFF
+
+// Most runs and literal spans in a map are short. The SIMD kernels check this
+// many values one at a time before switching to vector compares.
+#define SHORT_SPAN 4
+
+// Get the length of the run of `src[0]`, up to `max` values.
+typedef size_t (* RunLengthFunc)(const Uint16 * src, size_t max);
+
+// Get the number of leading values in `src` that would be written as is.
+typedef size_t (* SpanFunc)(const Uint16 * src, size_t count);
+
+typedef void (* FillFunc)(Uint16 * dest, Uint16 value, size_t count);
+
+static int FirstSetBit(Uint32 mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+#ifdef __APPLE__
+#pragma mark - GENERIC CODER
+#endif
+
+/// The encoder, shared by all kernels. Once inlined, the helpers are direct
+/// calls that the compiler can inline as well.
+SDL_FORCE_INLINE size_t
+Encode(const Uint16 * src, size_t count,
+       Uint16 * dest, size_t dest_capacity,
+       RunLengthFunc run_length, SpanFunc singleton_span)
+{
+    const Uint16 * src_end = src + count;
+    Uint16 * dest_start = dest;
+    Uint16 * dest_end = dest + dest_capacity;
+
+    while ( src < src_end ) {
+        // Each step writes up to three values. Give up once there's no room.
+        if ( dest_end - dest < 3 ) {
+            return 0;
+        }
+
+        size_t max = SDL_min((size_t)(src_end - src), MAX_RUN);
+        size_t run = run_length(src, max);
+        Uint16 value = *src;
+
+        // A lone value is likely followed by more: copy everything up to the
+        // next run in one go. Since they'd each be a step of their own, each
+        // value needs room for three.
+        if ( run == 1 && value != RLE_TAG ) {
+            size_t n = singleton_span(src, (size_t)(src_end - src));
+            if ( n > (size_t)(dest_end - dest) - 2 ) {
+                return 0;
+            }
+
+            memcpy(dest, src, n * sizeof(*src));
+            dest += n;
+            src += n;
+            continue;
+        }
+
+        src += run;
+
+        if ( run > 3 || value == RLE_TAG ) {
+            *dest++ = RLE_TAG;
+            *dest++ = (Uint16)run;
+            *dest++ = value;
+        } else {
+            for ( size_t i = 0; i < run; i++ ) {
+                *dest++ = value;
+            }
+        }
+    }
+
+    return (size_t)(dest - dest_start);
+}
+
+/// The decoder, shared by all kernels.
+SDL_FORCE_INLINE bool
+Decode(const Uint16 * src, size_t count,
+       Uint16 * dest, size_t dest_count,
+       SpanFunc tag_span, FillFunc fill)
+{
+    const Uint16 * src_end = src + count;
+    Uint16 * dest_end = dest + dest_count;
+
+    while ( src < src_end ) {
+        // Copy literals up to the next run.
+        size_t n = tag_span(src, (size_t)(src_end - src));
+        if ( n > 0 ) {
+            if ( n > (size_t)(dest_end - dest) ) {
+                return false; // Overflows the destination.
+            }
+
+            memcpy(dest, src, n * sizeof(*src));
+            dest += n;
+            src += n;
+            continue;
+        }
+
+        if ( src_end - src < 3 ) {
+            return false; // Truncated run.
+        }
+
+        size_t run = src[1];
+        Uint16 value = src[2];
+        src += 3;
+
+        if ( run > (size_t)(dest_end - dest) ) {
+            return false; // Run overflows the destination.
+        }
+
+        fill(dest, value, run);
+        dest += run;
+    }
+
+    return dest == dest_end;
+}
+
+#ifdef __APPLE__
+#pragma mark - SCALAR
+#endif
+
+static size_t RunLengthScalar(const Uint16 * src, size_t max)
+{
+    size_t n = 1;
+    while ( n < max && src[n] == src[0] ) {
+        n++;
+    }
+
+    return n;
+}
+
+static size_t SingletonSpanScalar(const Uint16 * src, size_t count)
+{
+    size_t n = 0;
+    while ( n < count
+           && src[n] != RLE_TAG
+           && (n + 1 == count || src[n] != src[n + 1]) ) {
+        n++;
+    }
+
+    return n;
+}
+
+static size_t TagSpanScalar(const Uint16 * src, size_t count)
+{
+    size_t n = 0;
+    while ( n < count && src[n] != RLE_TAG ) {
+        n++;
+    }
+
+    return n;
+}
+
+static void FillScalar(Uint16 * dest, Uint16 value, size_t count)
+{
+    for ( size_t i = 0; i < count; i++ ) {
+        dest[i] = value;
+    }
+}
+
+static size_t
+EncodeScalar(const Uint16 * src, size_t count, Uint16 * dest, size_t capacity)
+{
+    return Encode(src, count, dest, capacity,
+                  RunLengthScalar, SingletonSpanScalar);
+}
+
+static bool
+DecodeScalar(const Uint16 * src, size_t count, Uint16 * dest, size_t dest_count)
+{
+    return Decode(src, count, dest, dest_count, TagSpanScalar, FillScalar);
+}
+
+#ifdef RLE_X86
+
+#ifdef __APPLE__
+#pragma mark - SSE2
+#endif
+
+SSE2_TARGET static size_t RunLengthSSE2(const Uint16 * src, size_t max)
+{
+    __m128i value = _mm_set1_epi16((short)src[0]);
+    size_t n = 1;
+
+    while ( n < SHORT_SPAN && n < max && src[n] == src[0] ) {
+        n++;
+    }
+
+    if ( n < SHORT_SPAN ) {
+        return n;
+    }
+
+    for ( ; n + 8 <= max; n += 8 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + n));
+        Uint32 equal = (Uint32)_mm_movemask_epi8(_mm_cmpeq_epi16(v, value));
+        if ( equal != 0xFFFF ) {
+            return n + (size_t)FirstSetBit(~equal) / 2;
+        }
+    }
+
+    while ( n < max && src[n] == src[0] ) {
+        n++;
+    }
+
+    return n;
+}
+
+SSE2_TARGET static size_t SingletonSpanSSE2(const Uint16 * src, size_t count)
+{
+    __m128i tag = _mm_set1_epi16((short)RLE_TAG);
+    size_t n = 0;
+
+    if ( count > SHORT_SPAN ) {
+        for ( ; n < SHORT_SPAN; n++ ) {
+            if ( src[n] == RLE_TAG || src[n] == src[n + 1] ) {
+                return n;
+            }
+        }
+    }
+
+    // A value starts a run if it's equal to the next one.
+    for ( ; n + 9 <= count; n += 8 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + n));
+        __m128i next = _mm_loadu_si128((const __m128i *)(src + n + 1));
+        __m128i stop = _mm_or_si128(_mm_cmpeq_epi16(v, next),
+                                    _mm_cmpeq_epi16(v, tag));
+        Uint32 mask = (Uint32)_mm_movemask_epi8(stop);
+        if ( mask != 0 ) {
+            return n + (size_t)FirstSetBit(mask) / 2;
+        }
+    }
+
+    return n + SingletonSpanScalar(src + n, count - n);
+}
+
+SSE2_TARGET static size_t TagSpanSSE2(const Uint16 * src, size_t count)
+{
+    __m128i tag = _mm_set1_epi16((short)RLE_TAG);
+    size_t n = 0;
+
+    for ( ; n + 8 <= count; n += 8 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + n));
+        Uint32 mask = (Uint32)_mm_movemask_epi8(_mm_cmpeq_epi16(v, tag));
+        if ( mask != 0 ) {
+            return n + (size_t)FirstSetBit(mask) / 2;
+        }
+    }
+
+    return n + TagSpanScalar(src + n, count - n);
+}
+
+SSE2_TARGET static void FillSSE2(Uint16 * dest, Uint16 value, size_t count)
+{
+    __m128i v = _mm_set1_epi16((short)value);
+    size_t i = 0;
+
+    for ( ; i + 8 <= count; i += 8 ) {
+        _mm_storeu_si128((__m128i *)(dest + i), v);
+    }
+
+    FillScalar(dest + i, value, count - i);
+}
+
+SSE2_TARGET static size_t
+EncodeSSE2(const Uint16 * src, size_t count, Uint16 * dest, size_t capacity)
+{
+    return Encode(src, count, dest, capacity,
+                  RunLengthSSE2, SingletonSpanSSE2);
+}
+
+SSE2_TARGET static bool
+DecodeSSE2(const Uint16 * src, size_t count, Uint16 * dest, size_t dest_count)
+{
+    return Decode(src, count, dest, dest_count, TagSpanSSE2, FillSSE2);
+}
+
+#ifdef __APPLE__
+#pragma mark - AVX2
+#endif
+
+AVX2_TARGET static size_t RunLengthAVX2(const Uint16 * src, size_t max)
+{
+    __m256i value = _mm256_set1_epi16((short)src[0]);
+    size_t n = 1;
+
+    while ( n < SHORT_SPAN && n < max && src[n] == src[0] ) {
+        n++;
+    }
+
+    if ( n < SHORT_SPAN ) {
+        return n;
+    }
+
+    for ( ; n + 16 <= max; n += 16 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + n));
+        Uint32 equal = (Uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, value));
+        if ( equal != 0xFFFFFFFF ) {
+            return n + (size_t)FirstSetBit(~equal) / 2;
+        }
+    }
+
+    while ( n < max && src[n] == src[0] ) {
+        n++;
+    }
+
+    return n;
+}
+
+AVX2_TARGET static size_t SingletonSpanAVX2(const Uint16 * src, size_t count)
+{
+    __m256i tag = _mm256_set1_epi16((short)RLE_TAG);
+    size_t n = 0;
+
+    if ( count > SHORT_SPAN ) {
+        for ( ; n < SHORT_SPAN; n++ ) {
+            if ( src[n] == RLE_TAG || src[n] == src[n + 1] ) {
+                return n;
+            }
+        }
+    }
+
+    for ( ; n + 17 <= count; n += 16 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + n));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(src + n + 1));
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi16(v, next),
+                                       _mm256_cmpeq_epi16(v, tag));
+        Uint32 mask = (Uint32)_mm256_movemask_epi8(stop);
+        if ( mask != 0 ) {
+            return n + (size_t)FirstSetBit(mask) / 2;
+        }
+    }
+
+    return n + SingletonSpanScalar(src + n, count - n);
+}
+
+AVX2_TARGET static size_t TagSpanAVX2(const Uint16 * src, size_t count)
+{
+    __m256i tag = _mm256_set1_epi16((short)RLE_TAG);
+    size_t n = 0;
+
+    for ( ; n + 16 <= count; n += 16 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + n));
+        Uint32 mask = (Uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, tag));
+        if ( mask != 0 ) {
+            return n + (size_t)FirstSetBit(mask) / 2;
+        }
+    }
+
+    return n + TagSpanScalar(src + n, count - n);
+}
+
+AVX2_TARGET static void FillAVX2(Uint16 * dest, Uint16 value, size_t count)
+{
+    __m256i v = _mm256_set1_epi16((short)value);
+    size_t i = 0;
+
+    for ( ; i + 16 <= count; i += 16 ) {
+        _mm256_storeu_si256((__m256i *)(dest + i), v);
+    }
+
+    FillScalar(dest + i, value, count - i);
+}
+
+AVX2_TARGET static size_t
+EncodeAVX2(const Uint16 * src, size_t count, Uint16 * dest, size_t capacity)
+{
+    return Encode(src, count, dest, capacity,
+                  RunLengthAVX2, SingletonSpanAVX2);
+}
+
+AVX2_TARGET static bool
+DecodeAVX2(const Uint16 * src, size_t count, Uint16 * dest, size_t dest_count)
+{
+    return Decode(src, count, dest, dest_count, TagSpanAVX2, FillAVX2);
+}
+
+#endif /* RLE_X86 */
+
+#ifdef __APPLE__
+#pragma mark - PUBLIC
+#endif
+
+bool RLE_IsKernelSupported(RLEKernel kernel)
+{
+    switch ( kernel ) {
+        case RLE_KERNEL_SCALAR:
+            return true;
+#ifdef RLE_X86
+        case RLE_KERNEL_SSE2:
+            return SDL_HasSSE2();
+        case RLE_KERNEL_AVX2:
+            return SDL_HasAVX2();
+#endif
+        default:
+            return false;
+    }
+}
+
+RLEKernel RLE_GetKernel(void)
+{
+    for ( int k = RLE_NUM_KERNELS - 1; k > RLE_KERNEL_SCALAR; k-- ) {
+        if ( RLE_IsKernelSupported((RLEKernel)k) ) {
+            return (RLEKernel)k;
+        }
+    }
+
+    return RLE_KERNEL_SCALAR;
+}
+
+const char * RLE_KernelName(RLEKernel kernel)
+{
+    switch ( kernel ) {
+        case RLE_KERNEL_SCALAR: return "scalar";
+        case RLE_KERNEL_SSE2: return "sse2";
+        case RLE_KERNEL_AVX2: return "avx2";
+        default: return "unknown";
+    }
+}
+
+size_t RLE_Encode(RLEKernel kernel,
+                  const Uint16 * src, size_t count,
+                  Uint16 * dest, size_t dest_capacity)
+{
+    switch ( kernel ) {
+#ifdef RLE_X86
+        case RLE_KERNEL_SSE2:
+            return EncodeSSE2(src, count, dest, dest_capacity);
+        case RLE_KERNEL_AVX2:
+            return EncodeAVX2(src, count, dest, dest_capacity);
+#endif
+        default:
+            return EncodeScalar(src, count, dest, dest_capacity);
+    }
+}
+
+bool RLE_Decode(RLEKernel kernel,
+                const Uint16 * src, size_t count,
+                Uint16 * dest, size_t dest_count)
+{
+    switch ( kernel ) {
+#ifdef RLE_X86
+        case RLE_KERNEL_SSE2:
+            return DecodeSSE2(src, count, dest, dest_count);
+        case RLE_KERNEL_AVX2:
+            return DecodeAVX2(src, count, dest, dest_count);
+#endif
+        default:
+            return DecodeScalar(src, count, dest, dest_count);
+    }
+}
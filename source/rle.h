@@ -0,0 +1,46 @@
+//
+//  rle.h
+//  te
+//
+//  Run-length coding of 16-bit tile data, used to compress map chunks.
+//
+
+#ifndef rle_h
+#define rle_h
+
+#include <SDL3/SDL.h>
+
+// Marks a run: RLE_TAG, count, value. Values equal to RLE_TAG are always
+// written as a run, everything else is a literal.
+#define RLE_TAG 0xABCD
+
+/// Implementations of the RLE coder. All produce identical output.
+typedef enum {
+    RLE_KERNEL_SCALAR,
+    RLE_KERNEL_SSE2,
+    RLE_KERNEL_AVX2,
+    RLE_NUM_KERNELS
+} RLEKernel;
+
+/// Get the fastest kernel the CPU supports.
+RLEKernel RLE_GetKernel(void);
+bool RLE_IsKernelSupported(RLEKernel kernel);
+const char * RLE_KernelName(RLEKernel kernel);
+
+/// Encode `count` values from `src` into `dest`.
+///
+/// - returns: The number of values written to `dest`, or 0 if the result
+///   does not fit in `dest_capacity` values.
+size_t RLE_Encode(RLEKernel kernel,
+                  const Uint16 * src, size_t count,
+                  Uint16 * dest, size_t dest_capacity);
+
+/// Decode `count` values from `src` into `dest`.
+///
+/// - returns: false if the data is malformed or doesn't decode to exactly
+///   `dest_count` values.
+bool RLE_Decode(RLEKernel kernel,
+                const Uint16 * src, size_t count,
+                Uint16 * dest, size_t dest_count);
+
+#endif /* rle_h */
@@ -0,0 +1,193 @@
+//
+//  tile_atlas.c
+//  te
+//
+//  Tilesets are packed whole, tallest first, in rows across atlases about as
+//  wide as they are tall, so a tile's rect in its atlas is its rect in its
+//  tileset plus the tileset's offset. A new atlas is started when one reaches
+//  the renderer's maximum texture size.
+//
+
+#include "tile_atlas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Used if the renderer doesn't say. Any renderer SDL has can do this much.
+#define DEFAULT_MAX_SIZE 4096
+
+typedef struct {
+    SDL_Texture * texture;
+    int w; // Size of the area used.
+    int h;
+} Atlas;
+
+static Atlas _atlases[MAX_TILESETS];
+static int _num_atlases;
+
+void FreeTileAtlases(Tileset * tilesets)
+{
+    for ( int i = 0; i < _num_atlases; i++ ) {
+        if ( _atlases[i].texture != NULL ) {
+            SDL_DestroyTexture(_atlases[i].texture);
+        }
+    }
+
+    memset(_atlases, 0, sizeof(_atlases));
+    _num_atlases = 0;
+
+    for ( Tileset * ts = tilesets; ts != NULL; ts = ts->next ) {
+        ts->atlas = NULL;
+    }
+
+    IndexTilesets(tilesets);
+}
+
+static int CompareHeight(const void * a, const void * b)
+{
+    const Tileset * ta = *(Tileset * const *)a;
+    const Tileset * tb = *(Tileset * const *)b;
+    return (tb->texture->h > ta->texture->h) - (tb->texture->h < ta->texture->h);
+}
+
+/// Place each tileset in `list` in an atlas, setting its `atlas_x` and
+/// `atlas_y` and its entry in `atlas_index`.
+static void
+LayOutAtlases(Tileset ** list, int count, int width, int max_size, int * atlas_index)
+{
+    int x = 0;
+    int y = 0;
+    int row_h = 0;
+    _num_atlases = 1;
+
+    for ( int i = 0; i < count; i++ ) {
+        Tileset * ts = list[i];
+        int w = ts->texture->w;
+        int h = ts->texture->h;
+
+        if ( x + w > width ) { // Next row.
+            x = 0;
+            y += row_h;
+            row_h = 0;
+        }
+
+        if ( y + h > max_size ) { // Next atlas.
+            _num_atlases++;
+            x = 0;
+            y = 0;
+            row_h = 0;
+        }
+
+        Atlas * atlas = &_atlases[_num_atlases - 1];
+        atlas->w = SDL_max(atlas->w, x + w);
+        atlas->h = SDL_max(atlas->h, y + h);
+
+        ts->atlas_x = x;
+        ts->atlas_y = y;
+        atlas_index[i] = _num_atlases - 1;
+
+        x += w;
+        row_h = SDL_max(row_h, h);
+    }
+}
+
+static void
+CopyToAtlas(SDL_Renderer * renderer, Tileset * ts, SDL_Texture * atlas)
+{
+    // Copy alpha as it is rather than blending it with the cleared atlas.
+    SDL_BlendMode mode;
+    SDL_GetTextureBlendMode(ts->texture, &mode);
+    SDL_SetTextureBlendMode(ts->texture, SDL_BLENDMODE_NONE);
+
+    SDL_FRect dest = {
+        (float)ts->atlas_x,
+        (float)ts->atlas_y,
+        (float)ts->texture->w,
+        (float)ts->texture->h
+    };
+    SDL_RenderTexture(renderer, ts->texture, NULL, &dest);
+
+    SDL_SetTextureBlendMode(ts->texture, mode);
+    ts->atlas = atlas;
+}
+
+void PackTilesets(SDL_Renderer * renderer, Tileset * tilesets)
+{
+    FreeTileAtlases(tilesets);
+
+    SDL_PropertiesID props = SDL_GetRendererProperties(renderer);
+    int max_size = (int)SDL_GetNumberProperty(props,
+                                              SDL_PROP_RENDERER_MAX_TEXTURE_SIZE_NUMBER,
+                                              0);
+    if ( max_size <= 0 ) {
+        max_size = DEFAULT_MAX_SIZE;
+    }
+
+    Tileset * list[MAX_TILESETS];
+    int count = 0;
+    Sint64 area = 0;
+    int widest = 0;
+
+    for ( Tileset * ts = tilesets; ts != NULL && count < MAX_TILESETS; ts = ts->next ) {
+        if ( ts->texture->w > max_size || ts->texture->h > max_size ) {
+            continue; // Stays in its own texture.
+        }
+
+        list[count++] = ts;
+        area += (Sint64)ts->texture->w * ts->texture->h;
+        widest = SDL_max(widest, ts->texture->w);
+    }
+
+    if ( count == 0 ) {
+        return;
+    }
+
+    qsort(list, (size_t)count, sizeof(*list), CompareHeight);
+
+    // Wide enough that everything would fit in a square, if it can.
+    int width = 1;
+    while ( width < max_size && (Sint64)width * width < area ) {
+        width *= 2;
+    }
+    width = SDL_min(SDL_max(width, widest), max_size);
+
+    int atlas_index[MAX_TILESETS];
+    LayOutAtlases(list, count, width, max_size, atlas_index);
+
+    SDL_Texture * target = SDL_GetRenderTarget(renderer);
+    SDL_Rect viewport;
+    SDL_GetRenderViewport(renderer, &viewport);
+
+    for ( int i = 0; i < _num_atlases; i++ ) {
+        Atlas * atlas = &_atlases[i];
+        atlas->texture = SDL_CreateTexture(renderer,
+                                           SDL_PIXELFORMAT_ARGB8888,
+                                           SDL_TEXTUREACCESS_TARGET,
+                                           atlas->w, atlas->h);
+        if ( atlas->texture == NULL ) {
+            fprintf(stderr, "%s: could not create %dx%d atlas (%s), "
+                    "drawing its tilesets separately\n",
+                    __func__, atlas->w, atlas->h, SDL_GetError());
+            continue;
+        }
+
+        SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+        SDL_SetTextureScaleMode(atlas->texture, SDL_SCALEMODE_NEAREST);
+
+        SDL_SetRenderTarget(renderer, atlas->texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+
+        for ( int j = 0; j < count; j++ ) {
+            if ( atlas_index[j] == i ) {
+                CopyToAtlas(renderer, list[j], atlas->texture);
+            }
+        }
+    }
+
+    SDL_SetRenderTarget(renderer, target);
+    SDL_SetRenderViewport(renderer, &viewport);
+
+    IndexTilesets(tilesets);
+}
@@ -0,0 +1,33 @@
+//
+//  tile_atlas.h
+//  te
+//
+//  Packs tilesets into a few large textures, so that tiles from different
+//  tilesets can be drawn in one batch.
+//
+
+#ifndef tile_atlas_h
+#define tile_atlas_h
+
+#include "map.h"
+
+#include <SDL3/SDL.h>
+
+///
+/// Copy the tilesets' textures into as few atlas textures as the renderer's
+/// maximum texture size allows, replacing any atlases already built, and
+/// re-index the tilesets so that GIDs are drawn from them. Each tileset's
+/// own texture is kept for drawing it on its own, as in the palette.
+///
+/// Tilesets that don't fit, or all of them if the renderer can't render to
+/// textures, are left to be drawn from their own textures.
+///
+/// Atlases are render targets, so build them again when render targets are
+/// reset.
+///
+void PackTilesets(SDL_Renderer * renderer, Tileset * tilesets);
+
+/// Destroy the atlases and go back to drawing from each tileset's texture.
+void FreeTileAtlases(Tileset * tilesets);
+
+#endif /* tile_atlas_h */
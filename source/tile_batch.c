@@ -0,0 +1,164 @@
+//
+//  tile_batch.c
+//  te
+//
+//  Collects quads into a vertex list per texture, so that a layer of tiles
+//  is drawn with one SDL_RenderGeometry call per tileset atlas rather than
+//  one SDL_RenderTexture call per tile. All quads share one index list.
+//
+
+#include "tile_batch.h"
+#include "profiler.h"
+
+#include <stdio.h>
+
+// Tilesets, plus room for the odd other texture.
+#define MAX_BATCHES (MAX_TILESETS + 4)
+
+typedef struct {
+    SDL_Texture * texture;
+    SDL_Vertex * vertices; // Four per quad.
+    int num_quads;
+    int capacity; // In quads.
+} Batch;
+
+static Batch _batches[MAX_BATCHES]; // Buffers are kept between flushes.
+static int _num_batches;
+
+static int * _indices; // 0 1 2 2 3 0 for each quad, offset by 4 for the next.
+static int _indices_capacity; // In quads.
+
+static Batch * GetBatch(SDL_Renderer * renderer, SDL_Texture * texture)
+{
+    // Tiles tend to come from the same texture as the last one.
+    for ( int i = _num_batches - 1; i >= 0; i-- ) {
+        if ( _batches[i].texture == texture ) {
+            return &_batches[i];
+        }
+    }
+
+    if ( _num_batches == MAX_BATCHES ) {
+        FlushTileBatch(renderer);
+    }
+
+    Batch * batch = &_batches[_num_batches++];
+    batch->texture = texture;
+    batch->num_quads = 0;
+    return batch;
+}
+
+static bool ReserveQuad(Batch * batch)
+{
+    if ( batch->num_quads < batch->capacity ) {
+        return true;
+    }
+
+    int new_capacity = batch->capacity ? batch->capacity * 2 : 256;
+    size_t size = (size_t)new_capacity * 4 * sizeof(SDL_Vertex);
+    SDL_Vertex * vertices = SDL_realloc(batch->vertices, size);
+    if ( vertices == NULL ) {
+        fprintf(stderr, "%s: realloc failed\n", __func__);
+        return false;
+    }
+
+    batch->vertices = vertices;
+    batch->capacity = new_capacity;
+    return true;
+}
+
+static bool ReserveIndices(int num_quads)
+{
+    if ( num_quads <= _indices_capacity ) {
+        return true;
+    }
+
+    int new_capacity = SDL_max(num_quads, _indices_capacity * 2);
+    int * indices = SDL_realloc(_indices, (size_t)new_capacity * 6 * sizeof(int));
+    if ( indices == NULL ) {
+        fprintf(stderr, "%s: realloc failed\n", __func__);
+        return false;
+    }
+
+    for ( int q = _indices_capacity; q < new_capacity; q++ ) {
+        int * i = &indices[q * 6];
+        int v = q * 4;
+        i[0] = v;
+        i[1] = v + 1;
+        i[2] = v + 2;
+        i[3] = v + 2;
+        i[4] = v + 3;
+        i[5] = v;
+    }
+
+    _indices = indices;
+    _indices_capacity = new_capacity;
+    return true;
+}
+
+void BatchTexture(SDL_Renderer * renderer,
+                  SDL_Texture * texture,
+                  const SDL_FRect * src,
+                  const SDL_FRect * dest)
+{
+    Batch * batch = GetBatch(renderer, texture);
+    if ( !ReserveQuad(batch) ) {
+        SDL_RenderTexture(renderer, texture, src, dest);
+        __profile_counts.draw_calls++;
+        return;
+    }
+
+    float u0 = 0.0f, v0 = 0.0f, u1 = 1.0f, v1 = 1.0f;
+    if ( src != NULL ) {
+        float tw = (float)texture->w;
+        float th = (float)texture->h;
+        u0 = src->x / tw;
+        v0 = src->y / th;
+        u1 = (src->x + src->w) / tw;
+        v1 = (src->y + src->h) / th;
+    }
+
+    const SDL_FColor white = { 1.0f, 1.0f, 1.0f, 1.0f };
+    float x0 = dest->x;
+    float y0 = dest->y;
+    float x1 = dest->x + dest->w;
+    float y1 = dest->y + dest->h;
+
+    SDL_Vertex * v = &batch->vertices[batch->num_quads++ * 4];
+    v[0] = (SDL_Vertex){ { x0, y0 }, white, { u0, v0 } };
+    v[1] = (SDL_Vertex){ { x1, y0 }, white, { u1, v0 } };
+    v[2] = (SDL_Vertex){ { x1, y1 }, white, { u1, v1 } };
+    v[3] = (SDL_Vertex){ { x0, y1 }, white, { u0, v1 } };
+}
+
+void BatchTile(SDL_Renderer * renderer, GID gid, const SDL_FRect * dest)
+{
+    const GIDLocation * location = GetGIDLocation(gid);
+    if ( location->tileset != NULL ) {
+        BatchTexture(renderer, location->texture, &location->src, dest);
+        __profile_counts.tiles++;
+    }
+}
+
+void FlushTileBatch(SDL_Renderer * renderer)
+{
+    for ( int i = 0; i < _num_batches; i++ ) {
+        Batch * batch = &_batches[i];
+        if ( batch->num_quads == 0 ) {
+            continue;
+        }
+
+        if ( ReserveIndices(batch->num_quads) ) {
+            SDL_RenderGeometry(renderer,
+                               batch->texture,
+                               batch->vertices,
+                               batch->num_quads * 4,
+                               _indices,
+                               batch->num_quads * 6);
+            __profile_counts.draw_calls++;
+        }
+
+        batch->num_quads = 0;
+    }
+
+    _num_batches = 0;
+}
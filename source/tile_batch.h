@@ -0,0 +1,34 @@
+//
+//  tile_batch.h
+//  te
+//
+//  Batches tile drawing into one SDL_RenderGeometry call per texture.
+//
+
+#ifndef tile_batch_h
+#define tile_batch_h
+
+#include "map.h"
+
+#include <SDL3/SDL.h>
+
+/// Queue the `src` rect of `texture`, or all of it if NULL, to be drawn at
+/// `dest`. Nothing is drawn until `FlushTileBatch`.
+void BatchTexture(SDL_Renderer * renderer,
+                  SDL_Texture * texture,
+                  const SDL_FRect * src,
+                  const SDL_FRect * dest);
+
+/// Queue a tile to be drawn at `dest`, like `RenderTile`. Empty tiles are
+/// skipped.
+void BatchTile(SDL_Renderer * renderer, GID gid, const SDL_FRect * dest);
+
+///
+/// Draw everything queued, one call per texture in the order each texture
+/// was first queued. Tiles queued for different textures can be drawn out of
+/// order, so flush between things that overlap, like layers, and before
+/// drawing anything else or changing the render target.
+///
+void FlushTileBatch(SDL_Renderer * renderer);
+
+#endif /* tile_batch_h */
@@ -0,0 +1,190 @@
+//
+//  trace.c
+//  te
+//
+//  Events go into blocks from a pool allocated up front. Each thread fills a
+//  block of its own, so recording an event takes no lock, and takes a new
+//  block from the pool with an atomic add when its block fills. Once the pool
+//  runs out, further spans are dropped whole.
+//
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#define BLOCK_EVENTS 4096
+#define MAX_BLOCKS 512 // About 50 MB.
+
+typedef struct {
+    const char * name;
+    Uint64 time; // Nanoseconds.
+    char phase; // 'B' or 'E'.
+} TraceEvent;
+
+typedef struct {
+    SDL_ThreadID thread_id;
+    SDL_AtomicInt count; // Set after the event is written.
+    TraceEvent events[BLOCK_EVENTS];
+} TraceBlock;
+
+bool __tracing;
+
+static FILE * _file;
+static Uint64 _start;
+static SDL_ThreadID _main_thread;
+static bool _started;
+
+static TraceBlock * _blocks;
+static SDL_AtomicInt _num_blocks; // Taken, which may overshoot MAX_BLOCKS.
+
+// This thread's block, and the events it has to keep room for.
+static THREAD_LOCAL TraceBlock * _block;
+static THREAD_LOCAL int _ends_owed; // Spans begun and not yet ended.
+static THREAD_LOCAL int _ends_dropped; // Spans begun while out of room.
+
+bool StartTrace(const char * path)
+{
+    if ( _started ) {
+        fprintf(stderr, "%s: only one trace per run\n", __func__);
+        return false;
+    }
+
+    _file = fopen(path, "w");
+    if ( _file == NULL ) {
+        fprintf(stderr, "%s: could not open '%s': %s\n",
+                __func__, path, strerror(errno));
+        return false;
+    }
+
+    _blocks = SDL_malloc(MAX_BLOCKS * sizeof(*_blocks));
+    if ( _blocks == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        fclose(_file);
+        _file = NULL;
+        return false;
+    }
+
+    SDL_SetAtomicInt(&_num_blocks, 0);
+    _start = SDL_GetTicksNS();
+    _main_thread = SDL_GetCurrentThreadID();
+    _started = true;
+    __tracing = true;
+
+    return true;
+}
+
+static bool NextBlock(void)
+{
+    int index = SDL_AddAtomicInt(&_num_blocks, 1);
+    if ( index >= MAX_BLOCKS ) {
+        return false;
+    }
+
+    _block = &_blocks[index];
+    _block->thread_id = SDL_GetCurrentThreadID();
+    SDL_SetAtomicInt(&_block->count, 0);
+
+    return true;
+}
+
+static void AddEvent(const char * name, char phase)
+{
+    int count = SDL_GetAtomicInt(&_block->count);
+    _block->events[count] = (TraceEvent){ name, SDL_GetTicksNS(), phase };
+    SDL_SetAtomicInt(&_block->count, count + 1);
+}
+
+void _TraceEvent(const char * name, char phase)
+{
+    if ( phase == 'E' ) {
+        if ( _ends_dropped > 0 ) {
+            _ends_dropped--; // Its begin wasn't recorded either.
+        } else if ( _ends_owed > 0 ) {
+            _ends_owed--;
+            AddEvent(name, phase); // There's always room: see below.
+        }
+        return;
+    }
+
+    // Only begin a span if there'll be room to end it, and those already
+    // begun. A new block has room for any reasonable depth.
+    if ( _ends_dropped > 0 ) {
+        _ends_dropped++;
+        return;
+    }
+
+    int room = 0;
+    if ( _block != NULL ) {
+        room = BLOCK_EVENTS - SDL_GetAtomicInt(&_block->count);
+    }
+
+    if ( room < _ends_owed + 2 && !NextBlock() ) {
+        _ends_dropped++;
+        return;
+    }
+
+    _ends_owed++;
+    AddEvent(name, phase);
+}
+
+void StopTrace(void)
+{
+    if ( !__tracing ) {
+        return;
+    }
+
+    __tracing = false;
+
+    fprintf(_file, "{\"traceEvents\":[\n");
+    fprintf(_file,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%llu,"
+            "\"args\":{\"name\":\"main\"}}",
+            (unsigned long long)_main_thread);
+
+    int num_blocks = SDL_min(SDL_GetAtomicInt(&_num_blocks), MAX_BLOCKS);
+    size_t num_events = 0;
+
+    for ( int b = 0; b < num_blocks; b++ ) {
+        TraceBlock * block = &_blocks[b];
+        int count = SDL_GetAtomicInt(&block->count);
+
+        for ( int i = 0; i < count; i++ ) {
+            const TraceEvent * event = &block->events[i];
+            fprintf(_file,
+                    ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":1,\"tid\":%llu}",
+                    event->name,
+                    event->phase,
+                    (double)(event->time - _start) / 1000.0,
+                    (unsigned long long)block->thread_id);
+        }
+
+        num_events += (size_t)count;
+    }
+
+    fprintf(_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if ( fclose(_file) != 0 ) {
+        fprintf(stderr, "%s: could not write trace: %s\n",
+                __func__, strerror(errno));
+    } else {
+        printf("Wrote %zu trace events\n", num_events);
+    }
+
+    if ( SDL_GetAtomicInt(&_num_blocks) > MAX_BLOCKS ) {
+        fprintf(stderr, "%s: ran out of room; later events were dropped\n",
+                __func__);
+    }
+
+    _file = NULL;
+    SDL_free(_blocks);
+    _blocks = NULL;
+}
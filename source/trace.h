@@ -0,0 +1,41 @@
+//
+//  trace.h
+//  te
+//
+//  Records begin and end events, on any thread, to be written out in Chrome's
+//  trace event format for Perfetto or chrome://tracing.
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include <SDL3/SDL.h>
+
+extern bool __tracing;
+
+/// Start recording events, to be written to `path` by `StopTrace`.
+bool StartTrace(const char * path);
+
+/// Write the events recorded to the trace file and stop recording. Call once
+/// threads that record events are done with them.
+void StopTrace(void);
+
+void _TraceEvent(const char * name, char phase);
+
+/// Begin a span on this thread. `name` must be a string literal, or live as
+/// long as the trace. Spans on a thread nest; end each with `TraceEnd`.
+static inline void TraceBegin(const char * name)
+{
+    if ( __tracing ) {
+        _TraceEvent(name, 'B');
+    }
+}
+
+static inline void TraceEnd(const char * name)
+{
+    if ( __tracing ) {
+        _TraceEvent(name, 'E');
+    }
+}
+
+#endif /* trace_h */
@@ -6,43 +6,59 @@
 //
 
 #include "editor.h"
+#include "trace.h"
 #include <stdio.h>
 #include <limits.h>
 
 static Change current_change; // Current in-progress action
 static bool recording = false;
-
-bool RecordingChange(void)
+static size_t undo_budget = DEFAULT_UNDO_BUDGET;
+static Map * change_map; // The map being changed.
+
+// Where each tile in the current change is in its list, plus one, so a tile
+// changed again is found at once. Open addressing; 0 is an empty slot.
+static int * change_index;
+static int index_size; // Slots, a power of two. At most half are used.
+
+// The current change's tiles on one layer, kept as a region as they're
+// recorded rather than in the list, which is how a fill's runs are kept.
+// Tiles on other layers still go in the list. `tiles` is NULL if there's
+// no region yet.
+static RegionChange change_region;
+
+// The rectangle around the tiles in the list, and whether they're all on
+// one layer, so it can be turned into a region.
+static int list_layer;
+static bool list_one_layer;
+static int list_min_x;
+static int list_min_y;
+static int list_max_x;
+static int list_max_y;
+
+// Each time the list is about to grow past this many tiles, it's checked for
+// whether it'd be smaller as a region, so a big dense change isn't built up
+// as a list first.
+#define REGION_CHECK_TILES 4096
+
+// Set if a tile couldn't be recorded, so the change can't be undone.
+static bool change_failed;
+
+static void FreeIndex(void)
 {
-    return recording;
+    SDL_free(change_index);
+    change_index = NULL;
+    index_size = 0;
 }
 
-static Change CopyChange(Change * change)
+static void FreeRegion(void)
 {
-    Change copy = *change;
-
-    switch ( change->type ) {
-        case CHANGE_SET_TILES: {
-            TileChanges * src = &change->tile_changes;
-            TileChanges * dst = &copy.tile_changes;
-
-            size_t size = (size_t)src->count * sizeof(*src->list);
-            dst->list = SDL_malloc(size);
-            memcpy(dst->list, src->list, size);
-            break;
-        }
-        case CHANGE_MAP_SIZE: {
-            MapSizeChange * src = &change->map_size_changes;
-            MapSizeChange * dst = &copy.map_size_changes;
-
-            size_t size = (size_t)src->num_tiles * sizeof(*src->tiles);
-            dst->tiles = SDL_malloc(size);
-            memcpy(dst->tiles, src->tiles, size);
-            break;
-        }
-    }
+    SDL_free(change_region.tiles);
+    change_region = (RegionChange){ 0 };
+}
 
-    return copy;
+bool RecordingChange(void)
+{
+    return recording;
 }
 
 static void FreeChange(Change * change)
@@ -59,39 +75,150 @@ static void FreeChange(Change * change)
             change->map_size_changes.tiles = NULL;
             change->map_size_changes.num_tiles = 0;
             break;
+        case CHANGE_SET_REGION:
+            SDL_free(change->region_change.tiles);
+            change->region_change.tiles = NULL;
+            break;
     }
 }
 
-void FreeChangeStack(ChangeStack * stack)
+/// Bytes a change takes up in a stack.
+static size_t ChangeSize(const Change * change)
+{
+    size_t size = sizeof(*change);
+
+    switch ( change->type ) {
+        case CHANGE_SET_TILES:
+            size += (size_t)change->tile_changes.allocated * sizeof(TileChange);
+            break;
+        case CHANGE_MAP_SIZE:
+            size += (size_t)change->map_size_changes.num_tiles * sizeof(Tile);
+            break;
+        case CHANGE_SET_REGION: {
+            const RegionChange * c = &change->region_change;
+            size += (size_t)c->w * (size_t)c->h * 2 * sizeof(GID);
+            break;
+        }
+    }
+
+    return size;
+}
+
+/// The `i`th change in the stack, counting up from the oldest.
+static Change * StackChange(const ChangeStack * stack, int i)
+{
+    return &stack->changes[(stack->first + i) % stack->capacity];
+}
+
+/// Free the stack's changes, keeping its buffer for the next ones.
+static void ClearChangeStack(ChangeStack * stack)
 {
     for ( int i = 0; i < stack->count; i++ ) {
-        FreeChange(&stack->changes[i]);
+        FreeChange(StackChange(stack, i));
     }
+
+    stack->first = 0;
     stack->count = 0;
+    stack->bytes = 0;
+}
+
+void FreeChangeStack(ChangeStack * stack)
+{
+    ClearChangeStack(stack);
+    SDL_free(stack->changes);
+    *stack = (ChangeStack){ 0 };
+}
+
+static bool GrowStack(ChangeStack * stack)
+{
+    int new_capacity = stack->capacity ? stack->capacity * 2 : 16;
+    Change * new_changes = SDL_malloc((size_t)new_capacity * sizeof(Change));
+    if ( new_changes == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    for ( int i = 0; i < stack->count; i++ ) {
+        new_changes[i] = *StackChange(stack, i);
+    }
+
+    SDL_free(stack->changes);
+    stack->changes = new_changes;
+    stack->capacity = new_capacity;
+    stack->first = 0;
+
+    return true;
 }
 
+/// Move `change` onto the stack, which takes over its buffers, and leave it
+/// empty.
 static void PushChange(ChangeStack * stack, Change * change)
 {
-    stack->changes[stack->count++] = CopyChange(change);
+    if ( stack->count == stack->capacity && !GrowStack(stack) ) {
+        FreeChange(change); // The change is lost.
+    } else {
+        Change * top = StackChange(stack, stack->count++);
+        *top = *change;
+        stack->bytes += ChangeSize(top);
+    }
+
+    *change = (Change){ 0 };
 }
 
+/// Move the newest change off the stack. The caller takes over its buffers.
 static Change PopChange(ChangeStack * stack)
 {
-    Change * top = &stack->changes[stack->count - 1];
-    Change change = CopyChange(top);
-    FreeChange(top);
+    Change * top = StackChange(stack, stack->count - 1);
+    stack->bytes -= ChangeSize(top);
+    stack->count--;
+
+    return *top;
+}
+
+static void DropOldestChange(ChangeStack * stack)
+{
+    Change * oldest = StackChange(stack, 0);
+    stack->bytes -= ChangeSize(oldest);
+    FreeChange(oldest);
+    stack->first = (stack->first + 1) % stack->capacity;
     stack->count--;
+}
+
+/// Drop the oldest changes until the map's history is within budget, keeping
+/// the newest. Only a new change adds to the history: undo and redo just
+/// move changes between the stacks.
+static void TrimHistory(EditorMap * map)
+{
+    if ( undo_budget == 0 ) {
+        return;
+    }
 
-    return change;
+    while ( map->undo.count > 1 && UndoMemoryUsed(map) > undo_budget ) {
+        DropOldestChange(&map->undo);
+    }
+}
+
+void SetUndoMemoryBudget(size_t bytes)
+{
+    undo_budget = bytes;
+}
+
+size_t UndoMemoryUsed(const EditorMap * map)
+{
+    return map->undo.bytes + map->redo.bytes;
 }
 
 void BeginChange(EditorMap * map, ChangeType type)
 {
     recording = true;
     current_change.type = type;
+    change_map = &map->map;
+    FreeIndex();
+    FreeRegion();
+    change_failed = false;
 
     // The redo stack gets cleared when making a new change.
-    FreeChangeStack(&map->redo);
+    ClearChangeStack(&map->redo);
 
     switch ( type ) {
         case CHANGE_SET_TILES: {
@@ -104,6 +231,9 @@ void BeginChange(EditorMap * map, ChangeType type)
             changes->count = 0;
             changes->allocated = 16;
             changes->list = SDL_malloc((size_t)changes->allocated * sizeof(TileChange));
+            if ( changes->list == NULL ) {
+                changes->allocated = 0; // Try again on the first tile.
+            }
             break;
         }
 
@@ -120,30 +250,119 @@ static bool ValidateChange(ChangeType type)
     return recording && current_change.type == type;
 }
 
-void AddTileChange(int x, int y, int layer, GID old, GID new)
+static Uint32 HashTile(int x, int y, int layer)
 {
-    if ( !ValidateChange(CHANGE_SET_TILES) ) return; // TODO: error?
-    if ( old == new ) return;
-
-    // Check for duplicate tile in this action
-    for ( int i = 0; i < current_change.tile_changes.count; i++ ) {
-        TileChange * c = &current_change.tile_changes.list[i];
-        if ( c->x == x && c->y == y ) {
-            // Update the new value only; keep original old_tile
-            c->new = new;
-            return;
+    Uint32 h = (Uint32)x * 0x9E3779B1u
+             ^ (Uint32)y * 0x85EBCA77u
+             ^ (Uint32)layer * 0xC2B2AE3Du;
+    return h ^ (h >> 15);
+}
+
+/// The index slot for the tile: its own if it's in the change, otherwise
+/// the empty one where it goes.
+static int * FindIndexSlot(int x, int y, int layer)
+{
+    const TileChange * list = current_change.tile_changes.list;
+    Uint32 mask = (Uint32)index_size - 1;
+
+    for ( Uint32 i = HashTile(x, y, layer) & mask; ; i = (i + 1) & mask ) {
+        int * slot = &change_index[i];
+        if ( *slot == 0 ) {
+            return slot;
+        }
+
+        const TileChange * c = &list[*slot - 1];
+        if ( c->x == x && c->y == y && c->layer == layer ) {
+            return slot;
         }
     }
+}
+
+static bool GrowIndex(void)
+{
+    int new_size = index_size ? index_size * 2 : 256;
+    int * new_index = SDL_calloc((size_t)new_size, sizeof(*new_index));
+    if ( new_index == NULL ) {
+        fprintf(stderr, "%s: calloc failed\n", __func__);
+        return false;
+    }
+
+    SDL_free(change_index);
+    change_index = new_index;
+    index_size = new_size;
+
+    TileChanges * changes = &current_change.tile_changes;
+    for ( int i = 0; i < changes->count; i++ ) {
+        TileChange * c = &changes->list[i];
+        *FindIndexSlot(c->x, c->y, c->layer) = i + 1;
+    }
 
-    // Add new change
+    return true;
+}
 
+/// Make room in the change's list for `count` more tiles.
+static bool ReserveTileChanges(int count)
+{
     TileChanges * changes = &current_change.tile_changes;
+    if ( changes->count + count <= changes->allocated ) {
+        return true;
+    }
+
+    int new_allocated = SDL_max(changes->allocated, 16);
+    while ( changes->count + count > new_allocated ) {
+        new_allocated *= 2;
+    }
 
-    // Increase list size as needed.
-    if ( changes->count >= changes->allocated ) {
-        changes->allocated *= 2;
-        size_t size = (size_t)changes->allocated * sizeof(TileChange);
-        changes->list = SDL_realloc(changes->list, size);
+    size_t size = (size_t)new_allocated * sizeof(TileChange);
+    TileChange * new_list = SDL_realloc(changes->list, size);
+    if ( new_list == NULL ) {
+        fprintf(stderr, "%s: realloc failed\n", __func__);
+        return false;
+    }
+
+    changes->list = new_list;
+    changes->allocated = new_allocated;
+    return true;
+}
+
+static void RecordTileChange(int x, int y, int layer, GID old, GID new)
+{
+    TileChanges * changes = &current_change.tile_changes;
+    if ( change_failed ) {
+        return;
+    }
+
+    // Without the index, finding a tile changed again would mean searching
+    // the list, which for a big change is too slow to be worth it.
+    if ( (changes->count + 1) * 2 > index_size && !GrowIndex() ) {
+        change_failed = true;
+        return;
+    }
+
+    int * slot = FindIndexSlot(x, y, layer);
+    if ( *slot != 0 ) {
+        TileChange * c = &changes->list[*slot - 1];
+        // Update the new value only; keep original old_tile
+        c->new = new;
+        return;
+    }
+
+    if ( !ReserveTileChanges(1) ) {
+        change_failed = true;
+        return;
+    }
+
+    if ( changes->count == 0 ) {
+        list_layer = layer;
+        list_one_layer = true;
+        list_min_x = list_max_x = x;
+        list_min_y = list_max_y = y;
+    } else {
+        list_one_layer = list_one_layer && layer == list_layer;
+        list_min_x = SDL_min(list_min_x, x);
+        list_min_y = SDL_min(list_min_y, y);
+        list_max_x = SDL_max(list_max_x, x);
+        list_max_y = SDL_max(list_max_y, y);
     }
 
     TileChange * c = &changes->list[changes->count++];
@@ -152,6 +371,251 @@ void AddTileChange(int x, int y, int layer, GID old, GID new)
     c->layer = layer;
     c->old = old;
     c->new = new;
+    *slot = changes->count;
+}
+
+/// Whether tiles in a region of `area` take less memory than `count` of
+/// them in a list.
+static bool RegionIsSmaller(size_t area, size_t count)
+{
+    return area * 2 * sizeof(GID) < count * sizeof(TileChange);
+}
+
+/// Grow the change's region to take in the `w` x `h` tiles at (x, y), which
+/// must be on the map. Tiles that haven't been recorded are as they are now.
+static bool GrowRegion(int x, int y, int w, int h)
+{
+    RegionChange * r = &change_region;
+    int x1 = x + w;
+    int y1 = y + h;
+
+    if ( r->tiles != NULL ) {
+        int r_x1 = r->x + r->w;
+        int r_y1 = r->y + r->h;
+        if ( x >= r->x && y >= r->y && x1 <= r_x1 && y1 <= r_y1 ) {
+            return true;
+        }
+
+        // Grow by at least the region's size on any side it grows, so one
+        // grown a run at a time is only copied a few times.
+        x = x < r->x ? SDL_max(SDL_min(x, r->x - r->w), 0) : r->x;
+        y = y < r->y ? SDL_max(SDL_min(y, r->y - r->h), 0) : r->y;
+        x1 = x1 > r_x1 ? SDL_min(SDL_max(x1, r_x1 + r->w), change_map->width) : r_x1;
+        y1 = y1 > r_y1 ? SDL_min(SDL_max(y1, r_y1 + r->h), change_map->height) : r_y1;
+        w = x1 - x;
+        h = y1 - y;
+    }
+
+    size_t area = (size_t)w * (size_t)h;
+    GID * tiles = SDL_malloc(area * 2 * sizeof(GID));
+    if ( tiles == NULL ) {
+        fprintf(stderr, "%s: malloc failed\n", __func__);
+        return false;
+    }
+
+    // Tiles that weren't in the region are read from the map, as they were
+    // and are now the same.
+    GID * old = tiles;
+    GID * new = tiles + area;
+    size_t r_area = (size_t)r->w * (size_t)r->h;
+    for ( int row = 0; row < h; row++ ) {
+        size_t at = (size_t)row * (size_t)w;
+        int r_row = y + row - r->y;
+
+        if ( r->tiles == NULL || r_row < 0 || r_row >= r->h ) {
+            GetMapRow(change_map, x, y + row, r->layer, new + at, w);
+            memcpy(old + at, new + at, (size_t)w * sizeof(GID));
+            continue;
+        }
+
+        int left = r->x - x;
+        int right = w - left - r->w;
+        size_t from = (size_t)r_row * (size_t)r->w;
+        size_t r_at = at + (size_t)left;
+        size_t right_at = r_at + (size_t)r->w;
+
+        if ( left > 0 ) {
+            GetMapRow(change_map, x, y + row, r->layer, new + at, left);
+            memcpy(old + at, new + at, (size_t)left * sizeof(GID));
+        }
+
+        if ( right > 0 ) {
+            GetMapRow(change_map, r->x + r->w, y + row, r->layer, new + right_at, right);
+            memcpy(old + right_at, new + right_at, (size_t)right * sizeof(GID));
+        }
+
+        memcpy(old + r_at, r->tiles + from, (size_t)r->w * sizeof(GID));
+        memcpy(new + r_at, r->tiles + r_area + from, (size_t)r->w * sizeof(GID));
+    }
+
+    SDL_free(r->tiles);
+
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = h;
+    r->tiles = tiles;
+
+    return true;
+}
+
+static void RecordRegionRun(int x, int y, int count, GID old, GID new)
+{
+    RegionChange * r = &change_region;
+    if ( change_failed ) {
+        return;
+    }
+
+    // Tiles already in the region were as they are there until now, whether
+    // they were recorded or not: keep those. The rest were `old`.
+    int in_x = x;
+    int in_x1 = x;
+    if ( r->tiles != NULL && y >= r->y && y < r->y + r->h ) {
+        in_x = SDL_max(x, r->x);
+        in_x1 = SDL_max(SDL_min(x + count, r->x + r->w), in_x);
+    }
+
+    if ( !GrowRegion(x, y, count, 1) ) {
+        change_failed = true;
+        return;
+    }
+
+    size_t area = (size_t)r->w * (size_t)r->h;
+    size_t at = (size_t)(y - r->y) * (size_t)r->w + (size_t)(x - r->x);
+    GID * old_tiles = r->tiles + at;
+    GID * new_tiles = r->tiles + area + at;
+
+    for ( int i = 0; i < count; i++ ) {
+        if ( x + i < in_x || x + i >= in_x1 ) {
+            old_tiles[i] = old;
+        }
+        new_tiles[i] = new;
+    }
+}
+
+/// Move the tiles in the change's list, which are all on one layer, into its
+/// region, which there isn't yet. The run of `count` tiles at (x, y), changed
+/// from `old`, is about to be added, and the map may have it already, so the
+/// region takes it in as it was. If there isn't memory, the list is kept.
+static bool MoveListToRegion(int x, int y, int count, GID old)
+{
+    TileChanges * changes = &current_change.tile_changes;
+    RegionChange * r = &change_region;
+
+    int x0 = list_min_x;
+    int y0 = list_min_y;
+    int x1 = list_max_x + 1;
+    int y1 = list_max_y + 1;
+    if ( count > 0 ) {
+        x0 = SDL_min(x0, x);
+        y0 = SDL_min(y0, y);
+        x1 = SDL_max(x1, x + count);
+        y1 = SDL_max(y1, y + 1);
+    }
+
+    r->layer = list_layer;
+    if ( !GrowRegion(x0, y0, x1 - x0, y1 - y0) ) {
+        return false;
+    }
+
+    size_t area = (size_t)r->w * (size_t)r->h;
+    if ( count > 0 ) {
+        size_t at = (size_t)(y - r->y) * (size_t)r->w + (size_t)(x - r->x);
+        for ( int i = 0; i < count; i++ ) {
+            r->tiles[at + (size_t)i] = old;
+        }
+    }
+
+    // Then the tiles changed before it, from what they first were.
+    for ( int i = 0; i < changes->count; i++ ) {
+        const TileChange * c = &changes->list[i];
+        size_t at = (size_t)(c->y - r->y) * (size_t)r->w + (size_t)(c->x - r->x);
+        r->tiles[at] = c->old;
+        r->tiles[area + at] = c->new;
+    }
+
+    changes->count = 0;
+    FreeIndex();
+
+    return true;
+}
+
+/// Whether the run of `count` tiles is on the map. Ones that aren't can't
+/// have been changed.
+static bool IsValidRun(int x, int y, int layer, int count)
+{
+    return x >= 0 && y >= 0 && layer >= 0
+        && x + count <= change_map->width
+        && y < change_map->height
+        && layer < change_map->num_layers;
+}
+
+/// Whether the change's list, with the tile at (x, y) added to it, should
+/// be moved into a region now.
+static bool ShouldMoveListToRegion(int x, int y, int layer)
+{
+    const TileChanges * changes = &current_change.tile_changes;
+    if ( change_region.tiles != NULL
+        || changes->count < REGION_CHECK_TILES
+        || changes->count < changes->allocated
+        || !list_one_layer
+        || layer != list_layer ) {
+        return false;
+    }
+
+    size_t w = (size_t)(SDL_max(list_max_x, x) - SDL_min(list_min_x, x) + 1);
+    size_t h = (size_t)(SDL_max(list_max_y, y) - SDL_min(list_min_y, y) + 1);
+
+    return RegionIsSmaller(w * h, (size_t)changes->count + 1);
+}
+
+void AddTileChange(int x, int y, int layer, GID old, GID new)
+{
+    if ( !ValidateChange(CHANGE_SET_TILES) ) return; // TODO: error?
+    if ( old == new || !IsValidRun(x, y, layer, 1) ) return;
+
+    if ( ShouldMoveListToRegion(x, y, layer) ) {
+        MoveListToRegion(x, y, 1, old); // Or if it can't, keep the list.
+    }
+
+    if ( change_region.tiles != NULL && layer == change_region.layer ) {
+        RecordRegionRun(x, y, 1, old, new);
+    } else {
+        RecordTileChange(x, y, layer, old, new);
+    }
+}
+
+void AddTileRunChange(int x, int y, int layer, int count, GID old, GID new)
+{
+    if ( !ValidateChange(CHANGE_SET_TILES) ) return;
+    if ( old == new || count <= 0 || !IsValidRun(x, y, layer, count) ) return;
+
+    // Runs go straight into the region, so a fill isn't recorded a tile at
+    // a time.
+    TileChanges * changes = &current_change.tile_changes;
+    if ( change_region.tiles == NULL ) {
+        if ( changes->count == 0 ) {
+            change_region.layer = layer;
+        } else if ( list_one_layer && list_layer == layer ) {
+            MoveListToRegion(x, y, count, old);
+        }
+    }
+
+    if ( layer == change_region.layer
+        && (change_region.tiles != NULL || changes->count == 0) ) {
+        RecordRegionRun(x, y, count, old, new);
+        return;
+    }
+
+    // It's on another layer than the region.
+    if ( !ReserveTileChanges(count) ) {
+        change_failed = true;
+        return;
+    }
+
+    for ( int i = 0; i < count; i++ ) {
+        RecordTileChange(x + i, y, layer, old, new);
+    }
 }
 
 void RegisterMapSizeChange(EditorMap * map, int dx, int dy)
@@ -212,18 +676,132 @@ void RegisterMapSizeChange(EditorMap * map, int dx, int dy)
     EndChange(map);
 }
 
+/// Free the unused end of the change's list, which can be nearly half of it,
+/// before it goes into the history.
+static void ShrinkTileChanges(void)
+{
+    TileChanges * changes = &current_change.tile_changes;
+    if ( changes->count == changes->allocated ) {
+        return;
+    }
+
+    size_t size = (size_t)changes->count * sizeof(TileChange);
+    TileChange * new_list = SDL_realloc(changes->list, size);
+    if ( new_list != NULL ) { // Otherwise, it's kept as it is.
+        changes->list = new_list;
+        changes->allocated = changes->count;
+    }
+}
+
+/// Add the changed tiles in the change's region to its list.
+static bool MoveRegionToList(size_t changed)
+{
+    TileChanges * changes = &current_change.tile_changes;
+    const RegionChange * r = &change_region;
+
+    if ( changed > (size_t)(INT_MAX - changes->count)
+        || !ReserveTileChanges((int)changed) ) {
+        return false;
+    }
+
+    const GID * old = r->tiles;
+    const GID * new = r->tiles + (size_t)r->w * (size_t)r->h;
+    for ( int y = 0; y < r->h; y++ ) {
+        for ( int x = 0; x < r->w; x++, old++, new++ ) {
+            if ( *old != *new ) {
+                changes->list[changes->count++] = (TileChange){
+                    .x = r->x + x,
+                    .y = r->y + y,
+                    .layer = r->layer,
+                    .old = *old,
+                    .new = *new,
+                };
+            }
+        }
+    }
+
+    FreeRegion();
+    return true;
+}
+
+/// Keep the current change's tiles in whichever of a list or a region takes
+/// less memory. A change with a region and tiles on other layers is kept as
+/// a list of them all.
+static void FinishTileChanges(void)
+{
+    TileChanges * changes = &current_change.tile_changes;
+
+    if ( change_region.tiles == NULL
+        && changes->count > 0
+        && list_one_layer ) {
+        size_t w = (size_t)(list_max_x - list_min_x + 1);
+        size_t h = (size_t)(list_max_y - list_min_y + 1);
+        if ( RegionIsSmaller(w * h, (size_t)changes->count) ) {
+            MoveListToRegion(0, 0, 0, 0);
+        }
+    }
+
+    if ( change_region.tiles != NULL ) {
+        const RegionChange * r = &change_region;
+        size_t area = (size_t)r->w * (size_t)r->h;
+        size_t changed = 0;
+        for ( size_t i = 0; i < area; i++ ) {
+            changed += r->tiles[i] != r->tiles[area + i];
+        }
+
+        if ( changes->count > 0 && !MoveRegionToList(changed) ) {
+            change_failed = true;
+            return;
+        }
+
+        if ( change_region.tiles != NULL && !RegionIsSmaller(area, changed) ) {
+            MoveRegionToList(changed); // Or if it can't, keep the region.
+        }
+    }
+
+    if ( change_region.tiles != NULL ) {
+        SDL_free(changes->list);
+        current_change.type = CHANGE_SET_REGION;
+        current_change.region_change = change_region;
+        change_region = (RegionChange){ 0 };
+    } else if ( changes->count > 0 ) {
+        ShrinkTileChanges();
+    }
+}
+
 void EndChange(EditorMap * map)
 {
     if ( !recording ) return;
     recording = false;
+    FreeIndex();
+
+    if ( current_change.type == CHANGE_SET_TILES && !change_failed ) {
+        FinishTileChanges();
+    }
+
+    if ( change_failed ) {
+        // The map was edited in ways the history doesn't know about, so
+        // none of it can be undone safely.
+        fprintf(stderr, "%s: out of memory recording a change, "
+                "clearing undo history\n", __func__);
+        FreeChange(&current_change);
+        FreeRegion();
+        current_change = (Change){ 0 };
+        ClearChangeStack(&map->undo);
+        ClearChangeStack(&map->redo);
+        return;
+    }
 
     switch ( current_change.type ) {
         case CHANGE_SET_TILES:
             if ( current_change.tile_changes.count == 0 ) {
                 printf("  no changes\n");
+                // Leave nothing behind for a map size change to mistake
+                // for its tiles.
+                FreeChange(&current_change);
+                current_change = (Change){ 0 };
                 return; // No changes
             }
-
             break;
         case CHANGE_MAP_SIZE:
             break;
@@ -231,12 +809,23 @@ void EndChange(EditorMap * map)
             break;
     }
 
-    // Push to undo stack
-    if ( map->undo.count < MAX_HISTORY ) {
-        PushChange(&map->undo, &current_change);
-    }
+    // Push to undo stack. This leaves nothing behind for BeginChange to
+    // mistake for a tile list.
+    PushChange(&map->undo, &current_change);
+    TrimHistory(map);
+}
+
+/// Set the region's tiles back to how they were, or forward to how they are
+/// after the change, a row at a time.
+static void ApplyRegion(const RegionChange * c, Map * m, bool forward)
+{
+    size_t area = (size_t)c->w * (size_t)c->h;
+    const GID * tiles = forward ? c->tiles + area : c->tiles;
 
-    FreeChange(&current_change);
+    for ( int row = 0; row < c->h; row++ ) {
+        SetMapRow(m, c->x, c->y + row, c->layer,
+                  tiles + (size_t)row * (size_t)c->w, c->w);
+    }
 }
 
 static void RestoreTiles(MapSizeChange * c, Map * m)
@@ -247,13 +836,14 @@ static void RestoreTiles(MapSizeChange * c, Map * m)
     }
 }
 
-// TODO: use set tile
 void Undo(EditorMap * map)
 {
     Map * m = &map->map;
 
     if ( map->undo.count == 0 ) return;
 
+    TraceBegin("undo");
+
     // Pop action off undo stack
     Change a = PopChange(&map->undo);
 
@@ -262,10 +852,14 @@ void Undo(EditorMap * map)
         case CHANGE_SET_TILES:
             for ( int i = 0; i < a.tile_changes.count; i++ ) {
                 TileChange * c = &a.tile_changes.list[i];
-                m->tiles[c->layer][c->y * m->width + c->x] = c->old;
+                SetMapTile(m, c->x, c->y, c->layer, c->old);
             }
             break;
 
+        case CHANGE_SET_REGION:
+            ApplyRegion(&a.region_change, m, false);
+            break;
+
         case CHANGE_MAP_SIZE: {
             MapSizeChange * c = &a.map_size_changes;
 
@@ -284,10 +878,9 @@ void Undo(EditorMap * map)
             break;
     }
 
-    if ( map->redo.count < MAX_HISTORY ) {
-        PushChange(&map->redo, &a);
-        FreeChange(&a);
-    }
+    PushChange(&map->redo, &a);
+
+    TraceEnd("undo");
 }
 
 void Redo(EditorMap * map)
@@ -296,6 +889,8 @@ void Redo(EditorMap * map)
 
     if ( map->redo.count == 0 ) return;
 
+    TraceBegin("redo");
+
     // Pop action off redo stack
     Change a = PopChange(&map->redo);
 
@@ -303,10 +898,14 @@ void Redo(EditorMap * map)
         case CHANGE_SET_TILES:
             for ( int i = 0; i < a.tile_changes.count; i++ ) {
                 TileChange * c = &a.tile_changes.list[i];
-                m->tiles[c->layer][c->y * m->width + c->x] = c->new;
+                SetMapTile(m, c->x, c->y, c->layer, c->new);
             }
             break;
 
+        case CHANGE_SET_REGION:
+            ApplyRegion(&a.region_change, m, true);
+            break;
+
         case CHANGE_MAP_SIZE: {
             MapSizeChange * c = &a.map_size_changes;
 
@@ -324,9 +923,7 @@ void Redo(EditorMap * map)
             break;
     }
 
-//    map->undo.changes[map->undo.count++] = a; // Push
-    if ( map->undo.count < MAX_HISTORY ) {
-        PushChange(&map->undo, &a);
-        FreeChange(&a);
-    }
+    PushChange(&map->undo, &a);
+
+    TraceEnd("redo");
 }
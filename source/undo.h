@@ -10,13 +10,14 @@
 
 #include "map.h"
 
-#define MAX_HISTORY 256
+#define DEFAULT_UNDO_BUDGET (64 << 20) // Bytes of history kept per map.
 
 typedef struct editor_map EditorMap;
 
 typedef enum {
     CHANGE_SET_TILES, // Paint, fill, paste tiles, etc
     CHANGE_MAP_SIZE,
+    CHANGE_SET_REGION, // A CHANGE_SET_TILES stored as a RegionChange.
 } ChangeType;
 
 typedef struct {
@@ -41,6 +42,18 @@ typedef struct {
     int num_tiles;
 } MapSizeChange;
 
+// Dense tile changes on one layer are kept as the rectangle around them,
+// before and after, which takes less memory than a TileChange per tile.
+// Tiles in it that weren't changed are the same in both.
+typedef struct {
+    int layer;
+    int x;
+    int y;
+    int w;
+    int h;
+    GID * tiles; // w * h tiles as they were, then w * h as they are, by row.
+} RegionChange;
+
 typedef struct {
     TileChange * list;
     int allocated; // Slots allocated.
@@ -52,12 +65,18 @@ typedef struct {
     union {
         TileChanges tile_changes;
         MapSizeChange map_size_changes;
+        RegionChange region_change;
     };
 } Change;
 
+// Changes, oldest first, in a ring buffer so the oldest can be dropped
+// when the history is over budget.
 typedef struct {
-    Change changes[MAX_HISTORY];
+    Change * changes; // `capacity` slots, the oldest change at `first`.
+    int capacity;
+    int first;
     int count;
+    size_t bytes; // Held by the changes.
 } ChangeStack;
 
 void BeginChange(EditorMap * map, ChangeType type);
@@ -67,6 +86,9 @@ void FreeChangeStack(ChangeStack * stack);
 
 // These are called between a BeginChange and EndChange call:
 void AddTileChange(int x, int y, int layer, GID old, GID new);
+/// Add a run of `count` tiles rightward from (x, y), all changed from `old`
+/// to `new`.
+void AddTileRunChange(int x, int y, int layer, int count, GID old, GID new);
 
 // These are called on their own and are equivalent to Begin...Add...End:
 void RegisterMapSizeChange(EditorMap * map, int dx, int dy);
@@ -74,4 +96,12 @@ void RegisterMapSizeChange(EditorMap * map, int dx, int dy);
 void Undo(EditorMap * map);
 void Redo(EditorMap * map);
 
+/// Set how many bytes of undo history each map may keep, or 0 for no limit.
+/// The oldest changes are dropped to stay under it, but the last change made
+/// can always be undone.
+void SetUndoMemoryBudget(size_t bytes);
+
+/// Bytes held by the map's undo and redo history.
+size_t UndoMemoryUsed(const EditorMap * map);
+
 #endif /* undo_h */
@@ -10,6 +10,7 @@
 #include "view.h"
 #include "zoom.h"
 #include "misc.h"
+#include "profiler.h"
 
 static float _ants_phase;
 
@@ -27,7 +28,7 @@ static SDL_FRect GetTileUnionRect(const View * view,
 
 void UpdateAntsPhase(void)
 {
-    _ants_phase += 20.0f * __dt;
+    _ants_phase = (float)(SDL_GetTicks() / ANTS_STEP_MS);
 }
 
 SDL_FRect GetViewRect(const View * view, int x, int y, int w, int h)
@@ -138,18 +139,27 @@ void RenderGrid(const View * view,
 {
     SetColor(ContrastingColor(bg, contrast_factor));
 
+    // Only the lines in view.
+    SDL_FRect visible = GetVisibleRect(view);
+    int min_y = SDL_max((int)(visible.y / (float)y_step), 1) * y_step;
+    int min_x = SDL_max((int)(visible.x / (float)x_step), 1) * x_step;
+    int max_y = SDL_min((int)(visible.y + visible.h) + 1, view->content_h);
+    int max_x = SDL_min((int)(visible.x + visible.w) + 1, view->content_w);
+
     // Horizontal Lines
-    for ( int y = y_step; y < view->content_h; y += y_step ) {
+    for ( int y = min_y; y < max_y; y += y_step ) {
         SDL_FPoint p1 = ConvertToWindow(view, 0, y);
         SDL_FPoint p2 = ConvertToWindow(view, view->content_w, y);
         SDL_RenderLine(__renderer, p1.x, p1.y, p2.x, p2.y);
+        __profile_counts.draw_calls++;
     }
 
     // Vertical Lines
-    for ( int x = x_step; x < view->content_w; x += x_step ) {
+    for ( int x = min_x; x < max_x; x += x_step ) {
         SDL_FPoint p1 = ConvertToWindow(view, x, 0);
         SDL_FPoint p2 = ConvertToWindow(view, x, view->content_h);
         SDL_RenderLine(__renderer, p1.x, p1.y, p2.x, p2.y);
+        __profile_counts.draw_calls++;
     }
 }
 
@@ -221,12 +231,12 @@ void ScrollView(View * view, int dx, int dy)
         return;  // Don't respond to CTLR-S, etc.
     }
 
-    static float speed = 0.0f;
+    static float speed = 0.0f; // Content pixels per second.
 
     if ( dx || dy ) {
         float scale = GetScale(view->zoom_index);
-        speed += (900.0f / scale) * __dt;
-        float max = (600.0f / scale) * __dt;
+        speed += (54000.0f / scale) * __dt; // Full speed in a frame or two.
+        float max = 600.0f / scale;
         if ( speed > max )
             speed = max;
     } else {
@@ -234,8 +244,8 @@ void ScrollView(View * view, int dx, int dy)
         return;
     }
 
-    view->origin.x += speed * dx;
-    view->origin.y += speed * dy;
+    view->origin.x += speed * __dt * dx;
+    view->origin.y += speed * __dt * dy;
     ClampViewOrigin(view);
 }
 
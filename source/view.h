@@ -33,7 +33,9 @@ typedef struct view {
     bool has_selection;
 } View;
 
-void UpdateAntsPhase(void); // Selection box marching ants.
+#define ANTS_STEP_MS 50 // Time between marching ants steps of a pixel.
+
+void UpdateAntsPhase(void); // Selection box marching ants, by the clock.
 SDL_FRect GetVisibleRect(const View * v);
 bool GetMouseTile(const View * view, int * x, int * y, int tile_size);
 SDL_FRect GetTileRect(const View * view, int tile_x, int tile_y, int tile_size);
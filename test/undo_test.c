@@ -0,0 +1,403 @@
+//
+//  undo_test.c
+//  te
+//
+//  Regression tests for the undo history, including running out of memory
+//  while recording a change, and random changes undone and redone against
+//  copies of the map. Build it with sanitizers; it exits with a failure if
+//  any check fails.
+//
+//      cc -g -O1 -fsanitize=address,undefined test/undo_test.c source/map.c
+//          source/undo.c source/rle.c source/lz.c source/jobs.c source/crc.c
+//          source/trace.c -Isource -lSDL3 -o undo_test
+//      ./undo_test
+//
+//  Maps are written to undo_test.temap in the working directory.
+//
+
+#include "editor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAP_PATH "undo_test.temap"
+
+static EditorMap _map;
+static int _failures;
+static Uint32 _seed = 1;
+
+// SDL's allocator, and switches to make it fail.
+static SDL_malloc_func _malloc;
+static SDL_calloc_func _calloc;
+static SDL_realloc_func _realloc;
+static SDL_free_func _free;
+static bool _fail_calloc;
+static bool _fail_realloc;
+
+static void * SDLCALL TestCalloc(size_t count, size_t size)
+{
+    return _fail_calloc ? NULL : _calloc(count, size);
+}
+
+static void * SDLCALL TestRealloc(void * memory, size_t size)
+{
+    return _fail_realloc ? NULL : _realloc(memory, size);
+}
+
+#define CHECK(condition) \
+    do { \
+        if ( !(condition) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __func__, __LINE__, #condition); \
+            _failures++; \
+        } \
+    } while (0)
+
+static Uint32 Random(void)
+{
+    _seed = _seed * 1664525 + 1013904223;
+    return _seed >> 8;
+}
+
+static bool OpenMap(Uint16 w, Uint16 h, Uint8 num_layers)
+{
+    remove(MAP_PATH);
+    _map = (EditorMap){ 0 };
+    if ( !CreateMap(MAP_PATH, w, h, num_layers) || !LoadMap(&_map.map, MAP_PATH) ) {
+        fprintf(stderr, "%s: could not create map\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
+static void CloseMap(void)
+{
+    FreeChangeStack(&_map.undo);
+    FreeChangeStack(&_map.redo);
+    FreeMap(&_map.map);
+}
+
+/// A change with no tiles in it, say from painting a tile with the tile it
+/// already is, followed by shrinking the map.
+static void TestEmptyChangeThenResize(void)
+{
+    if ( !OpenMap(8, 8, 1) ) {
+        _failures++;
+        return;
+    }
+
+    SetMapTile(&_map.map, 7, 3, 0, 5);
+
+    BeginChange(&_map, CHANGE_SET_TILES);
+    AddTileChange(1, 1, 0, 0, 0);
+    EndChange(&_map);
+    CHECK(_map.undo.count == 0);
+
+    RegisterMapSizeChange(&_map, -1, 0);
+    ResizeMap(&_map.map, 7, 8);
+    CHECK(_map.undo.count == 1);
+
+    Undo(&_map);
+    CHECK(_map.map.width == 8);
+    CHECK(GetMapTile(&_map.map, 7, 3, 0) == 5);
+
+    CloseMap();
+}
+
+/// A change whose index can't grow is dropped like one whose list can't,
+/// along with the history before it.
+static void TestIndexCantGrow(void)
+{
+    if ( !OpenMap(256, 4, 1) ) {
+        _failures++;
+        return;
+    }
+
+    BeginChange(&_map, CHANGE_SET_TILES);
+    SetMapTile(&_map.map, 0, 3, 0, 7);
+    AddTileChange(0, 3, 0, 0, 7);
+    EndChange(&_map);
+    CHECK(_map.undo.count == 1);
+
+    BeginChange(&_map, CHANGE_SET_TILES);
+    for ( int x = 0; x < 200; x++ ) {
+        SetMapTile(&_map.map, x, 0, 0, 1);
+
+        _fail_calloc = true;
+        AddTileChange(x, 0, 0, 0, 1);
+        _fail_calloc = false;
+    }
+    EndChange(&_map);
+    CHECK(_map.undo.count == 0);
+    CHECK(_map.redo.count == 0);
+    CHECK(UndoMemoryUsed(&_map) == 0);
+
+    CloseMap();
+}
+
+/// A change whose list of tiles can't grow can't be undone, nor can those
+/// before it.
+static void TestChangeCantGrow(void)
+{
+    if ( !OpenMap(64, 4, 1) ) {
+        _failures++;
+        return;
+    }
+
+    BeginChange(&_map, CHANGE_SET_TILES);
+    SetMapTile(&_map.map, 0, 3, 0, 7);
+    AddTileChange(0, 3, 0, 0, 7);
+    EndChange(&_map);
+    CHECK(_map.undo.count == 1);
+
+    BeginChange(&_map, CHANGE_SET_TILES);
+    for ( int x = 0; x < 64; x++ ) {
+        SetMapTile(&_map.map, x, 0, 0, 1);
+
+        _fail_realloc = true;
+        AddTileChange(x, 0, 0, 0, 1);
+        _fail_realloc = false;
+    }
+    EndChange(&_map);
+    CHECK(_map.undo.count == 0);
+    CHECK(_map.redo.count == 0);
+    CHECK(UndoMemoryUsed(&_map) == 0);
+
+    CloseMap();
+}
+
+/// Copy every tile of the map, layer by layer, into `tiles`.
+static void CopyMap(GID * tiles)
+{
+    const Map * m = &_map.map;
+    for ( int l = 0; l < m->num_layers; l++ ) {
+        for ( int y = 0; y < m->height; y++ ) {
+            GetMapRow(m, 0, y, l, tiles, m->width);
+            tiles += m->width;
+        }
+    }
+}
+
+static bool MapMatches(const GID * tiles)
+{
+    const Map * m = &_map.map;
+    for ( int l = 0; l < m->num_layers; l++ ) {
+        for ( int y = 0; y < m->height; y++ ) {
+            for ( int x = 0; x < m->width; x++, tiles++ ) {
+                if ( GetMapTile(m, x, y, l) != *tiles ) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static ChangeType NewestChangeType(void)
+{
+    const ChangeStack * undo = &_map.undo;
+    return undo->changes[(undo->first + undo->count - 1) % undo->capacity].type;
+}
+
+/// Set a tile, recording it before or after as the editor's tools do.
+static void PaintTile(int x, int y, int layer)
+{
+    GID old = GetMapTile(&_map.map, x, y, layer);
+    GID new = (GID)(Random() % 4);
+
+    if ( Random() % 2 ) {
+        AddTileChange(x, y, layer, old, new);
+        SetMapTile(&_map.map, x, y, layer, new);
+    } else {
+        SetMapTile(&_map.map, x, y, layer, new);
+        AddTileChange(x, y, layer, old, new);
+    }
+}
+
+/// Make a random change: tiles painted here and there or all over one
+/// layer, the same tiles on several layers, and flood fills.
+static void MakeRandomChange(void)
+{
+    const Map * m = &_map.map;
+    BeginChange(&_map, CHANGE_SET_TILES);
+
+    int steps = 1 + (int)(Random() % 4);
+    for ( int i = 0; i < steps; i++ ) {
+        int layer = (int)(Random() % m->num_layers);
+        int x = (int)(Random() % m->width);
+        int y = (int)(Random() % m->height);
+
+        switch ( Random() % 4 ) {
+            case 0: { // Scattered tiles, many of them painted again.
+                int count = (int)(Random() % 200);
+                for ( int t = 0; t < count; t++ ) {
+                    PaintTile((int)(Random() % 16), (int)(Random() % 16), layer);
+                }
+                break;
+            }
+            case 1: { // Enough tiles for the list to become a region.
+                for ( int ty = 0; ty < m->height; ty++ ) {
+                    for ( int tx = 0; tx < m->width; tx++ ) {
+                        if ( Random() % 4 ) {
+                            PaintTile(tx, ty, layer);
+                        }
+                    }
+                }
+                break;
+            }
+            case 2: // The same tile on every layer, twice.
+                for ( int t = 0; t < 2 * m->num_layers; t++ ) {
+                    PaintTile(x, y, t % m->num_layers);
+                }
+                break;
+            case 3:
+                FloodFillMap(&_map.map, x, y, layer, (GID)(Random() % 4),
+                             AddTileRunChange);
+                break;
+        }
+    }
+
+    EndChange(&_map);
+}
+
+#define HISTORY 8 // Random changes kept track of to undo back through.
+
+/// Make random changes, undoing and redoing them, and some of those before
+/// them, checking the map against copies taken after each.
+static void TestRandomChanges(void)
+{
+    if ( !OpenMap(96, 80, 3) ) {
+        _failures++;
+        return;
+    }
+
+    SetUndoMemoryBudget(0);
+
+    size_t num_tiles = 96 * 80 * 3;
+    GID * copies = malloc((HISTORY + 1) * num_tiles * sizeof(GID));
+    int num_copies = 1;
+    int num_regions = 0;
+    CopyMap(copies);
+
+    for ( int i = 0; i < 300 && _failures == 0; i++ ) {
+        int count = _map.undo.count;
+        MakeRandomChange();
+
+        if ( _map.undo.count == count ) {
+            CHECK(MapMatches(&copies[(size_t)(num_copies - 1) * num_tiles]));
+            continue;
+        }
+
+        num_regions += NewestChangeType() == CHANGE_SET_REGION;
+        if ( num_copies == HISTORY + 1 ) {
+            memmove(copies, copies + num_tiles, HISTORY * num_tiles * sizeof(GID));
+            num_copies--;
+        }
+        CopyMap(&copies[(size_t)num_copies++ * num_tiles]);
+
+        // Undo and redo only move changes between the stacks.
+        size_t used = UndoMemoryUsed(&_map);
+        int steps = 1 + (int)(Random() % (Uint32)(num_copies - 1));
+
+        for ( int s = 1; s <= steps; s++ ) {
+            Undo(&_map);
+            CHECK(MapMatches(&copies[(size_t)(num_copies - 1 - s) * num_tiles]));
+        }
+        CHECK(_map.redo.count == steps);
+
+        for ( int s = steps - 1; s >= 0; s-- ) {
+            Redo(&_map);
+            CHECK(MapMatches(&copies[(size_t)(num_copies - 1 - s) * num_tiles]));
+        }
+        CHECK(_map.redo.count == 0);
+        CHECK(UndoMemoryUsed(&_map) == used);
+    }
+
+    CHECK(num_regions > 0);
+    CHECK(num_regions < _map.undo.count);
+
+    free(copies);
+    SetUndoMemoryBudget(DEFAULT_UNDO_BUDGET);
+    CloseMap();
+}
+
+/// Keep making changes over budget: the oldest are dropped, those kept can
+/// all be undone and redone, and the newest is kept even on its own over.
+static void TestBudget(void)
+{
+    if ( !OpenMap(64, 64, 2) ) {
+        _failures++;
+        return;
+    }
+
+    size_t budget = 64 * 1024;
+    SetUndoMemoryBudget(budget);
+
+    for ( int i = 1; i <= 100; i++ ) {
+        BeginChange(&_map, CHANGE_SET_TILES);
+        for ( int t = 0; t < 500; t++ ) {
+            PaintTile((int)(Random() % 64), (int)(Random() % 64), t % 2);
+        }
+        EndChange(&_map);
+        CHECK(UndoMemoryUsed(&_map) <= budget);
+    }
+    CHECK(_map.undo.count > 1);
+    CHECK(_map.undo.count < 100);
+
+    GID * newest = malloc(64 * 64 * 2 * sizeof(GID));
+    CopyMap(newest);
+
+    int kept = _map.undo.count;
+    while ( _map.undo.count > 0 ) {
+        Undo(&_map);
+    }
+    CHECK(_map.redo.count == kept);
+
+    while ( _map.redo.count > 0 ) {
+        Redo(&_map);
+    }
+    CHECK(MapMatches(newest));
+    free(newest);
+
+    // A change bigger than the budget replaces the whole history.
+    BeginChange(&_map, CHANGE_SET_TILES);
+    for ( int y = 0; y < 64; y++ ) {
+        for ( int x = 0; x < 64; x++ ) {
+            for ( int l = 0; l < 2; l++ ) {
+                GID old = GetMapTile(&_map.map, x, y, l);
+                SetMapTile(&_map.map, x, y, l, (GID)(old + 1));
+                AddTileChange(x, y, l, old, (GID)(old + 1));
+            }
+        }
+    }
+    EndChange(&_map);
+    CHECK(_map.undo.count == 1);
+
+    SetUndoMemoryBudget(DEFAULT_UNDO_BUDGET);
+    CloseMap();
+}
+
+int main(void)
+{
+    SDL_GetOriginalMemoryFunctions(&_malloc, &_calloc, &_realloc, &_free);
+    SDL_SetMemoryFunctions(_malloc, TestCalloc, TestRealloc, _free);
+
+    TestEmptyChangeThenResize();
+    TestIndexCantGrow();
+    TestChangeCantGrow();
+    TestRandomChanges();
+    TestBudget();
+
+    remove(MAP_PATH);
+
+    if ( _failures > 0 ) {
+        fprintf(stderr, "%d checks failed\n", _failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All tests passed\n");
+    return EXIT_SUCCESS;
+}